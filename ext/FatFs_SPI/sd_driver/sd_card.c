@@ -105,10 +105,12 @@ specific language governing permissions and limitations under the License.
  * just always use the Standard Capacity cards with a block size of 512 bytes.
  * This is set with CMD16.
  *
- * You can read and write single blocks (CMD17, CMD25) or multiple blocks
- * (CMD18, CMD25). For simplicity, I'll just use single block accesses. When
- * the card gets a read command, it responds with a response token, and then
- * a data token or an error.
+ * You can read and write single blocks (CMD17, CMD24) or multiple blocks
+ * (CMD18, CMD25). Requests for more than one block use the multiple block
+ * commands, so that a command and response are only paid once per request
+ * rather than once per block; disk_read() and disk_write() in glue.c pass the
+ * sector count of FatFs through. When the card gets a read command, it
+ * responds with a response token, and then a data token or an error.
  *
  * SPI Command Format
  * ------------------
@@ -886,12 +888,62 @@ static int in_sd_read_blocks(sd_card_t *pSD, uint8_t *buffer,
     return rd_status ? rd_status : status;
 }
 
+/*
+ * The SPI clock for data transfer is negotiated once the card is initialised.
+ * Starting from the baud rate configured for the SPI, each lower rate that the
+ * SPI can generate is tried until block 0 reads back several times identically
+ * to a read at the initialisation clock, with valid CRCs. Transfers that later
+ * fail step the clock down further and are retried.
+ */
+#define SD_NEGOTIATE_READS 4
+#define SD_MIN_DATA_FREQUENCY (5 * 1000 * 1000)
+
+static bool sd_is_transfer_error(int status) {
+    return SD_BLOCK_DEVICE_ERROR_CRC == status ||
+           SD_BLOCK_DEVICE_ERROR_NO_RESPONSE == status ||
+           SD_BLOCK_DEVICE_ERROR_WRITE == status;
+}
+
+static bool sd_step_down_frequency(sd_card_t *pSD) {
+    if (pSD->baud_rate <= SD_MIN_DATA_FREQUENCY) return false;
+    pSD->baud_rate = sd_spi_set_frequency(pSD, pSD->baud_rate - 1);
+    DBG_PRINTF("SD card clock lowered to %u Hz\r\n", pSD->baud_rate);
+    return true;
+}
+
+static void sd_negotiate_frequency(sd_card_t *pSD) {
+    static uint8_t reference[BLOCK_SIZE_HC];
+    static uint8_t readback[BLOCK_SIZE_HC];
+    uint baud_rate = pSD->spi->baud_rate;
+
+    if (SD_BLOCK_DEVICE_ERROR_NONE != in_sd_read_blocks(pSD, reference, 0, 1)) {
+        // Nothing to compare with: use the configured clock.
+        pSD->baud_rate = sd_spi_set_frequency(pSD, baud_rate);
+        return;
+    }
+    for (;;) {
+        bool ok = true;
+
+        pSD->baud_rate = sd_spi_set_frequency(pSD, baud_rate);
+        for (int i = 0; ok && i < SD_NEGOTIATE_READS; ++i) {
+            ok = SD_BLOCK_DEVICE_ERROR_NONE ==
+                     in_sd_read_blocks(pSD, readback, 0, 1) &&
+                 0 == memcmp(reference, readback, sizeof readback);
+        }
+        if (ok || pSD->baud_rate <= SD_MIN_DATA_FREQUENCY) break;
+        baud_rate = pSD->baud_rate - 1;
+    }
+    DBG_PRINTF("SD card clock: %u Hz\r\n", pSD->baud_rate);
+}
+
 int sd_read_blocks(sd_card_t *pSD, uint8_t *buffer, uint64_t ulSectorNumber,
                    uint32_t ulSectorCount) {
     sd_acquire(pSD);
     TRACE_PRINTF("sd_read_blocks(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
                  ulSectorNumber, ulSectorCount);
     int status = in_sd_read_blocks(pSD, buffer, ulSectorNumber, ulSectorCount);
+    while (sd_is_transfer_error(status) && sd_step_down_frequency(pSD))
+        status = in_sd_read_blocks(pSD, buffer, ulSectorNumber, ulSectorCount);
     sd_release(pSD);
     return status;
 }
@@ -1018,6 +1070,8 @@ int sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
     TRACE_PRINTF("sd_write_blocks(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
                  ulSectorNumber, blockCnt);
     int status = in_sd_write_blocks(pSD, buffer, ulSectorNumber, blockCnt);
+    while (sd_is_transfer_error(status) && sd_step_down_frequency(pSD))
+        status = in_sd_write_blocks(pSD, buffer, ulSectorNumber, blockCnt);
     sd_release(pSD);
     return status;
 }
@@ -1178,12 +1232,12 @@ int sd_init(sd_card_t *pSD) {
         sd_unlock(pSD);
         return pSD->m_Status;
     }
-    // Set SCK for data transfer
-    sd_spi_go_high_frequency(pSD);
-
     // The card is now initialized
     pSD->m_Status &= ~STA_NOINIT;
 
+    // Set SCK for data transfer
+    sd_negotiate_frequency(pSD);
+
     sd_spi_release(pSD);
     sd_unlock(pSD);
 
@@ -50,6 +50,7 @@ typedef struct {
     int m_Status;                                    // Card status
     uint64_t sectors;                                // Assigned dynamically
     int card_type;                                   // Assigned dynamically
+    uint baud_rate;                                  // Negotiated SPI clock for data transfer
     mutex_t mutex;
     FATFS fatfs;
     bool mounted;
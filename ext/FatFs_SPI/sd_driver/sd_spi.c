@@ -31,6 +31,12 @@ void sd_spi_go_high_frequency(sd_card_t *pSD) {
     uint actual = spi_set_baudrate(pSD->spi->hw_inst, pSD->spi->baud_rate);
     TRACE_PRINTF("%s: Actual frequency: %lu\n", __FUNCTION__, (long)actual);
 }
+// Returns the actual frequency, which is the closest not above baud_rate.
+uint sd_spi_set_frequency(sd_card_t *pSD, uint baud_rate) {
+    uint actual = spi_set_baudrate(pSD->spi->hw_inst, baud_rate);
+    TRACE_PRINTF("%s: Actual frequency: %lu\n", __FUNCTION__, (long)actual);
+    return actual;
+}
 void sd_spi_go_low_frequency(sd_card_t *pSD) {
     uint actual = spi_set_baudrate(pSD->spi->hw_inst, 400 * 1000); // Actual frequency: 398089
     TRACE_PRINTF("%s: Actual frequency: %lu\n", __FUNCTION__, (long)actual);
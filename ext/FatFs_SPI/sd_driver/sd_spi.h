@@ -27,6 +27,7 @@ void sd_spi_acquire(sd_card_t *pSD);
 void sd_spi_release(sd_card_t *pSD);
 void sd_spi_go_low_frequency(sd_card_t *this);
 void sd_spi_go_high_frequency(sd_card_t *this);
+uint sd_spi_set_frequency(sd_card_t *this, uint baud_rate);
 
 /* 
 After power up, the host starts the clock and sends the initializing sequence on the CMD line. 
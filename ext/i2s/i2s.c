@@ -23,6 +23,42 @@
  */
 
 #include "i2s.h"
+#include <hardware/irq.h>
+
+/* I2S context of the DMA interrupt handler */
+static i2s_config_t *i2s_dma_config = NULL;
+
+static inline uint16_t *i2s_dma_buffer(const i2s_config_t *i2s_config, uint32_t n) {
+    return i2s_config->dma_buf + (n % i2s_config->dma_buf_count) * i2s_config->dma_trans_count * 2;
+}
+
+/**
+ * Start the next committed buffer when the previous one has been played,
+ * or stop if the ring is empty. Called in interrupt context.
+ */
+static void __isr i2s_dma_irq_handler(void) {
+    i2s_config_t *i2s_config = i2s_dma_config;
+    const uint32_t mask = 1u << i2s_config->dma_channel;
+
+    /* DMA_IRQ_0 is shared with the SD card driver */
+    if (!(dma_hw->ints0 & mask)) return;
+    dma_hw->ints0 = mask;
+    spin_lock_unsafe_blocking(i2s_config->dma_lock);
+    i2s_config->dma_tail++;
+
+    if(i2s_config->dma_tail != i2s_config->dma_head) {
+        dma_channel_transfer_from_buffer_now(i2s_config->dma_channel,
+                                             i2s_dma_buffer(i2s_config, i2s_config->dma_tail),
+                                             i2s_config->dma_trans_count);
+    } else {
+        i2s_config->dma_playing = false;
+        i2s_config->underruns++;
+    }
+    spin_unlock_unsafe(i2s_config->dma_lock);
+
+    /* Wake up a producer waiting for a free buffer */
+    __sev();
+}
 
 /**
  * return the default i2s context used to store information about the setup
@@ -39,11 +75,28 @@ i2s_config_t i2s_get_default_config(void) {
         .dma_buf = NULL,
         .dma_trans_count = 0,
         .volume = 0,
+        .dma_buf_count = 3,
+        .dma_head = 0,
+        .dma_tail = 0,
+        .dma_playing = false,
+        .underruns = 0,
+        .dma_lock = NULL,
 	};
 
     return i2s_config;
 }
 
+/**
+ * Derive the PIO clock divider from the system clock. Must be called again
+ * whenever the system clock changes, for the sample rate to stay the same.
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ */
+void i2s_update_clock(const i2s_config_t *i2s_config) {
+    uint32_t system_clock_frequency = clock_get_hz(clk_sys);
+    uint32_t divider = system_clock_frequency * 4 / i2s_config->sample_freq; // avoid arithmetic overflow
+    pio_sm_set_clkdiv_int_frac(i2s_config->pio, i2s_config->sm , divider >> 8u, divider & 0xffu);
+}
+
 /**
  * Initialize the I2S driver. Must be called before calling i2s_write or i2s_dma_write
  * i2s_config: I2S context obtained by i2s_get_default_config()
@@ -61,14 +114,14 @@ void i2s_init(i2s_config_t *i2s_config) {
     audio_i2s_program_init(i2s_config->pio, i2s_config->sm , offset, i2s_config->data_pin , i2s_config->clock_pin_base);
     
     /* Set PIO clock */
-    uint32_t system_clock_frequency = clock_get_hz(clk_sys);
-    uint32_t divider = system_clock_frequency * 4 / i2s_config->sample_freq; // avoid arithmetic overflow
-    pio_sm_set_clkdiv_int_frac(i2s_config->pio, i2s_config->sm , divider >> 8u, divider & 0xffu);
+    i2s_update_clock(i2s_config);
 
     pio_sm_set_enabled(i2s_config->pio, i2s_config->sm, false);
 
-    /* Allocate memory for the DMA buffer */
-    i2s_config->dma_buf=malloc(i2s_config->dma_trans_count*sizeof(uint32_t));
+    /* Allocate memory for the ring of DMA buffers */
+    if(i2s_config->dma_buf_count<2) i2s_config->dma_buf_count=2;
+    i2s_config->dma_buf=calloc(i2s_config->dma_buf_count,
+                               i2s_config->dma_trans_count*sizeof(uint32_t));
 
     /* Direct Memory Access setup */
     i2s_config->dma_channel = dma_claim_unused_channel(true);
@@ -86,6 +139,14 @@ void i2s_init(i2s_config_t *i2s_config) {
                           false                                       // Start immediately
     );
 
+    /* Re-arm the next buffer of the ring on completion */
+    i2s_config->dma_lock = spin_lock_init(spin_lock_claim_unused(true));
+    i2s_dma_config = i2s_config;
+    dma_channel_set_irq0_enabled(i2s_config->dma_channel, true);
+    irq_add_shared_handler(DMA_IRQ_0, i2s_dma_irq_handler,
+                           PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_0, true);
+
     pio_sm_set_enabled(i2s_config->pio, i2s_config->sm , true);
 }
 
@@ -104,26 +165,64 @@ void i2s_write(const i2s_config_t *i2s_config,const int16_t *samples,const size_
 }
 
 /**
- * Write samples to DMA buffer and initiate DMA transfer (non blocking)
+ * Return whether a buffer of the DMA ring is free, in which case
+ * i2s_dma_get_buffer() returns without waiting.
  * i2s_config: I2S context obtained by i2s_get_default_config()
- *     sample: pointer to an array of dma_trans_count x 32 bits samples
  */
-void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples) {
-    /* Wait the completion of the previous DMA transfer */
-    dma_channel_wait_for_finish_blocking(i2s_config->dma_channel);
-    /* Copy samples into the DMA buffer */
-    if(i2s_config->volume==0) {
-        memcpy(i2s_config->dma_buf,samples,i2s_config->dma_trans_count*sizeof(int32_t));
-    } else {
+bool i2s_dma_buffer_free(const i2s_config_t *i2s_config) {
+    return i2s_config->dma_head - i2s_config->dma_tail != i2s_config->dma_buf_count;
+}
+
+/**
+ * Return the next free buffer of the DMA ring, waiting for one to be played
+ * if all are in use. The buffer must be filled with dma_trans_count x 32 bits
+ * samples, then passed to the DMA with i2s_dma_commit().
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ */
+int16_t *i2s_dma_get_buffer(i2s_config_t *i2s_config) {
+    while(!i2s_dma_buffer_free(i2s_config)) {
+        __wfe();
+    }
+
+    return (int16_t *)i2s_dma_buffer(i2s_config, i2s_config->dma_head);
+}
+
+/**
+ * Queue the buffer returned by i2s_dma_get_buffer() for playing (non blocking)
+ * The volume is applied in place. May be called from either core.
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ */
+void i2s_dma_commit(i2s_config_t *i2s_config) {
+    int16_t *samples = (int16_t *)i2s_dma_buffer(i2s_config, i2s_config->dma_head);
+    uint32_t irq;
+
+    if(i2s_config->volume!=0) {
         for(uint16_t i=0;i<i2s_config->dma_trans_count*2;i++) {
-            i2s_config->dma_buf[i] = samples[i]>>i2s_config->volume;
+            samples[i] >>= i2s_config->volume;
         }
     }
-    
-    /* Initiate the DMA transfer */
-    dma_channel_transfer_from_buffer_now(i2s_config->dma_channel,
-                                         i2s_config->dma_buf,
-                                         i2s_config->dma_trans_count);
+
+    irq = spin_lock_blocking(i2s_config->dma_lock);
+    i2s_config->dma_head++;
+    /* Restart the DMA if the ring ran empty */
+    if(!i2s_config->dma_playing) {
+        i2s_config->dma_playing = true;
+        dma_channel_transfer_from_buffer_now(i2s_config->dma_channel,
+                                             i2s_dma_buffer(i2s_config, i2s_config->dma_tail),
+                                             i2s_config->dma_trans_count);
+    }
+    spin_unlock(i2s_config->dma_lock, irq);
+}
+
+/**
+ * Copy samples to the DMA ring and queue them for playing (non blocking)
+ * Only waits if all buffers of the ring are in use.
+ * i2s_config: I2S context obtained by i2s_get_default_config()
+ *     sample: pointer to an array of dma_trans_count x 32 bits samples
+ */
+void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples) {
+    memcpy(i2s_dma_get_buffer(i2s_config),samples,i2s_config->dma_trans_count*sizeof(int32_t));
+    i2s_dma_commit(i2s_config);
 }
 
 /**
@@ -29,6 +29,7 @@
 #include <hardware/pio.h>
 #include <hardware/clocks.h>
 #include <hardware/dma.h>
+#include <hardware/sync.h>
 #include "audio_i2s.pio.h"
 
 typedef struct i2s_config 
@@ -43,13 +44,24 @@ typedef struct i2s_config
     uint16_t dma_trans_count;
     uint16_t *dma_buf;
     uint8_t volume;
+    /* Ring of dma_buf_count buffers of dma_trans_count samples, played in turn */
+    uint8_t dma_buf_count;
+    volatile uint32_t dma_head;     // Number of buffers committed
+    volatile uint32_t dma_tail;     // Number of buffers played
+    volatile bool dma_playing;
+    volatile uint32_t underruns;    // Number of times the ring ran empty while playing
+    spin_lock_t *dma_lock;          // Allows buffers to be committed from either core
 } i2s_config_t;
 
 
 i2s_config_t i2s_get_default_config(void);
 void i2s_init(i2s_config_t *i2s_config);
+void i2s_update_clock(const i2s_config_t *i2s_config);
 void i2s_write(const i2s_config_t *i2s_config,const int16_t *samples,const size_t len);
 void i2s_dma_write(i2s_config_t *i2s_config,const int16_t *samples);
+bool i2s_dma_buffer_free(const i2s_config_t *i2s_config);
+int16_t *i2s_dma_get_buffer(i2s_config_t *i2s_config);
+void i2s_dma_commit(i2s_config_t *i2s_config);
 void i2s_volume(i2s_config_t *i2s_config,uint8_t volume);
 void i2s_increase_volume(i2s_config_t *i2s_config);
 void i2s_decrease_volume(i2s_config_t *i2s_config);
@@ -70,10 +70,14 @@ static struct chan {
 	uint8_t volume_init;
 
 	uint16_t freq;
+	/* Phase of the channel, and its increment per sample, in steps of the
+	 * duty cycle, wave position or LFSR as 16.16 fixed point. */
 	uint32_t freq_counter;
 	uint32_t freq_inc;
 
 	int_fast16_t val;
+	/* Left and right output gain, combining channel volume and panning. */
+	int_fast16_t gain_l, gain_r;
 
 	struct chan_len_ctr    len;
 	struct chan_vol_env    env;
@@ -97,12 +101,158 @@ static struct chan {
 
 static int32_t vol_l, vol_r;
 
-static void set_note_freq(struct chan *c, const uint32_t freq)
+/* Phase increments per sample in 16.16 fixed point, before dividing by the
+ * channel's frequency divider. Square channels step the duty cycle 8 times per
+ * period of 4 * 8 * (2048 - freq) cycles, the wave channel steps 32 times per
+ * period of 2 * 32 * (2048 - freq) cycles, and the noise channel steps the LFSR
+ * once per divider period. */
+#define SQUARE_PHASE_INC	((uint32_t)(DMG_CLOCK_FREQ * 65536.0 / (4.0 * AUDIO_SAMPLE_RATE)))
+#define WAVE_PHASE_INC		((uint32_t)(DMG_CLOCK_FREQ * 65536.0 / (2.0 * AUDIO_SAMPLE_RATE)))
+#define NOISE_PHASE_INC		((uint32_t)(DMG_CLOCK_FREQ * 65536.0 / AUDIO_SAMPLE_RATE))
+
+/**
+ * Set the phase increment of a channel from its frequency registers. Called
+ * when they change, so that samples are generated without division.
+ */
+static void set_note_freq(const uint_fast8_t i)
+{
+	struct chan *c = chans + i;
+
+	switch (i) {
+	case 0:
+	case 1:
+		if (c->freq <= 2047)
+			c->freq_inc = SQUARE_PHASE_INC / (2048 - c->freq);
+		break;
+
+	case 2:
+		c->freq_inc = WAVE_PHASE_INC / (2048 - c->freq);
+		break;
+
+	case 3: {
+		const uint8_t lfsr_div_lut[] = {
+			8, 16, 32, 48, 64, 80, 96, 112
+		};
+
+		/* The channel is disabled for shifts of 14 and 15. */
+		c->freq_inc = NOISE_PHASE_INC /
+			((uint32_t)lfsr_div_lut[c->noise.lfsr_div] << (c->freq & 0x0F));
+		break;
+	}
+	}
+}
+
+/**
+ * Set the output gain of a channel from its volume and panning.
+ */
+static void set_gain(struct chan *c)
+{
+	c->gain_l = c->on_left  ? c->volume * vol_l : 0;
+	c->gain_r = c->on_right ? c->volume * vol_r : 0;
+}
+
+/**
+ * Mix a sample into the stereo output, applying the gain of the channel.
+ */
+static inline void mix_sample(int16_t *samples, const struct chan *c,
+		const int32_t sample)
 {
-	/* Lowest expected value of freq is 64. */
-	c->freq_inc = freq * (uint32_t)(FREQ_INC_REF / AUDIO_SAMPLE_RATE);
+	samples[0] += (sample * c->gain_l) >> 2;
+	samples[1] += (sample * c->gain_r) >> 2;
 }
 
+#if MINIGB_APU_SYNTH == MINIGB_APU_SYNTH_BLEP
+#define BLEP_TAPS		8
+#define BLEP_PHASES		16
+
+/* Largest phase increments that are band-limited. Square channels make two
+ * changes per period of 8 steps, so a period of at least 2 samples is at most
+ * one change per sample. Noise changes at most once per step. */
+#define BLEP_SQUARE_MAX_INC	(4u << 16)
+#define BLEP_NOISE_MAX_INC	(1u << 16)
+
+/* Residual of a band-limited step from an ideal step, in 2.14 fixed point,
+ * for a change made (phase + 0.5) / BLEP_PHASES samples before each of the
+ * following BLEP_TAPS samples. The step is the integral of a Blackman windowed
+ * sinc with a cutoff of 0.42 times the sample rate, centred 4 samples after
+ * the change. */
+static const int16_t blep_residual[BLEP_PHASES][BLEP_TAPS] = {
+	{ -16384, -16357, -16427, -17053,  -7763,    790,     -4,    -20 },
+	{ -16384, -16348, -16483, -16881,  -6909,    866,    -41,    -14 },
+	{ -16384, -16339, -16549, -16653,  -6064,    903,    -70,    -10 },
+	{ -16384, -16328, -16624, -16369,  -5247,    904,    -89,     -6 },
+	{ -16384, -16317, -16706, -16024,  -4462,    877,   -101,     -3 },
+	{ -16384, -16306, -16794, -15616,  -3716,    828,   -107,     -1 },
+	{ -16385, -16296, -16885, -15143,  -3012,    760,   -108,      0 },
+	{ -16385, -16287, -16976, -14611,  -2364,    680,   -104,      0 },
+	{ -16384, -16280, -17064, -14020,  -1773,    592,    -97,      1 },
+	{ -16384, -16276, -17144, -13372,  -1241,    501,    -88,      1 },
+	{ -16383, -16277, -17212, -12668,   -768,    410,    -78,      0 },
+	{ -16381, -16283, -17261, -11922,   -360,    322,    -67,      0 },
+	{ -16378, -16295, -17288, -11137,    -15,    240,    -56,      0 },
+	{ -16374, -16314, -17287, -10320,    269,    165,    -45,      0 },
+	{ -16370, -16343, -17250,  -9475,    497,     99,    -36,      0 },
+	{ -16364, -16380, -17174,  -8621,    669,     43,    -27,      0 },
+};
+
+/* Residuals due after the last generated sample, as stereo pairs. */
+static int32_t blep_carry[BLEP_TAPS][2];
+
+/**
+ * Band-limit a change in value of a channel by mixing in the step residual.
+ * \param samples	Interleaved samples up to "end".
+ * \param i		First sample following the change.
+ * \param delta	Change in value, before gain.
+ * \param phase	Time from the change to sample "i", in 1/BLEP_PHASES
+ *			samples.
+ */
+static void blep_add(int16_t *samples, const uint_fast16_t i,
+		const uint_fast16_t end, const struct chan *c,
+		const int32_t delta, const uint_fast8_t phase)
+{
+	const int16_t *r = blep_residual[phase];
+	const int32_t dl = (delta * c->gain_l) >> 2;
+	const int32_t dr = (delta * c->gain_r) >> 2;
+	uint_fast16_t k = 0;
+	uint_fast16_t n = (end - i) / 2;
+
+	if (n > BLEP_TAPS)
+		n = BLEP_TAPS;
+
+	for (; k < n; k++) {
+		samples[i + k * 2 + 0] += (dl * r[k]) >> 14;
+		samples[i + k * 2 + 1] += (dr * r[k]) >> 14;
+	}
+
+	for (; k < BLEP_TAPS; k++) {
+		blep_carry[k - n][0] += (dl * r[k]) >> 14;
+		blep_carry[k - n][1] += (dr * r[k]) >> 14;
+	}
+}
+
+/**
+ * Mix the residuals left over from previous samples into the start of the
+ * interleaved samples between "start" and "end".
+ */
+static void blep_flush(int16_t *samples, const uint_fast16_t start,
+		const uint_fast16_t end)
+{
+	uint_fast16_t n = (end - start) / 2;
+	uint_fast16_t k;
+
+	if (n > BLEP_TAPS)
+		n = BLEP_TAPS;
+
+	for (k = 0; k < n; k++) {
+		samples[start + k * 2 + 0] += blep_carry[k][0];
+		samples[start + k * 2 + 1] += blep_carry[k][1];
+	}
+
+	memmove(blep_carry, blep_carry + n, (BLEP_TAPS - n) * sizeof(*blep_carry));
+	memset(blep_carry + BLEP_TAPS - n, 0, n * sizeof(*blep_carry));
+}
+#endif
+
 static void chan_enable(const uint_fast8_t i, const bool enable)
 {
 	uint8_t val;
@@ -127,6 +277,7 @@ static void update_env(struct chan *c)
 				c->env.inc = 0;
 			}
 			c->volume = MAX(0, MIN(MAX_CHAN_VOLUME, c->volume));
+			set_gain(c);
 		}
 		c->env.counter -= FREQ_INC_REF;
 	}
@@ -144,19 +295,19 @@ static void update_len(struct chan *c)
 	}
 }
 
-static bool update_freq(struct chan *c, uint32_t *pos)
+/**
+ * Advance the phase of a channel by one sample.
+ * \return	Number of steps taken during the sample.
+ */
+static inline uint_fast16_t update_freq(struct chan *c)
 {
-	uint32_t inc = c->freq_inc - *pos;
-	c->freq_counter += inc;
+	uint_fast16_t steps;
 
-	if (c->freq_counter > FREQ_INC_REF) {
-		*pos		= c->freq_inc - (c->freq_counter - FREQ_INC_REF);
-		c->freq_counter = 0;
-		return true;
-	} else {
-		*pos = c->freq_inc;
-		return false;
-	}
+	c->freq_counter += c->freq_inc;
+	steps = c->freq_counter >> 16;
+	c->freq_counter &= 0xFFFF;
+
+	return steps;
 }
 
 static void update_sweep(struct chan *c)
@@ -173,9 +324,7 @@ static void update_sweep(struct chan *c)
 			if (c->freq > 2047) {
 				c->enabled = 0;
 			} else {
-				set_note_freq(c,
-					DMG_CLOCK_FREQ_U / ((2048 - c->freq)<< 5));
-				c->freq_inc *= 8;
+				set_note_freq(0);
 			}
 		} else if (c->sweep.rate) {
 			c->enabled = 0;
@@ -184,19 +333,19 @@ static void update_sweep(struct chan *c)
 	}
 }
 
-static void update_square(int16_t* samples, const bool ch2)
+static void update_square(int16_t* samples, const bool ch2,
+		const uint_fast16_t start, const uint_fast16_t end)
 {
-	uint32_t freq;
 	struct chan* c = chans + ch2;
 
 	if (!c->powered || !c->enabled)
 		return;
 
-	freq = DMG_CLOCK_FREQ_U / ((2048 - c->freq) << 5);
-	set_note_freq(c, freq);
-	c->freq_inc *= 8;
+	set_gain(c);
+
+	for (uint_fast16_t i = start; i < end; i += 2) {
+		uint_fast16_t steps;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
 		update_len(c);
 
 		if (!c->enabled)
@@ -206,28 +355,53 @@ static void update_square(int16_t* samples, const bool ch2)
 		if (!ch2)
 			update_sweep(c);
 
-		uint32_t pos = 0;
-		uint32_t prev_pos = 0;
-		int32_t sample = 0;
+		steps = update_freq(c);
+#if MINIGB_APU_SYNTH == MINIGB_APU_SYNTH_BLEP
+		if (steps && c->freq_inc > BLEP_SQUARE_MAX_INC) {
+			/* Too high to be heard: play the average level. */
+			const int_fast8_t high =
+				__builtin_popcount(c->square.duty);
+
+			c->square.duty_counter =
+				(c->square.duty_counter + steps) & 7;
+			c->val = (high * (VOL_INIT_MAX / MAX_CHAN_VOLUME) +
+				(8 - high) * (VOL_INIT_MIN / MAX_CHAN_VOLUME)) / 8;
+		} else {
+			/* Steps taken in this sample, from the earliest. */
+			while (steps--) {
+				int_fast16_t val;
+
+				c->square.duty_counter =
+					(c->square.duty_counter + 1) & 7;
+				val = (c->square.duty & (1 << c->square.duty_counter)) ?
+					VOL_INIT_MAX / MAX_CHAN_VOLUME :
+					VOL_INIT_MIN / MAX_CHAN_VOLUME;
+
+				if (val == c->val)
+					continue;
 
-		while (update_freq(c, &pos)) {
-			c->square.duty_counter = (c->square.duty_counter + 1) & 7;
-			sample += ((pos - prev_pos) / c->freq_inc) * c->val;
+				if (!c->muted) {
+					blep_add(samples, i, end, c, val - c->val,
+						((c->freq_counter + (steps << 16)) *
+						 BLEP_PHASES) / c->freq_inc);
+				}
+				c->val = val;
+			}
+		}
+#else
+		if (steps) {
+			c->square.duty_counter =
+				(c->square.duty_counter + steps) & 7;
 			c->val = (c->square.duty & (1 << c->square.duty_counter)) ?
 				VOL_INIT_MAX / MAX_CHAN_VOLUME :
 				VOL_INIT_MIN / MAX_CHAN_VOLUME;
-			prev_pos = pos;
 		}
+#endif
 
 		if (c->muted)
 			continue;
 
-		sample += c->val;
-		sample *= c->volume;
-		sample /= 4;
-
-		samples[i + 0] += sample * c->on_left * vol_l;
-		samples[i + 1] += sample * c->on_right * vol_r;
+		mix_sample(samples + i, c, c->val);
 	}
 }
 
@@ -244,81 +418,53 @@ static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
 	return volume ? (sample >> (volume - 1)) : 0;
 }
 
-static void update_wave(int16_t *samples)
+static void update_wave(int16_t *samples,
+		const uint_fast16_t start, const uint_fast16_t end)
 {
-	uint32_t freq;
 	struct chan *c = chans + 2;
 
 	if (!c->powered || !c->enabled)
 		return;
 
-	freq = (DMG_CLOCK_FREQ_U / 64) / (2048 - c->freq);
-	set_note_freq(c, freq);
+	/* The wave channel volume is a shift, applied to the sample below. */
+	c->gain_l = c->on_left  ? vol_l : 0;
+	c->gain_r = c->on_right ? vol_r : 0;
 
-	c->freq_inc *= 32;
+	for (uint_fast16_t i = start; i < end; i += 2) {
+		int32_t sample;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
 		update_len(c);
 
 		if (!c->enabled)
 			continue;
 
-		uint32_t pos      = 0;
-		uint32_t prev_pos = 0;
-		int32_t sample   = 0;
+		c->val = (c->val + update_freq(c)) & 31;
 
-		c->wave.sample = wave_sample(c->val, c->volume);
-
-		while (update_freq(c, &pos)) {
-			c->val = (c->val + 1) & 31;
-			sample += ((pos - prev_pos) / c->freq_inc) *
-				((int)c->wave.sample - 8) * (INT16_MAX/64);
-			c->wave.sample = wave_sample(c->val, c->volume);
-			prev_pos  = pos;
-		}
-
-		sample += ((int)c->wave.sample - 8) * (int)(INT16_MAX/64);
-
-		if (c->volume == 0)
-			continue;
-
-		{
-			/* First element is unused. */
-			int16_t div[] = { INT16_MAX, 1, 2, 4 };
-			sample = sample / (div[c->volume]);
-		}
-
-		if (c->muted)
+		if (c->volume == 0 || c->muted)
 			continue;
 
-		sample /= 4;
-
-		samples[i + 0] += sample * c->on_left * vol_l;
-		samples[i + 1] += sample * c->on_right * vol_r;
+		c->wave.sample = wave_sample(c->val, c->volume);
+		sample = ((int)c->wave.sample - 8) * (int)(INT16_MAX/64);
+		mix_sample(samples + i, c, sample >> (c->volume - 1));
 	}
 }
 
-static void update_noise(int16_t *samples)
+static void update_noise(int16_t *samples,
+		const uint_fast16_t start, const uint_fast16_t end)
 {
 	struct chan *c = chans + 3;
 
 	if (!c->powered)
 		return;
 
-	{
-		const uint32_t lfsr_div_lut[] = {
-			8, 16, 32, 48, 64, 80, 96, 112
-		};
-		uint32_t freq;
-
-		freq = DMG_CLOCK_FREQ_U / (lfsr_div_lut[c->noise.lfsr_div] << c->freq);
-		set_note_freq(c, freq);
-	}
-
 	if (c->freq >= 14)
 		c->enabled = 0;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
+	set_gain(c);
+
+	for (uint_fast16_t i = start; i < end; i += 2) {
+		uint_fast16_t steps;
+
 		update_len(c);
 
 		if (!c->enabled)
@@ -326,11 +472,11 @@ static void update_noise(int16_t *samples)
 
 		update_env(c);
 
-		uint32_t pos      = 0;
-		uint32_t prev_pos = 0;
-		int32_t sample    = 0;
+#if MINIGB_APU_SYNTH == MINIGB_APU_SYNTH_BLEP
+		const int_fast16_t prev_val = c->val;
+#endif
 
-		while (update_freq(c, &pos)) {
+		for (steps = update_freq(c); steps > 0; steps--) {
 			c->noise.lfsr_reg = (c->noise.lfsr_reg << 1) |
 				(c->val >= VOL_INIT_MAX/MAX_CHAN_VOLUME);
 
@@ -345,23 +491,41 @@ static void update_noise(int16_t *samples)
 					VOL_INIT_MAX / MAX_CHAN_VOLUME :
 					VOL_INIT_MIN / MAX_CHAN_VOLUME;
 			}
-
-			sample += ((pos - prev_pos) / c->freq_inc) * c->val;
-			prev_pos = pos;
 		}
 
 		if (c->muted)
 			continue;
 
-		sample += c->val;
-		sample *= c->volume;
-		sample /= 4;
+#if MINIGB_APU_SYNTH == MINIGB_APU_SYNTH_BLEP
+		/* A noise channel stepping once per sample at most changes at
+		 * most once, at the time of the step. */
+		if (c->val != prev_val && c->freq_inc <= BLEP_NOISE_MAX_INC) {
+			blep_add(samples, i, end, c, c->val - prev_val,
+				(c->freq_counter * BLEP_PHASES) / c->freq_inc);
+		}
+#endif
 
-		samples[i + 0] += sample * c->on_left * vol_l;
-		samples[i + 1] += sample * c->on_right * vol_r;
+		mix_sample(samples + i, c, c->val);
 	}
 }
 
+/**
+ * Generate interleaved samples between "start" and "end" of "stream".
+ */
+static void render_samples(int16_t *stream, const uint_fast16_t start,
+		const uint_fast16_t end)
+{
+	memset(stream + start, 0, (end - start) * sizeof(*stream));
+#if MINIGB_APU_SYNTH == MINIGB_APU_SYNTH_BLEP
+	blep_flush(stream, start, end);
+#endif
+
+	update_square(stream, 0, start, end);
+	update_square(stream, 1, start, end);
+	update_wave(stream, start, end);
+	update_noise(stream, start, end);
+}
+
 /**
  * SDL2 style audio callback function.
  */
@@ -369,13 +533,9 @@ void audio_callback(void *userdata, int16_t *stream, size_t len)
 {
 	/* Appease unused variable warning. */
 	(void)userdata;
+	(void)len;
 
-	memset(stream, 0, len);
-
-	update_square(stream, 0);
-	update_square(stream, 1);
-	update_wave(stream);
-	update_noise(stream);
+	render_samples(stream, 0, AUDIO_NSAMPLES);
 }
 
 static void chan_trigger(uint_fast8_t i)
@@ -449,12 +609,9 @@ uint8_t audio_read(const uint16_t addr)
 }
 
 /**
- * Write audio register.
- * \param addr	Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
- *				This is not checked in this function.
- * \param val	Byte to write at address.
+ * Apply a write to an audio register.
  */
-void audio_write(const uint16_t addr, const uint8_t val)
+static void apply_write(const uint16_t addr, const uint8_t val)
 {
 	/* Find sound channel corresponding to register address. */
 	uint_fast8_t i;
@@ -530,6 +687,7 @@ void audio_write(const uint16_t addr, const uint8_t val)
 	case 0xFF1D:
 		chans[i].freq &= 0xFF00;
 		chans[i].freq |= val;
+		set_note_freq(i);
 		break;
 
 	case 0xFF1A:
@@ -542,6 +700,7 @@ void audio_write(const uint16_t addr, const uint8_t val)
 	case 0xFF1E:
 		chans[i].freq &= 0x00FF;
 		chans[i].freq |= ((val & 0x07) << 8);
+		set_note_freq(i);
 		/* Intentional fall-through. */
 	case 0xFF23:
 		chans[i].len.enabled = val & 0x40 ? 1 : 0;
@@ -554,6 +713,7 @@ void audio_write(const uint16_t addr, const uint8_t val)
 		chans[3].freq = val >> 4;
 		chans[3].noise.lfsr_wide = !(val & 0x08);
 		chans[3].noise.lfsr_div = val & 0x07;
+		set_note_freq(3);
 		break;
 
 	case 0xFF24:
@@ -572,11 +732,269 @@ void audio_write(const uint16_t addr, const uint8_t val)
 	}
 }
 
+/**
+ * Copy the state of the APU to or from "state", which holds
+ * AUDIO_STATE_SIZE bytes.
+ */
+#define AUDIO_STATE_SIZE \
+	(sizeof(audio_mem) + sizeof(chans) + sizeof(vol_l) + sizeof(vol_r))
+
+static void state_copy(uint8_t *state, const bool save)
+{
+#define STATE_FIELD(field)						\
+	do {								\
+		if(save)						\
+			memcpy(state, &(field), sizeof(field));		\
+		else							\
+			memcpy(&(field), state, sizeof(field));		\
+		state += sizeof(field);					\
+	} while(0)
+
+	STATE_FIELD(audio_mem);
+	STATE_FIELD(chans);
+	STATE_FIELD(vol_l);
+	STATE_FIELD(vol_r);
+#undef STATE_FIELD
+}
+
+size_t audio_state_size(void)
+{
+	return AUDIO_STATE_SIZE;
+}
+
+#if MINIGB_APU_WRITE_LOG
+/* Number of entries in the register write log. Must be a power of 2. */
+#define AUDIO_LOG_SIZE		2048
+
+/* Each log entry holds the sample at which it takes effect in the upper 16
+ * bits, the low byte of the register address and the value written. Entries
+ * with an address of 0 are markers, up to which samples may be generated. */
+#define LOG_ENTRY(sample, addr, val)					\
+	(((uint32_t)(sample) << 16) | ((uint32_t)((addr) & 0xFF) << 8) | (val))
+#define LOG_SAMPLE(entry)	((entry) >> 16)
+#define LOG_ADDR(entry)		(((entry) >> 8) & 0xFF)
+#define LOG_VAL(entry)		((entry) & 0xFF)
+
+/* Marker types. */
+#define LOG_MARK_PARTIAL	0
+#define LOG_MARK_FRAME		1
+#define LOG_MARK_FRAME_MUTED	2
+#define LOG_MARK_STATE_SAVE	3
+#define LOG_MARK_STATE_LOAD	4
+
+/* Writes are appended to the log by audio_write(), and only read by
+ * audio_render(). Each side only writes its own index. */
+static uint32_t audio_log[AUDIO_LOG_SIZE];
+static uint32_t audio_log_head;
+static uint32_t audio_log_tail;
+/* Number of markers appended and played. */
+static uint32_t audio_log_marks;
+static uint32_t audio_log_marks_played;
+
+/* Sleep until, and signal, a change to the log made by the other core. */
+#if defined(__arm__)
+# define LOG_WAIT()		__asm volatile ("wfe")
+# define LOG_SIGNAL()		__asm volatile ("sev")
+#else
+# define LOG_WAIT()
+# define LOG_SIGNAL()
+#endif
+
+/* Stereo samples of the current frame generated so far. */
+static uint_fast16_t render_pos;
+
+/* Save state to be copied or applied by audio_render() at the next state
+ * marker. Cleared by audio_render() once done. */
+static uint8_t *volatile audio_state;
+/* Copy of the state to be loaded, so the caller may reuse its buffer. */
+static uint8_t audio_state_load_buf[AUDIO_STATE_SIZE];
+
+/* Converts cycles since the start of a frame to the sample played at that
+ * time, in 16.16 fixed point. */
+#define SAMPLES_PER_CYCLE_Q16 \
+	((uint32_t)(AUDIO_SAMPLES * 65536.0 / SCREEN_REFRESH_CYCLES))
+
+static void audio_log_put(const uint32_t entry)
+{
+	const uint32_t head = audio_log_head;
+
+	while(head - __atomic_load_n(&audio_log_tail, __ATOMIC_ACQUIRE) ==
+			AUDIO_LOG_SIZE)
+		LOG_WAIT();
+
+	audio_log[head % AUDIO_LOG_SIZE] = entry;
+	__atomic_store_n(&audio_log_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void audio_log_mark(const uint_fast16_t sample, const uint8_t type)
+{
+	audio_log_put(LOG_ENTRY(sample, 0, type));
+	__atomic_store_n(&audio_log_marks, audio_log_marks + 1,
+			__ATOMIC_RELEASE);
+	LOG_SIGNAL();
+}
+
+/**
+ * Sample of the current frame being played at the current time.
+ */
+static uint_fast16_t audio_log_sample(void)
+{
+	uint_fast32_t sample =
+		(audio_frame_cycles() * SAMPLES_PER_CYCLE_Q16) >> 16;
+
+	if(sample >= AUDIO_SAMPLES)
+		sample = AUDIO_SAMPLES - 1;
+
+	return sample;
+}
+
+/**
+ * Log a write to an audio register, to be applied by audio_render() at the
+ * time it was made.
+ */
+void audio_write(const uint16_t addr, const uint8_t val)
+{
+	const uint_fast16_t sample = audio_log_sample();
+
+	/* When the log is nearly full, allow samples to be generated up to
+	 * this write so that the log may be emptied. */
+	if(audio_log_head - __atomic_load_n(&audio_log_tail, __ATOMIC_ACQUIRE) >=
+			AUDIO_LOG_SIZE - 1)
+		audio_log_mark(sample, LOG_MARK_PARTIAL);
+
+	audio_log_put(LOG_ENTRY(sample, addr, val));
+}
+
+void audio_frame_end(const bool play)
+{
+	audio_log_mark(AUDIO_SAMPLES,
+		play ? LOG_MARK_FRAME : LOG_MARK_FRAME_MUTED);
+}
+
+bool audio_state_pending(void)
+{
+	return __atomic_load_n(&audio_state, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void audio_state_save(void *state)
+{
+	while(audio_state_pending())
+		LOG_WAIT();
+
+	audio_state = state;
+	audio_log_mark(audio_log_sample(), LOG_MARK_STATE_SAVE);
+}
+
+void audio_state_load(const void *state)
+{
+	while(audio_state_pending())
+		LOG_WAIT();
+
+	memcpy(audio_state_load_buf, state, AUDIO_STATE_SIZE);
+	audio_state = audio_state_load_buf;
+	audio_log_mark(audio_log_sample(), LOG_MARK_STATE_LOAD);
+}
+
+enum audio_render_e audio_render(int16_t *stream, unsigned max)
+{
+	while(max > 0)
+	{
+		uint32_t entry;
+		uint_fast16_t until;
+
+		/* Entries are only played once followed by a marker. */
+		if(audio_log_marks_played ==
+				__atomic_load_n(&audio_log_marks, __ATOMIC_ACQUIRE))
+			return AUDIO_RENDER_IDLE;
+
+		entry = audio_log[audio_log_tail % AUDIO_LOG_SIZE];
+		until = LOG_SAMPLE(entry);
+
+		if(render_pos < until)
+		{
+			if(until - render_pos > max)
+				until = render_pos + max;
+
+			render_samples(stream, render_pos * 2, until * 2);
+			max -= until - render_pos;
+			render_pos = until;
+			continue;
+		}
+
+		__atomic_store_n(&audio_log_tail, audio_log_tail + 1,
+				__ATOMIC_RELEASE);
+		/* Wake up audio_write() if it was waiting for space. */
+		LOG_SIGNAL();
+
+		if(LOG_ADDR(entry) != 0)
+		{
+			apply_write(0xFF00 | LOG_ADDR(entry), LOG_VAL(entry));
+			continue;
+		}
+
+		audio_log_marks_played++;
+		if(LOG_VAL(entry) == LOG_MARK_STATE_SAVE ||
+				LOG_VAL(entry) == LOG_MARK_STATE_LOAD)
+		{
+			state_copy(audio_state,
+				LOG_VAL(entry) == LOG_MARK_STATE_SAVE);
+			__atomic_store_n(&audio_state, NULL, __ATOMIC_RELEASE);
+			LOG_SIGNAL();
+			continue;
+		}
+		if(LOG_VAL(entry) == LOG_MARK_PARTIAL)
+			continue;
+
+		render_pos = 0;
+		return LOG_VAL(entry) == LOG_MARK_FRAME ?
+			AUDIO_RENDER_FRAME : AUDIO_RENDER_FRAME_MUTED;
+	}
+
+	return AUDIO_RENDER_BUSY;
+}
+#else
+/**
+ * Write audio register.
+ * \param addr	Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
+ *				This is not checked in this function.
+ * \param val	Byte to write at address.
+ */
+void audio_write(const uint16_t addr, const uint8_t val)
+{
+	apply_write(addr, val);
+}
+
+bool audio_state_pending(void)
+{
+	return false;
+}
+
+void audio_state_save(void *state)
+{
+	state_copy(state, true);
+}
+
+void audio_state_load(const void *state)
+{
+	state_copy((uint8_t *)state, false);
+}
+#endif
+
 void audio_init(void)
 {
 	/* Initialise channels and samples. */
 	memset(chans, 0, sizeof(chans));
 	chans[0].val = chans[1].val = -1;
+#if MINIGB_APU_SYNTH == MINIGB_APU_SYNTH_BLEP
+	memset(blep_carry, 0, sizeof(blep_carry));
+#endif
+
+#if MINIGB_APU_WRITE_LOG
+	audio_log_head = audio_log_tail = 0;
+	audio_log_marks = audio_log_marks_played = 0;
+	render_pos = 0;
+	audio_state = NULL;
+#endif
 
 	/* Initialise IO registers. */
 	{
@@ -587,7 +1005,7 @@ void audio_init(void)
 					      0x77, 0xF3, 0xF1 };
 
 		for(uint_fast8_t i = 0; i < sizeof(regs_init); ++i)
-			audio_write(0xFF10 + i, regs_init[i]);
+			apply_write(0xFF10 + i, regs_init[i]);
 	}
 
 	/* Initialise Wave Pattern RAM. */
@@ -598,6 +1016,6 @@ void audio_init(void)
 					      0xac, 0xdd, 0xda, 0x48 };
 
 		for(uint_fast8_t i = 0; i < sizeof(wave_init); ++i)
-			audio_write(0xFF30 + i, wave_init[i]);
+			apply_write(0xFF30 + i, wave_init[i]);
 	}
 }
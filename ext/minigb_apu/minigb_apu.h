@@ -7,8 +7,41 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/* Log writes to audio registers with the time they were made, and generate
+ * samples from the log with audio_render(), possibly on another core. Writes
+ * then take effect at the sample they were made instead of once per frame.
+ * Registers read back with audio_read() only reflect writes that have been
+ * played. */
+#ifndef MINIGB_APU_WRITE_LOG
+# define MINIGB_APU_WRITE_LOG 0
+#endif
+
+/* Synthesis of the square and noise channels, selected at compile time.
+ *
+ * MINIGB_APU_SYNTH_NEAREST: each sample takes the value of the channel when it
+ * is played. Costs a few adds and shifts per channel per sample, which is
+ * roughly 100k cycles per frame for all four channels on a Cortex-M0+. Tones
+ * near and above the Nyquist frequency alias.
+ *
+ * MINIGB_APU_SYNTH_BLEP: each change of value is band-limited by mixing in an
+ * 8-tap step residual at its sub-sample position, so quality is paid for per
+ * change rather than per sample. A square or noise channel makes at most one
+ * such change per sample: square tones above the Nyquist frequency play their
+ * average level and faster noise falls back to the nearest sample. The worst
+ * case adds roughly 16 multiply-adds per change, or about 300k cycles per frame
+ * with three channels changing every sample. Output is delayed by 4 samples.
+ */
+#define MINIGB_APU_SYNTH_NEAREST	0
+#define MINIGB_APU_SYNTH_BLEP		1
+
+#ifndef MINIGB_APU_SYNTH
+# define MINIGB_APU_SYNTH MINIGB_APU_SYNTH_NEAREST
+#endif
+
 #define AUDIO_SAMPLE_RATE	44100
 
 #define DMG_CLOCK_FREQ		4194304.0
@@ -38,3 +71,63 @@ void audio_write(const uint16_t addr, const uint8_t val);
  * Initialise audio driver.
  */
 void audio_init(void);
+
+/**
+ * Size in bytes of the APU state copied by audio_state_save(). The layout is
+ * specific to the build, and is meant to be stored in a versioned container.
+ */
+size_t audio_state_size(void);
+
+/**
+ * Copy the state of the APU to "state", which must hold audio_state_size()
+ * bytes. With MINIGB_APU_WRITE_LOG, the state is copied by audio_render() once
+ * it reaches the writes made so far, and "state" must not be read until
+ * audio_state_pending() returns false.
+ */
+void audio_state_save(void *state);
+
+/**
+ * Restore the state of the APU from "state". With MINIGB_APU_WRITE_LOG, the
+ * state is applied by audio_render() after the writes made so far, and
+ * "state" may be reused as soon as this returns.
+ */
+void audio_state_load(const void *state);
+
+/**
+ * Whether a state is still to be saved or loaded by audio_render().
+ */
+bool audio_state_pending(void);
+
+#if MINIGB_APU_WRITE_LOG
+/**
+ * Must be provided by the front-end. Returns the number of cycles since the
+ * start of the frame being emulated.
+ */
+extern uint_fast32_t audio_frame_cycles(void);
+
+/**
+ * Mark the end of the frame being emulated. Must be called once per frame, on
+ * the same core as audio_write().
+ * \param play	Whether the samples of this frame will be played. If not,
+ *		register writes are still applied.
+ */
+void audio_frame_end(const bool play);
+
+enum audio_render_e {
+	/* The frame cannot progress until more of it has been emulated. */
+	AUDIO_RENDER_IDLE,
+	/* More samples of the frame may be generated. */
+	AUDIO_RENDER_BUSY,
+	/* All AUDIO_SAMPLES samples of the frame have been generated. */
+	AUDIO_RENDER_FRAME,
+	/* The frame has been generated, but was marked as not to be played. */
+	AUDIO_RENDER_FRAME_MUTED
+};
+
+/**
+ * Generate up to "max" stereo samples of the oldest logged frame into "stream",
+ * which must hold AUDIO_SAMPLES stereo samples and be passed again until the
+ * frame is complete. May be called on a different core to audio_write().
+ */
+enum audio_render_e audio_render(int16_t *stream, unsigned max);
+#endif
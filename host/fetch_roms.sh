@@ -0,0 +1,22 @@
+#!/bin/sh
+# Put the ROMs of the replay suite in GB_ROM_DIR (host/roms by default), and
+# check each against its SHA-256 so that the suite always checks the same ROMs.
+# pgb-test.gb is generated by mkrom.py. A ROM downloaded here must be pinned
+# the same way, with the hashes of its scenario taken from a local run.
+#
+#   host/fetch_roms.sh [directory]
+
+set -e
+
+HOST=$(cd "$(dirname "$0")" && pwd)
+DIR=${1:-$HOST/roms}
+
+# Fail unless file $1 has the SHA-256 $2.
+check() {
+	echo "$2  $1" | sha256sum -c -
+}
+
+mkdir -p "$DIR"
+python3 "$HOST/mkrom.py" "$DIR/pgb-test.gb"
+check "$DIR/pgb-test.gb" \
+	b14410188ae5fef8b8b205efec4c54ee94850d0dd055b29622726f6bb75993bc
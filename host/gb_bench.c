@@ -0,0 +1,648 @@
+/**
+ * Headless benchmark of the emulator core, for A/B testing changes to
+ * peanut_gb.h and minigb_apu.c on a workstation.
+ *
+ * Runs a game for a number of frames as fast as possible, with the emulator
+ * settings of src/main.c, and reports the frames emulated per second, the
+ * distribution of frame times and a hash of the frames and of the audio. The
+ * joypad may be replayed from a trace recorded on the device, and the run
+ * checked against a minimum speed and the expected hashes, so that it can be
+ * used as a regression test. The last frame may be written to a PPM image and
+ * the audio to a WAV file, and the SD card reads of streaming a ROM larger than
+ * the flash counted.
+ *
+ * A trace is a text file of lines "J <frames> <joypad>", each holding
+ * gb.direct.joypad (in hex, 0xFF with no buttons pressed) for a number of
+ * frames from reset. Other lines are ignored.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ */
+
+// Peanut-GB emulator settings, as in src/main.c
+#define ENABLE_LCD	1
+#define ENABLE_SOUND	1
+#define PEANUT_GB_HIGH_LCD_ACCURACY 1
+#define PEANUT_GB_USE_BIOS 0
+#define PEANUT_GB_USE_PAGE_TABLE 1
+#define PEANUT_GB_USE_COMPUTED_GOTO 1
+#define PEANUT_GB_FUSE_OPCODES 1
+#define PEANUT_GB_EVENT_SCHEDULER 1
+#define PEANUT_GB_FAST_HALT 1
+#define PEANUT_GB_TILE_CACHE 1
+#define PEANUT_GB_SPRITE_BUCKETS 1
+#define PEANUT_GB_SPLIT_RENDER 1
+#define PEANUT_GB_MBC_VARIANTS 1
+
+#define DEFAULT_FRAMES	3600
+/* Largest line ring of src/main.c. */
+#define LINE_RING_MAX	LCD_HEIGHT
+/* Chunks of the ROM streaming of src/main.c. */
+#define ROM_STREAM_CHUNKS	8
+#define ROM_STREAM_CHUNK_SIZE	0x1000
+#define ROM_STREAM_BANK_CHUNKS	(ROM_BANK_SIZE / ROM_STREAM_CHUNK_SIZE)
+/* Largest ROM of an MBC5 cartridge. */
+#define ROM_MAX_SIZE	(8 * 1024 * 1024)
+
+/* C Headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Project headers */
+#include "minigb_apu.h"
+#include "peanut_gb.h"
+
+static uint8_t *rom;
+static size_t rom_size;
+static uint8_t ram[32768];
+
+/* The last frame drawn, as shades 0 to 3. */
+static uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+
+/* FNV-1a hashes of all the lines drawn and all the samples generated. */
+#define HASH_INIT	2166136261u
+static uint32_t frame_hash = HASH_INIT;
+static uint32_t audio_hash = HASH_INIT;
+
+/* Joypad trace, as runs of frames holding the same joypad value. */
+struct replay_run {
+	unsigned long frames;
+	uint8_t joypad;
+};
+static struct replay_run *replay;
+static size_t replay_runs;
+
+static struct gb_s gb;
+
+/* Model of the line ring of src/main.c with PEANUT_GB_SPLIT_RENDER, where core
+ * 1 is as slow as possible: queued lines are only rendered when the ring is
+ * full or the emulator waits for them. Used when depth is not 0. */
+static struct {
+	unsigned depth;
+	struct gb_line_s line[LINE_RING_MAX];
+	uint32_t head;
+	uint32_t tail;
+	unsigned long waits;
+	unsigned long lines_waited;
+} ring;
+
+/* Model of the ROM streaming of src/main.c, counting the chunks that would be
+ * read from the SD card. Streams the ROM beyond "flash" bytes when not 0. */
+static struct {
+	size_t flash;
+	uint16_t chunk[ROM_STREAM_CHUNKS];
+	uint32_t used[ROM_STREAM_CHUNKS];
+	uint32_t clock;
+	uint16_t bank;
+	unsigned long switches;
+	unsigned long faults;
+} rom_stream;
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Looks up a chunk of the streamed ROM as rom_stream_slot() of src/main.c,
+ * counting a fault when it would be read from the SD card.
+ */
+static void rom_stream_chunk(const uint_fast16_t chunk)
+{
+	unsigned slot = ROM_STREAM_CHUNKS;
+
+	for(unsigned i = 0; i < ROM_STREAM_CHUNKS; i++)
+	{
+		if(rom_stream.chunk[i] == chunk)
+		{
+			rom_stream.used[i] = ++rom_stream.clock;
+			return;
+		}
+
+		if(rom_stream.chunk[i] / ROM_STREAM_BANK_CHUNKS == rom_stream.bank)
+			continue;
+
+		if(slot == ROM_STREAM_CHUNKS
+				|| rom_stream.used[i] < rom_stream.used[slot])
+			slot = i;
+	}
+
+	rom_stream.chunk[slot] = chunk;
+	rom_stream.used[slot] = ++rom_stream.clock;
+	rom_stream.faults++;
+}
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	if(rom_stream.flash != 0 && addr >= rom_stream.flash && addr < rom_size)
+	{
+		const uint_fast16_t chunk = addr / ROM_STREAM_CHUNK_SIZE;
+
+		rom_stream_chunk(chunk);
+		if(chunk / ROM_STREAM_BANK_CHUNKS == rom_stream.bank)
+			gb_set_rom_page(gb, chunk % ROM_STREAM_BANK_CHUNKS,
+				rom + chunk * ROM_STREAM_CHUNK_SIZE);
+	}
+
+	return addr < rom_size ? rom[addr] : 0xFF;
+}
+
+/**
+ * Returns a pointer to the given 16 KiB ROM bank, or NULL beyond the end of
+ * the ROM or for a streamed bank, so that it is read with gb_rom_read().
+ */
+const uint8_t *gb_rom_bank_ptr(struct gb_s *gb, const uint_fast16_t bank)
+{
+	const size_t offset = (size_t)bank * ROM_BANK_SIZE;
+
+	(void) gb;
+	if(rom_stream.flash != 0 && offset != 0)
+	{
+		if(offset >= rom_stream.flash)
+		{
+			if(rom_stream.bank != bank)
+				rom_stream.switches++;
+			rom_stream.bank = bank;
+			return NULL;
+		}
+
+		rom_stream.bank = 0xFFFF;
+	}
+
+	return offset + ROM_BANK_SIZE <= rom_size ? rom + offset : NULL;
+}
+
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	(void) gb;
+	return addr < sizeof(ram) ? ram[addr] : 0xFF;
+}
+
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		       const uint8_t val)
+{
+	(void) gb;
+	if(addr < sizeof(ram))
+		ram[addr] = val;
+}
+
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr)
+{
+	(void) gb;
+	fprintf(stderr, "Error %d at 0x%04X\n", gb_err, addr);
+	exit(EXIT_FAILURE);
+}
+
+void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[LCD_WIDTH],
+		   const uint_fast8_t line)
+{
+	(void) gb;
+	for(unsigned int x = 0; x < LCD_WIDTH; x++)
+	{
+		fb[line][x] = pixels[x] & LCD_COLOUR;
+		frame_hash = (frame_hash ^ fb[line][x]) * 16777619u;
+	}
+}
+
+static uint32_t hash_bytes(uint32_t hash, const uint8_t *data, size_t len)
+{
+	while(len--)
+		hash = (hash ^ *data++) * 16777619u;
+
+	return hash;
+}
+
+static void ring_render(void)
+{
+	gb_render_line(&gb, &ring.line[ring.tail % ring.depth]);
+	ring.tail++;
+}
+
+uint32_t lcd_queue_line(struct gb_s *gb, const struct gb_line_s *line)
+{
+	(void) gb;
+	if(ring.head - ring.tail == ring.depth)
+		ring_render();
+
+	ring.line[ring.head % ring.depth] = *line;
+	return ++ring.head;
+}
+
+void lcd_wait_line(struct gb_s *gb, uint32_t ticket)
+{
+	(void) gb;
+	if((int32_t)(ticket - ring.tail) <= 0)
+		return;
+
+	ring.waits++;
+	ring.lines_waited += ticket - ring.tail;
+	while((int32_t)(ticket - ring.tail) > 0)
+		ring_render();
+}
+
+uint_fast32_t audio_frame_cycles(void)
+{
+	return gb_get_frame_cycles(&gb);
+}
+
+static uint8_t *read_file(const char *filename, size_t *size)
+{
+	FILE *f = fopen(filename, "rb");
+	uint8_t *data;
+
+	if(f == NULL)
+	{
+		perror(filename);
+		return NULL;
+	}
+
+	data = malloc(ROM_MAX_SIZE);
+	*size = data != NULL ? fread(data, 1, ROM_MAX_SIZE, f) : 0;
+	fclose(f);
+	return data;
+}
+
+/**
+ * Load the joypad trace "filename".
+ * \return	The number of frames in the trace, or 0 on error.
+ */
+static unsigned long read_trace(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	char line[64];
+	unsigned long total = 0;
+	size_t size = 0;
+
+	if(f == NULL)
+	{
+		perror(filename);
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		unsigned long frames;
+		unsigned joypad;
+
+		if(sscanf(line, "J %lu %x", &frames, &joypad) != 2)
+			continue;
+
+		if(replay_runs == size)
+		{
+			size = size ? size * 2 : 64;
+			replay = realloc(replay, size * sizeof(*replay));
+			if(replay == NULL)
+				break;
+		}
+
+		replay[replay_runs].frames = frames;
+		replay[replay_runs].joypad = joypad;
+		replay_runs++;
+		total += frames;
+	}
+
+	fclose(f);
+	return replay != NULL ? total : 0;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a;
+	const uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void write_ppm(const char *filename)
+{
+	static const uint8_t shades[4] = { 0xFF, 0xA5, 0x52, 0x00 };
+	FILE *f = fopen(filename, "wb");
+
+	if(f == NULL)
+	{
+		perror(filename);
+		return;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", LCD_WIDTH, LCD_HEIGHT);
+	for(unsigned int y = 0; y < LCD_HEIGHT; y++)
+	{
+		for(unsigned int x = 0; x < LCD_WIDTH; x++)
+		{
+			const uint8_t s = shades[fb[y][x]];
+			const uint8_t rgb[3] = { s, s, s };
+
+			fwrite(rgb, 1, sizeof(rgb), f);
+		}
+	}
+
+	fclose(f);
+}
+
+static void put_le(uint8_t *p, uint32_t v, unsigned bytes)
+{
+	while(bytes--)
+	{
+		*p++ = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+/**
+ * Write the header of a 16-bit stereo WAV file holding "samples" samples.
+ */
+static void write_wav_header(FILE *f, uint32_t samples)
+{
+	const uint32_t data_size = samples * 4;
+	uint8_t h[44];
+
+	memcpy(h, "RIFF", 4);
+	put_le(h + 4, 36 + data_size, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 16, 4);
+	put_le(h + 20, 1, 2);			/* PCM */
+	put_le(h + 22, 2, 2);			/* Channels */
+	put_le(h + 24, AUDIO_SAMPLE_RATE, 4);
+	put_le(h + 28, AUDIO_SAMPLE_RATE * 4, 4);
+	put_le(h + 32, 4, 2);			/* Bytes per sample */
+	put_le(h + 34, 16, 2);			/* Bits per channel */
+	memcpy(h + 36, "data", 4);
+	put_le(h + 40, data_size, 4);
+
+	rewind(f);
+	fwrite(h, 1, sizeof(h), f);
+}
+
+/**
+ * Generate the samples of the frame just emulated into "buf".
+ */
+static void audio_frame(int16_t *buf)
+{
+	audio_frame_end(true);
+	while(audio_render(buf, AUDIO_SAMPLES) == AUDIO_RENDER_BUSY)
+		;
+
+	audio_hash = hash_bytes(audio_hash, (const uint8_t *)buf,
+		AUDIO_BUFFER_SIZE_BYTES);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-n frames] [-r trace] [-f fps] [-H hash] [-A hash]\n"
+		"       [-p frame.ppm] [-w audio.wav] [-q] [-s KiB] [-d depth] rom.gb\n"
+		"  -n  number of frames to run (default %u, or the whole trace)\n"
+		"  -r  replay the joypad from a trace\n"
+		"  -f  fail if fewer frames are emulated per second\n"
+		"  -H  fail unless the frames hash to this value\n"
+		"  -A  fail unless the audio hashes to this value\n"
+		"  -p  write the last frame to a PPM image\n"
+		"  -w  write the audio to a WAV file\n"
+		"  -q  do not generate audio\n"
+		"  -s  count the SD card reads of streaming the ROM beyond\n"
+		"      this many KiB of flash\n"
+		"  -d  queue lines in a ring of this depth, rendered as late\n"
+		"      as possible, and count the waits for queued lines\n",
+		name, DEFAULT_FRAMES);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long frames = 0;
+	const char *trace = NULL;
+	double min_fps = 0;
+	const char *expect_frame_hash = NULL;
+	const char *expect_audio_hash = NULL;
+	const char *ppm = NULL;
+	const char *wav = NULL;
+	bool sound = true;
+	FILE *wav_file = NULL;
+	int16_t *audio_buf;
+	enum gb_init_error_e ret;
+	uint32_t *frame_us;
+	uint64_t start, elapsed;
+	size_t run = 0;
+	unsigned long run_frames = 0;
+	double fps;
+	bool failed = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:r:f:H:A:p:w:qs:d:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			trace = optarg;
+			break;
+
+		case 'f':
+			min_fps = strtod(optarg, NULL);
+			break;
+
+		case 'H':
+			expect_frame_hash = optarg;
+			break;
+
+		case 'A':
+			expect_audio_hash = optarg;
+			break;
+
+		case 'p':
+			ppm = optarg;
+			break;
+
+		case 'w':
+			wav = optarg;
+			break;
+
+		case 'q':
+			sound = false;
+			break;
+
+		case 's':
+			rom_stream.flash = strtoul(optarg, NULL, 0) * 1024;
+			break;
+
+		case 'd':
+			ring.depth = strtoul(optarg, NULL, 0);
+			if(ring.depth > LINE_RING_MAX)
+				ring.depth = LINE_RING_MAX;
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	rom = read_file(argv[optind], &rom_size);
+	if(rom == NULL)
+		return EXIT_FAILURE;
+
+	memset(rom_stream.chunk, 0xFF, sizeof(rom_stream.chunk));
+	rom_stream.bank = 0xFFFF;
+
+	if(trace != NULL)
+	{
+		const unsigned long trace_frames = read_trace(trace);
+
+		if(trace_frames == 0)
+		{
+			fprintf(stderr, "%s: no joypad runs\n", trace);
+			return EXIT_FAILURE;
+		}
+		if(frames == 0)
+			frames = trace_frames;
+	}
+	if(frames == 0)
+		frames = DEFAULT_FRAMES;
+
+	frame_us = malloc(frames * sizeof(*frame_us));
+	if(frame_us == NULL)
+		return EXIT_FAILURE;
+
+	ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+		      &gb_cart_ram_write, &gb_error, NULL);
+	if(ret != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Error: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	gb_set_rom_bank_ptr(&gb, &gb_rom_bank_ptr);
+	gb_init_lcd(&gb, &lcd_draw_line);
+	if(ring.depth != 0)
+		gb_set_split_render(&gb, &lcd_queue_line, &lcd_wait_line);
+	audio_init();
+	/* AUDIO_SAMPLES stereo samples. */
+	audio_buf = malloc(AUDIO_BUFFER_SIZE_BYTES);
+	if(audio_buf == NULL)
+		return EXIT_FAILURE;
+
+	if(wav != NULL && sound)
+	{
+		wav_file = fopen(wav, "wb");
+		if(wav_file == NULL)
+		{
+			perror(wav);
+			return EXIT_FAILURE;
+		}
+		write_wav_header(wav_file, 0);
+	}
+
+	start = time_ns();
+	for(unsigned long i = 0; i < frames; i++)
+	{
+		const uint64_t frame_start = time_ns();
+
+		/* The last value of the trace is held once it ends. */
+		while(run < replay_runs && run_frames == replay[run].frames)
+		{
+			gb_set_joypad(&gb, replay[run].joypad);
+			run++;
+			run_frames = 0;
+		}
+		run_frames++;
+
+		gb_run_frame(&gb);
+
+		if(sound)
+		{
+			audio_frame(audio_buf);
+			if(wav_file != NULL)
+				fwrite(audio_buf, AUDIO_BUFFER_SIZE_BYTES, 1,
+					wav_file);
+		}
+		else
+		{
+			/* Register writes are still applied. */
+			audio_frame_end(false);
+			while(audio_render(audio_buf, AUDIO_SAMPLES) ==
+					AUDIO_RENDER_BUSY)
+				;
+		}
+
+		frame_us[i] = (time_ns() - frame_start) / 1000;
+	}
+	while(ring.tail != ring.head)
+		ring_render();
+	elapsed = time_ns() - start;
+	fps = frames * 1e9 / elapsed;
+
+	printf("Frames: %lu\n"
+		"Time: %lu us\n"
+		"FPS: %.1f (%.1fx real time)\n",
+		frames, (unsigned long)(elapsed / 1000),
+		fps, fps / VERTICAL_SYNC);
+
+	qsort(frame_us, frames, sizeof(*frame_us), compare_u32);
+	printf("Frame time: min %u us, median %u us, 99%% %u us, max %u us\n",
+		frame_us[0], frame_us[frames / 2],
+		frame_us[frames - 1 - frames / 100], frame_us[frames - 1]);
+	printf("Frame hash: %08x\n", frame_hash);
+	if(sound)
+		printf("Audio hash: %08x\n", audio_hash);
+#if PEANUT_GB_FAST_HALT
+	printf("Halted: %u%%\n", (unsigned)(gb.counter.halt_cycles * 100ULL /
+		((uint64_t)frames * LCD_LINE_CYCLES * LCD_VERT_LINES)));
+#endif
+	if(ring.depth != 0)
+		printf("Line ring waits: %lu, %.1f per frame, %.1f lines each\n",
+			ring.waits, (double)ring.waits / frames,
+			ring.waits ? (double)ring.lines_waited / ring.waits : 0);
+	if(rom_stream.flash != 0)
+		printf("ROM streamed bank switches: %lu, chunk reads: %lu\n",
+			rom_stream.switches, rom_stream.faults);
+
+	if(ppm != NULL)
+		write_ppm(ppm);
+
+	if(wav_file != NULL)
+	{
+		write_wav_header(wav_file, frames * AUDIO_SAMPLES);
+		fclose(wav_file);
+	}
+
+	if(fps < min_fps)
+	{
+		printf("FAIL: below %.1f FPS\n", min_fps);
+		failed = true;
+	}
+	if(expect_frame_hash != NULL &&
+			strtoul(expect_frame_hash, NULL, 16) != frame_hash)
+	{
+		printf("FAIL: frame hash is not %s\n", expect_frame_hash);
+		failed = true;
+	}
+	if(expect_audio_hash != NULL &&
+			(!sound || strtoul(expect_audio_hash, NULL, 16) != audio_hash))
+	{
+		printf("FAIL: audio hash is not %s\n", expect_audio_hash);
+		failed = true;
+	}
+
+	free(frame_us);
+	free(replay);
+	free(audio_buf);
+	free(rom);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+# Generate pgb-test.gb, the synthetic test ROM of the replay suite.
+#
+# The ROM is an MBC1 cartridge with 64 KiB of ROM and 8 KiB of RAM. Every
+# frame it scrolls the background and the window, moves 40 sprites with OAM
+# DMA, switches ROM banks, toggles the tile data and sprite size, writes and
+# reads back cartridge RAM and VRAM, and takes STAT and timer interrupts. The
+# pressed buttons are XORed into SCX, so a joypad trace changes the frames.
+# The banks are filled from a seeded generator, so the output is always the
+# same and the ROM can be rebuilt instead of distributed.
+#
+#   host/mkrom.py [output]
+
+import random
+import sys
+
+BASE = 0x150
+
+rom = bytearray(0x10000)
+code = bytearray()
+labels = {}
+fixups = []
+
+random.seed(1234)
+for b in range(1, 4):
+	for i in range(0x4000):
+		rom[b * 0x4000 + i] = random.randrange(256)
+
+def emit(*bs):
+	code.extend(bs)
+
+def label(name):
+	labels[name] = BASE + len(code)
+
+def jr(op, name):
+	emit(op, 0)
+	fixups.append(('r', len(code) - 1, name))
+
+def ld_a(v):
+	emit(0x3E, v)
+
+def ld_a_mem(a):
+	emit(0xFA, a & 0xFF, a >> 8)
+
+def ld_mem_a(a):
+	emit(0xEA, a & 0xFF, a >> 8)
+
+def ldh_a(a):
+	emit(0xF0, a & 0xFF)
+
+def ldh_mem_a(a):
+	emit(0xE0, a & 0xFF)
+
+# Reset: wait for vblank and turn the LCD off.
+emit(0xF3)				# di
+emit(0x31, 0xFE, 0xFF)			# ld sp,FFFE
+label('wait_ly')
+ldh_a(0xFF44); emit(0xFE, 144); jr(0x20, 'wait_ly')
+ld_a(0); ldh_mem_a(0xFF40)
+
+# Copy 6 KiB of bank 1 to the tile data.
+ld_a(1); ld_mem_a(0x2000)
+emit(0x21, 0x00, 0x40)			# ld hl,4000
+emit(0x11, 0x00, 0x80)			# ld de,8000
+emit(0x01, 0x00, 0x18)			# ld bc,1800
+label('copy_tiles')
+emit(0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1); jr(0x20, 'copy_tiles')
+
+# Fill both tile maps with a = rlca(l) + l ^ h.
+emit(0x21, 0x00, 0x98)
+label('fill_map')
+emit(0x7D, 0x07, 0x85, 0xAC, 0x22, 0x7C, 0xFE, 0xA0); jr(0x20, 'fill_map')
+
+# 40 sprites at C000 with varied positions, tiles, palettes, flips and
+# priorities.
+emit(0x21, 0x00, 0xC0); emit(0x06, 40); emit(0x0E, 0)
+label('fill_oam')
+emit(0x79, 0xE6, 0x03, 0x07, 0x07, 0x07, 0xC6, 20, 0x22)	# y = (c & 3) * 8 + 20
+emit(0x79, 0x07, 0x07, 0xC6, 4, 0x22)				# x = c * 4 + 4
+emit(0x79, 0x22)						# tile = c
+emit(0x79, 0xCB, 0x27, 0xCB, 0x27, 0xCB, 0x27, 0xCB, 0x27, 0x22)	# attr = c << 4
+emit(0x0C, 0x05); jr(0x20, 'fill_oam')
+
+# Copy the OAM DMA routine to HRAM.
+emit(0x21, 0x80, 0xFF)
+emit(0x11); fixups.append(('a', len(code), 'dma')); emit(0, 0)
+emit(0x06, 12)
+label('copy_dma')
+emit(0x1A, 0x22, 0x13, 0x05); jr(0x20, 'copy_dma')
+
+# Enable cartridge RAM in RAM banking mode.
+ld_a(0x0A); ld_mem_a(0x0000)
+ld_a(0x01); ld_mem_a(0x6000)
+ld_a(0x00); ld_mem_a(0x4000)
+
+# Timer, LY compare, interrupts, window, palettes, then the LCD on.
+ld_a(0x80); ldh_mem_a(0xFF06); ld_a(0x05); ldh_mem_a(0xFF07)
+ld_a(60); ldh_mem_a(0xFF45); ld_a(0x40); ldh_mem_a(0xFF41)
+ld_a(0x07); ldh_mem_a(0xFFFF)
+ld_a(0x40); ldh_mem_a(0xFF4A); ld_a(0x50); ldh_mem_a(0xFF4B)
+ld_a(0xE4); ldh_mem_a(0xFF47); ld_a(0xD2); ldh_mem_a(0xFF48)
+ld_a(0x1B); ldh_mem_a(0xFF49)
+ld_a(0xE3); ldh_mem_a(0xFF40)
+emit(0xAF); ldh_mem_a(0xFF90); ldh_mem_a(0xFF91); ldh_mem_a(0xFF92)
+emit(0xFB)				# ei
+
+# Main loop: halt, then checksum 64 bytes of the current bank.
+label('loop')
+emit(0x76, 0x00)
+emit(0x21, 0x00, 0x40); emit(0x06, 0x40); emit(0xAF)
+label('sum')
+emit(0x86, 0xCB, 0x07, 0xAE, 0xCB, 0x3F, 0x23, 0x05); jr(0x20, 'sum')
+ldh_mem_a(0xFF92)
+jr(0x18, 'loop')
+
+# Vblank interrupt.
+label('vblank')
+emit(0xF5, 0xC5, 0xD5, 0xE5)		# push af, bc, de, hl
+ld_a(0xC0); emit(0xCD, 0x80, 0xFF)	# OAM DMA from C000
+ldh_a(0xFF90); emit(0x3C); ldh_mem_a(0xFF90)	# frame counter
+ldh_mem_a(0xFF43)			# scx = frame
+emit(0xCB, 0x3F); ldh_mem_a(0xFF42)	# scy = frame / 2
+
+# scx ^= pressed buttons, d-pad in the high nibble.
+ld_a(0x20); ldh_mem_a(0xFF00)
+ldh_a(0xFF00); ldh_a(0xFF00)
+emit(0x2F, 0xE6, 0x0F, 0xCB, 0x37, 0x47)	# b = ~p1 & 0x0F << 4
+ld_a(0x10); ldh_mem_a(0xFF00)
+ldh_a(0xFF00); ldh_a(0xFF00)
+emit(0x2F, 0xE6, 0x0F, 0xB0, 0x47)		# b |= ~p1 & 0x0F
+ld_a(0x30); ldh_mem_a(0xFF00)
+ldh_a(0xFF43); emit(0xA8); ldh_mem_a(0xFF43)
+
+# ROM bank frame & 3, where 0 selects bank 1.
+ldh_a(0xFF90); emit(0xE6, 0x03); ld_mem_a(0x2000)
+
+# Toggle the tile data and the sprite size every 32 and 64 frames.
+ldh_a(0xFF90); emit(0xE6, 0x20, 0xCB, 0x3F, 0x47)
+ldh_a(0xFF90); emit(0xE6, 0x40, 0xCB, 0x3F, 0xCB, 0x3F, 0xCB, 0x3F, 0xCB, 0x3F)
+emit(0xB0, 0xF6, 0xE3 & ~0x14); ldh_mem_a(0xFF40)
+
+# Move sprite i right by (i & 3) + 1.
+emit(0x21, 0x01, 0xC0); emit(0x06, 40)
+label('move')
+emit(0x78, 0xE6, 0x03, 0x3C, 0x86, 0x77, 0x23, 0x23, 0x23, 0x23, 0x05)
+jr(0x20, 'move')
+
+# Checksum 128 bytes of the bank into cartridge RAM at A000 + frame, read it
+# back, and write it to the tile data at 8000 + (frame & 63).
+emit(0x21, 0x00, 0x40); emit(0x06, 0x80); emit(0xAF)
+label('check')
+emit(0xAE, 0xCB, 0x37, 0x8E, 0xCB, 0x1F, 0x23, 0x05); jr(0x20, 'check')
+emit(0x47)
+ldh_a(0xFF90); emit(0x6F, 0x26, 0xA0, 0x70)
+emit(0x7E); ldh_mem_a(0xFF91)
+ldh_a(0xFF90); emit(0xE6, 0x3F, 0x6F, 0x26, 0x80, 0x70)
+
+# Move the window down with the frame counter.
+ldh_a(0xFF90); emit(0xE6, 0x7F); ldh_mem_a(0xFF4A)
+emit(0xE1, 0xD1, 0xC1, 0xF1)		# pop hl, de, bc, af
+emit(0xD9)				# reti
+
+# STAT interrupt at LY 60: flip SCX mid frame.
+label('stat')
+emit(0xF5); ldh_a(0xFF43); emit(0xEE, 0x55); ldh_mem_a(0xFF43); emit(0xF1, 0xD9)
+
+# Timer interrupt: count in HRAM.
+label('timer')
+emit(0xF5); ldh_a(0xFF93); emit(0x3C); ldh_mem_a(0xFF93); emit(0xF1, 0xD9)
+
+# OAM DMA routine, copied to FF80.
+label('dma')
+ldh_mem_a(0xFF46); emit(0x3E, 40, 0x3D, 0x20, 0xFD, 0xC9)
+
+for kind, pos, name in fixups:
+	target = labels[name]
+	if kind == 'r':
+		offset = target - (BASE + pos + 1)
+		assert -128 <= offset < 128, name
+		code[pos] = offset & 0xFF
+	else:
+		code[pos] = target & 0xFF
+		code[pos + 1] = target >> 8
+
+rom[BASE:BASE + len(code)] = code
+
+for vector, name in ((0x40, 'vblank'), (0x48, 'stat'), (0x50, 'timer')):
+	rom[vector:vector + 3] = bytes([0xC3, labels[name] & 0xFF, labels[name] >> 8])
+
+# Header: entry point, title, MBC1+RAM+battery, 64 KiB ROM, 8 KiB RAM.
+rom[0x100:0x104] = bytes([0x00, 0xC3, BASE & 0xFF, BASE >> 8])
+rom[0x134:0x13C] = b'PGBTEST\0'
+rom[0x147] = 0x03
+rom[0x148] = 0x01
+rom[0x149] = 0x02
+checksum = 0
+for i in range(0x134, 0x14D):
+	checksum = (checksum - rom[i] - 1) & 0xFF
+rom[0x14D] = checksum
+
+with open(sys.argv[1] if len(sys.argv) > 1 else 'pgb-test.gb', 'wb') as f:
+	f.write(rom)
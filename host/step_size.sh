@@ -0,0 +1,68 @@
+#!/bin/sh
+# Print the number of instructions and the size of __gb_step_cpu, built from
+# inc/peanut_gb.h at each of the given git revisions with the emulator
+# settings of src/main.c. With no revision, compare the header before and
+# after the struct gb_s field reorder.
+#
+# The RP2040 is targeted when arm-none-eabi-gcc is found, otherwise the host
+# compiler is used. Set CC and CFLAGS to override.
+#
+#   host/step_size.sh [revision...]
+
+set -e
+
+ROOT=$(git -C "$(dirname "$0")" rev-parse --show-toplevel)
+[ $# -gt 0 ] || set -- e78334a~1 e78334a
+
+if [ -z "$CC" ] && command -v arm-none-eabi-gcc >/dev/null 2>&1; then
+	CC=arm-none-eabi-gcc
+	: "${CFLAGS:=-mcpu=cortex-m0plus -mthumb -O3 -DNDEBUG}"
+	: "${OBJDUMP:=arm-none-eabi-objdump}"
+	: "${NM:=arm-none-eabi-nm}"
+fi
+: "${CC:=cc}"
+: "${CFLAGS:=-O3 -DNDEBUG}"
+: "${OBJDUMP:=objdump}"
+: "${NM:=nm}"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Same emulator settings as src/main.c, without the scratch Y placement.
+cat > "$TMP/step.c" <<EOF
+#define ENABLE_LCD	1
+#define ENABLE_SOUND	1
+#define PEANUT_GB_HIGH_LCD_ACCURACY 1
+#define PEANUT_GB_USE_BIOS 0
+#define PEANUT_GB_USE_PAGE_TABLE 1
+#define PEANUT_GB_USE_COMPUTED_GOTO 1
+#define PEANUT_GB_FUSE_OPCODES 1
+#define PEANUT_GB_EVENT_SCHEDULER 1
+#define PEANUT_GB_FAST_HALT 1
+#define PEANUT_GB_TILE_CACHE 1
+#define PEANUT_GB_SPRITE_BUCKETS 1
+#define PEANUT_GB_SPLIT_RENDER 1
+#define PEANUT_GB_HEATMAP 0
+#include "minigb_apu.h"
+#include "peanut_gb.h"
+EOF
+
+echo "$CC $CFLAGS"
+printf '%-12s %12s %8s\n' revision instructions bytes
+
+for rev in "$@"; do
+	mkdir -p "$TMP/inc"
+	git -C "$ROOT" show "$rev:inc/peanut_gb.h" > "$TMP/inc/peanut_gb.h"
+	$CC $CFLAGS -w -I"$TMP/inc" -I"$ROOT/ext/minigb_apu" \
+		-c "$TMP/step.c" -o "$TMP/step.o"
+
+	insns=$($OBJDUMP -d --no-show-raw-insn "$TMP/step.o" |
+		awk '/^[0-9a-f]+ <__gb_step_cpu>:$/ { f = 1; next }
+		     /^[0-9a-f]+ <.*>:$/ { f = 0 }
+		     f && /^ *[0-9a-f]+:\t/ { n++ }
+		     END { print n + 0 }')
+	size=$($NM -S "$TMP/step.o" | awk '$4 == "__gb_step_cpu" { print $2 }')
+	bytes=$((0x$size))
+
+	printf '%-12s %12s %8s\n' "$rev" "$insns" "$bytes"
+done
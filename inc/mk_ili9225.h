@@ -168,8 +168,14 @@ void mk_ili9225_blit(uint16_t *fbuf,uint8_t x,uint8_t y,uint8_t w,uint8_t h);
  */
 void mk_ili9225_get_letter(uint16_t *fbuf,char letter,uint16_t color,uint16_t bgcolor);
 
+/**
+ * Maximum number of characters written by mk_ili9225_text, one screen row
+ */
+#define MK_ILI9225_TEXT_MAX (SCREEN_SIZE_Y/8)
+
 /**
  * Write text to the screen using the the coordinates as the upper-left corner of the text.
  * All characters have dimensions of 8x8 pixels.
+ * The row is sent to the LCD in a single blit, text past the edge of the screen is clipped.
  */
 void mk_ili9225_text(char *s,uint8_t x,uint8_t y,uint16_t color,uint16_t bgcolor);
@@ -93,6 +93,98 @@
 # define PEANUT_GB_HIGH_LCD_ACCURACY 1
 #endif
 
+/* Allow the front-end to queue the registers captured for each line and
+ * render the line elsewhere, such as on another CPU core, with
+ * gb_render_line(). */
+#ifndef PEANUT_GB_SPLIT_RENDER
+# define PEANUT_GB_SPLIT_RENDER 0
+#endif
+
+/* Sort sprites into per line lists once OAM or the sprite size changes,
+ * instead of searching and sorting all sprites on every line. Requires
+ * PEANUT_GB_HIGH_LCD_ACCURACY. */
+#ifndef PEANUT_GB_SPRITE_BUCKETS
+# define PEANUT_GB_SPRITE_BUCKETS 0
+#endif
+
+#if PEANUT_GB_SPRITE_BUCKETS && !PEANUT_GB_HIGH_LCD_ACCURACY
+# error "PEANUT_GB_SPRITE_BUCKETS requires PEANUT_GB_HIGH_LCD_ACCURACY"
+#endif
+
+/* Keep a decoded copy of all tile rows in VRAM, updated on every write to
+ * tile data, so that the background, window and sprites are drawn with one
+ * lookup per tile row instead of shifting both bitplanes for every pixel.
+ * Uses 6 KiB of memory. */
+#ifndef PEANUT_GB_TILE_CACHE
+# define PEANUT_GB_TILE_CACHE 0
+#endif
+
+/* Dispatch memory accesses through a table of 4 KiB pages, skipping the
+ * address decoding for ROM, VRAM and WRAM. */
+#ifndef PEANUT_GB_USE_PAGE_TABLE
+# define PEANUT_GB_USE_PAGE_TABLE 0
+#endif
+
+/* Only update timers, serial and LCD when the next event is due or when a
+ * register depending on them is accessed, instead of after every
+ * instruction. */
+#ifndef PEANUT_GB_EVENT_SCHEDULER
+# define PEANUT_GB_EVENT_SCHEDULER 0
+#endif
+
+/* When halted, jump straight to the next event that can raise an enabled
+ * interrupt, skipping whole VBlank lines at once. Also counts the cycles
+ * spent halted. */
+#ifndef PEANUT_GB_FAST_HALT
+# define PEANUT_GB_FAST_HALT 0
+#endif
+
+/* Dispatch opcodes through a table of label addresses instead of a switch
+ * statement. Requires the GCC "labels as values" extension. */
+#ifndef PEANUT_GB_USE_COMPUTED_GOTO
+# define PEANUT_GB_USE_COMPUTED_GOTO 0
+#endif
+
+/* Execute a conditional relative jump that directly follows a flag setting
+ * INC, DEC, OR or CP instruction within the same step. Interrupts and timers
+ * are then serviced after the pair instead of in between, which loop counters
+ * and polling loops do not notice. Requires PEANUT_GB_USE_COMPUTED_GOTO. */
+#ifndef PEANUT_GB_FUSE_OPCODES
+# define PEANUT_GB_FUSE_OPCODES 0
+#endif
+
+#if PEANUT_GB_FUSE_OPCODES && !PEANUT_GB_USE_COMPUTED_GOTO
+# error "PEANUT_GB_FUSE_OPCODES requires PEANUT_GB_USE_COMPUTED_GOTO"
+#endif
+
+/* Count the opcodes executed and the reads and writes of each 4 KiB region of
+ * the memory map in gb->heatmap, to find which paths of the CPU core matter
+ * for a game. Only meant for profiling builds, as every access is counted. */
+#ifndef PEANUT_GB_HEATMAP
+# define PEANUT_GB_HEATMAP 0
+#endif
+
+#if PEANUT_GB_HEATMAP
+# define PGB_HEATMAP_COUNT(table, i) gb->heatmap.table[i]++
+#else
+# define PGB_HEATMAP_COUNT(table, i)
+#endif
+
+/* Attributes of the tables read by __gb_step_cpu for every instruction, such
+ * as a section placing them in memory close to the CPU running the emulator. */
+#ifndef PEANUT_GB_CORE_DATA
+# define PEANUT_GB_CORE_DATA
+#endif
+
+/* Build the handling of MBC registers and cartridge RAM once for each
+ * supported MBC type, with the type as a constant, and select the variant of
+ * the cartridge in gb_init(). The checks for the other MBC types are then
+ * removed from the slow paths of __gb_read() and __gb_write(). __gb_step_cpu
+ * itself is not built per MBC, as five copies would not fit in SRAM. */
+#ifndef PEANUT_GB_MBC_VARIANTS
+# define PEANUT_GB_MBC_VARIANTS 0
+#endif
+
 /* Use intrinsic functions. This may produce smaller and faster code. */
 #ifndef PEANUT_GB_USE_INTRINSICS
 # define PEANUT_GB_USE_INTRINSICS 1
@@ -195,6 +287,9 @@
 #define VRAM_TILES_3        (0x8000 - VRAM_ADDR + VRAM_BANK_SIZE)
 #define VRAM_TILES_4        (0x8800 - VRAM_ADDR + VRAM_BANK_SIZE)
 
+/* Number of 8 pixel rows in tile data. */
+#define TILE_CACHE_ROWS     (VRAM_BMAP_1 / 2)
+
 /* Interrupt jump addresses */
 #define VBLANK_INTR_ADDR    0x0040
 #define LCDC_INTR_ADDR      0x0048
@@ -236,6 +331,18 @@
 # endif
 #endif /* !defined(PGB_UNREACHABLE) */
 
+/* The PGB_ALWAYS_INLINE attribute forces a function to be inlined, so that
+ * functions taking a constant argument are specialised for it. */
+#if !defined(PGB_ALWAYS_INLINE)
+# if defined(__GNUC__)
+#  define PGB_ALWAYS_INLINE inline __attribute__((always_inline))
+# elif defined(_MSC_VER)
+#  define PGB_ALWAYS_INLINE __forceinline
+# else
+#  define PGB_ALWAYS_INLINE inline
+# endif
+#endif /* !defined(PGB_ALWAYS_INLINE) */
+
 #if PEANUT_GB_USE_INTRINSICS
 /* If using MSVC, only enable intrinsics for x86 platforms*/
 # if defined(_MSC_VER) && __has_include("intrin.h") && \
@@ -342,6 +449,34 @@
 	gb->cpu_reg.f_bits.h = 1;						\
 	gb->cpu_reg.f_bits.c = 0;
 
+#if PEANUT_GB_USE_COMPUTED_GOTO
+/* Labels each opcode handler so that it can be jumped to directly. */
+# define PGB_OPCODE(op) case op: pgb_op_##op
+#else
+# define PGB_OPCODE(op) case op
+#endif
+
+#if PEANUT_GB_FUSE_OPCODES
+/* If the next opcode is JR cc, dispatch straight to it. The byte is only
+ * counted as a read once it is taken as the opcode, as it is read again by
+ * the next step otherwise. */
+# define PGB_FUSE_JR()								\
+	{									\
+		const uint8_t next = __gb_peek(gb, gb->cpu_reg.pc.reg);		\
+		if((next & 0xE7) == 0x20)					\
+		{								\
+			PGB_HEATMAP_COUNT(read,					\
+				PEANUT_GB_GET_MSN16(gb->cpu_reg.pc.reg));	\
+			gb->cpu_reg.pc.reg++;					\
+			inst_cycles += op_cycles[next];				\
+			PGB_HEATMAP_COUNT(op, next);				\
+			goto *op_labels[next];					\
+		}								\
+	}
+#else
+# define PGB_FUSE_JR()
+#endif
+
 #if PEANUT_GB_IS_LITTLE_ENDIAN
 # define PEANUT_GB_GET_LSB16(x) (x & 0xFF)
 # define PEANUT_GB_GET_MSB16(x) (x >> 8)
@@ -428,8 +563,25 @@ struct count_s
 	uint_fast16_t div_count;	/* Divider Register Counter */
 	uint_fast16_t tima_count;	/* Timer Counter */
 	uint_fast16_t serial_count;	/* Serial Counter */
+#if PEANUT_GB_EVENT_SCHEDULER
+	uint_fast16_t pending;		/* Cycles not yet applied */
+	uint_fast16_t next_event;	/* Cycles until next event */
+#endif
+#if PEANUT_GB_FAST_HALT
+	uint64_t halt_cycles;		/* Cycles spent halted, for telemetry */
+#endif
 };
 
+#if PEANUT_GB_HEATMAP
+struct heatmap_s
+{
+	uint32_t op[0x100];	/* Opcodes executed, including fused ones */
+	uint32_t cb_op[0x100];	/* CB prefixed opcodes executed */
+	uint32_t read[16];	/* Reads of each 4 KiB region, with fetches */
+	uint32_t write[16];	/* Writes to each 4 KiB region */
+};
+#endif
+
 #if ENABLE_LCD
 	/* Bit mask for the shade of pixel to display */
 	#define LCD_COLOUR	0x03
@@ -473,14 +625,89 @@ enum gb_init_error_e
 	GB_INIT_INVALID_CHECKSUM
 };
 
+/**
+ * Errors that may occur when loading a save state.
+ */
+enum gb_state_error_e
+{
+	GB_STATE_NO_ERROR = 0,
+	/* The buffer is smaller than the state it holds. */
+	GB_STATE_INVALID_SIZE,
+	/* The buffer does not hold a save state. */
+	GB_STATE_INVALID_FORMAT,
+	/* The state was saved with another version of the format. */
+	GB_STATE_VERSION_MISMATCH,
+	/* The state was saved from another ROM. */
+	GB_STATE_ROM_MISMATCH
+};
+
 /**
  * Return codes for serial receive function, mainly for clarity.
  */
 enum gb_serial_rx_ret_e
 {
 	GB_SERIAL_RX_SUCCESS = 0,
-	GB_SERIAL_RX_NO_CONNECTION = 1
+	GB_SERIAL_RX_NO_CONNECTION = 1,
+	/* The peer is connected but has not sent its byte yet. The transfer
+	 * is left pending whatever the clock source, and retried. */
+	GB_SERIAL_RX_PENDING = 2
+};
+
+/**
+ * Registers used to render a line, captured when the line is drawn.
+ */
+struct gb_line_s
+{
+	uint8_t ly;
+	uint8_t lcdc;
+	uint8_t scy;
+	uint8_t scx;
+	uint8_t wy;
+	uint8_t wx;
+	/* Line of the window to draw. */
+	uint8_t window_line;
+	uint8_t bg_palette[4];
+	uint8_t sp_palette[8];
+#if PEANUT_GB_SPLIT_RENDER
+	/* OAM snapshot to draw the sprites from. */
+	uint8_t oam;
+#endif
+};
+
+#if PEANUT_GB_SPRITE_BUCKETS
+/**
+ * Sprites on each line, from highest to lowest priority.
+ */
+struct gb_sprite_lines_s
+{
+	uint8_t line[LCD_HEIGHT][MAX_SPRITES_LINE];
+	uint8_t count[LCD_HEIGHT];
+	/* Cleared when OAM or the sprite size changes. */
+	uint8_t valid;
 };
+#endif
+
+#if PEANUT_GB_SPLIT_RENDER
+/* Number of OAM snapshots that queued lines are rendered from. */
+#define PGB_OAM_SNAPSHOTS	2
+
+/**
+ * Copy of OAM taken when the first line after an OAM or sprite size change
+ * is queued, so that OAM may change while earlier lines are rendered.
+ */
+struct gb_oam_snapshot_s
+{
+	uint8_t oam[OAM_SIZE];
+	/* Ticket of the last line queued with this snapshot. */
+	uint32_t ticket;
+	/* Set while lines queued with this snapshot may not be rendered. */
+	uint8_t queued;
+# if PEANUT_GB_SPRITE_BUCKETS
+	/* Only written while rendering. */
+	struct gb_sprite_lines_s sprites;
+# endif
+};
+#endif
 
 /**
  * Emulator context.
@@ -490,6 +717,52 @@ enum gb_serial_rx_ret_e
  */
 struct gb_s
 {
+	/* Fields used by every instruction come first, so that the CPU can
+	 * reach them with the short immediate offsets of Thumb-1 loads and
+	 * stores (0-31 for bytes, 0-124 for words). Flags are whole bytes
+	 * rather than bitfields so that they are read without masking. */
+	struct cpu_registers_s cpu_reg;
+	uint8_t gb_halt;
+	uint8_t gb_ime;
+	uint8_t gb_frame; /* New frame drawn. */
+	uint8_t lcd_blank;
+	struct count_s counter;
+
+	/* Cartridge information:
+	 * Selected ROM bank and the MBC registers written by the game. */
+	uint16_t selected_rom_bank;
+	/* Memory Bank Controller (MBC) type. */
+	int8_t mbc;
+	/* Cartridge ROM/RAM mode select. */
+	uint8_t cart_mode_select;
+	uint8_t enable_cart_ram;
+	/* WRAM and VRAM bank selection not available. */
+	uint8_t cart_ram_bank;
+	/* Number of ROM banks in cartridge. */
+	uint16_t num_rom_banks_mask;
+	/* Number of RAM banks in cartridge. Ignore for MBC2. */
+	uint8_t num_ram_banks;
+	/* Whether the MBC has internal RAM. */
+	uint8_t cart_ram;
+
+	/* Pointers to ROM bank 0 and to the selected ROM bank. NULL if these
+	 * must be read using gb_rom_read. */
+	const uint8_t *rom_bank0;
+	const uint8_t *rom_bankn;
+
+	/* I/O registers are read by every step. On a 32 bit target the array
+	 * starts at byte 68 of the context, so the registers up to 0xFFBB (IF,
+	 * the timer, sound and LCD registers) are within the 0-255 range of a
+	 * movs immediate offset. The rest of HRAM and IE are beyond it. */
+	uint8_t hram_io[HRAM_IO_SIZE];
+
+#if PEANUT_GB_USE_PAGE_TABLE
+	/* Direct pointers to each 4 KiB page of the memory map. NULL if the
+	 * page must be decoded by __gb_read() or __gb_write(). */
+	const uint8_t *rd_page[16];
+	uint8_t *wr_page[16];
+#endif
+
 	/**
 	 * Return byte from ROM at given address.
 	 *
@@ -534,30 +807,25 @@ struct gb_s
 	/* Read byte from boot ROM at given address. */
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t addr);
 
-	struct
-	{
-		unsigned gb_halt	: 1;
-		unsigned gb_ime		: 1;
-		unsigned gb_frame	: 1; /* New frame drawn. */
-		unsigned lcd_blank	: 1;
-	};
-
-	/* Cartridge information:
-	 * Memory Bank Controller (MBC) type. */
-	int8_t mbc;
-	/* Whether the MBC has internal RAM. */
-	uint8_t cart_ram;
-	/* Number of ROM banks in cartridge. */
-	uint16_t num_rom_banks_mask;
-	/* Number of RAM banks in cartridge. Ignore for MBC2. */
-	uint8_t num_ram_banks;
+	/**
+	 * Return pointer to the start of a 16 KiB ROM bank. Optional, and only
+	 * called when the selected ROM bank changes.
+	 *
+	 * \param gb_s	emulator context
+	 * \param bank	ROM bank number
+	 * \return		pointer to ROM bank, or NULL to use gb_rom_read
+	 */
+	const uint8_t *(*gb_rom_bank_ptr)(struct gb_s*, const uint_fast16_t bank);
+
+#if PEANUT_GB_MBC_VARIANTS
+	/* Variants of __gb_read_cart_ram(), __gb_write_cart_ram() and
+	 * __gb_write_mbc() for the MBC of the cartridge. */
+	uint8_t (*mbc_read_cart_ram)(struct gb_s*, uint_fast16_t addr);
+	void (*mbc_write_cart_ram)(struct gb_s*, uint_fast16_t addr,
+			uint8_t val);
+	void (*mbc_write)(struct gb_s*, uint_fast16_t addr, uint8_t val);
+#endif
 
-	uint16_t selected_rom_bank;
-	/* WRAM and VRAM bank selection not available. */
-	uint8_t cart_ram_bank;
-	uint8_t enable_cart_ram;
-	/* Cartridge ROM/RAM mode select. */
-	uint8_t cart_mode_select;
 	union
 	{
 		struct
@@ -571,15 +839,20 @@ struct gb_s
 		uint8_t cart_rtc[5];
 	};
 
-	struct cpu_registers_s cpu_reg;
 	//struct gb_registers_s gb_reg;
-	struct count_s counter;
+#if PEANUT_GB_HEATMAP
+	struct heatmap_s heatmap;
+#endif
 
 	/* TODO: Allow implementation to allocate WRAM, VRAM and Frame Buffer. */
 	uint8_t wram[WRAM_SIZE];
 	uint8_t vram[VRAM_SIZE];
+#if PEANUT_GB_TILE_CACHE
+	/* Tile rows with the colour of the pixel in bit n of both bitplanes
+	 * stored in bits 2n+1 and 2n. */
+	uint16_t tile_cache[TILE_CACHE_ROWS];
+#endif
 	uint8_t oam[OAM_SIZE];
-	uint8_t hram_io[HRAM_IO_SIZE];
 
 	struct
 	{
@@ -606,6 +879,35 @@ struct gb_s
 				const uint8_t *pixels,
 				const uint_fast8_t line);
 
+#if PEANUT_GB_SPLIT_RENDER
+		/**
+		 * Queue line to be rendered with gb_render_line(). NULL if
+		 * lines are rendered immediately.
+		 */
+		uint32_t (*lcd_queue_line)(struct gb_s *gb,
+				const struct gb_line_s *line);
+
+		/**
+		 * Wait until the line queued with the given ticket is
+		 * rendered. Called before VRAM changes and before an OAM
+		 * snapshot is reused.
+		 */
+		void (*lcd_wait_line)(struct gb_s *gb, uint32_t ticket);
+
+		struct gb_oam_snapshot_s oam_snapshot[PGB_OAM_SNAPSHOTS];
+		/* Snapshot of the lines being queued. */
+		uint8_t oam_current;
+		/* Set when OAM or the sprite size changed since the current
+		 * snapshot was taken. */
+		uint8_t oam_changed;
+		/* Set while queued lines may not be rendered. */
+		uint8_t lines_queued;
+		/* Ticket of the last line queued. */
+		uint32_t line_ticket;
+#elif PEANUT_GB_SPRITE_BUCKETS
+		struct gb_sprite_lines_s sprites;
+#endif
+
 		/* Palettes */
 		uint8_t bg_palette[4];
 		uint8_t sp_palette[8];
@@ -613,8 +915,9 @@ struct gb_s
 		uint8_t window_clear;
 		uint8_t WY;
 
-		/* Only support 30fps frame skip. */
-		unsigned frame_skip_count : 1;
+		/* Frames skipped since the last drawn frame. The frame is drawn
+		 * once this reaches direct.frame_skip_ratio. */
+		uint8_t frame_skip_count;
 		unsigned interlace_count : 1;
 	} display;
 
@@ -633,6 +936,11 @@ struct gb_s
 		unsigned interlace : 1;
 		unsigned frame_skip : 1;
 
+		/* Number of frames skipped before each drawn frame when
+		 * frame_skip is set. Defaults to 1 (30fps). May be changed at
+		 * any time, taking effect after the next drawn frame. */
+		uint8_t frame_skip_ratio;
+
 		union
 		{
 			struct
@@ -690,144 +998,192 @@ struct gb_s
 #define IO_STAT_MODE_SEARCH_TRANSFER	3
 #define IO_STAT_MODE_VBLANK_OR_TRANSFER_MASK 0x1
 
+/* Number of cycles between TIMA increments for each TAC rate. */
+static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+
+#if PEANUT_GB_EVENT_SCHEDULER
+static void __gb_sync_peripherals(struct gb_s *gb);
+#endif
+
+#if ENABLE_LCD && PEANUT_GB_SPLIT_RENDER
 /**
- * Internal function used to read bytes.
- * addr is host platform endian.
+ * Internal function used to wait for queued lines to be rendered before
+ * changing VRAM, which they are rendered from.
  */
-uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+static inline void __gb_render_wait(struct gb_s *gb)
 {
-	switch(PEANUT_GB_GET_MSN16(addr))
-	{
-	case 0x0:
-		/* IO_BANK is only set to 1 if gb->gb_bootrom_read was not NULL
-		 * on reset. */
-		if(gb->hram_io[IO_BANK] == 0 && addr < 0x0100)
-		{
-			return gb->gb_bootrom_read(gb, addr);
-		}
-
-		/* Fallthrough */
-	case 0x1:
-	case 0x2:
-	case 0x3:
-		return gb->gb_rom_read(gb, addr);
-
-	case 0x4:
-	case 0x5:
-	case 0x6:
-	case 0x7:
-		if(gb->mbc == 1 && gb->cart_mode_select)
-			return gb->gb_rom_read(gb,
-					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
-		else
-			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
-
-	case 0x8:
-	case 0x9:
-		return gb->vram[addr - VRAM_ADDR];
-
-	case 0xA:
-	case 0xB:
-		if(gb->cart_ram && gb->enable_cart_ram)
-		{
-			if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-				return gb->cart_rtc[gb->cart_ram_bank - 0x08];
-			else if(gb->mbc == 2)
-			{
-				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
-				return gb->gb_cart_ram_read(gb, addr);
-			}
-			else if((gb->cart_mode_select || gb->mbc != 1) &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
-							    (gb->cart_ram_bank * CRAM_BANK_SIZE));
-			}
-			else
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
-		}
-
-		return 0xFF;
-
-	case 0xC:
-	case 0xD:
-		return gb->wram[addr - WRAM_0_ADDR];
+	if(!gb->display.lines_queued)
+		return;
 
-	case 0xE:
-		return gb->wram[addr - ECHO_ADDR];
+	gb->display.lcd_wait_line(gb, gb->display.line_ticket);
+	gb->display.lines_queued = 0;
+	for(uint_fast8_t i = 0; i < PGB_OAM_SNAPSHOTS; i++)
+		gb->display.oam_snapshot[i].queued = 0;
+}
+#endif
 
-	case 0xF:
-		if(addr < OAM_ADDR)
-			return gb->wram[addr - ECHO_ADDR];
+/**
+ * Internal function called when OAM or the sprite size changes. With
+ * PEANUT_GB_SPLIT_RENDER, a new OAM snapshot is taken for the next line
+ * queued, instead of waiting for the queued lines.
+ */
+static inline void __gb_oam_changed(struct gb_s *gb)
+{
+#if ENABLE_LCD && PEANUT_GB_SPLIT_RENDER
+	gb->display.oam_changed = 1;
+#elif PEANUT_GB_SPRITE_BUCKETS
+	gb->display.sprites.valid = 0;
+#else
+	(void) gb;
+#endif
+}
 
-		if(addr < UNUSED_ADDR)
-			return gb->oam[addr - OAM_ADDR];
+#if PEANUT_GB_TILE_CACHE
+/**
+ * Internal function used to decode the tile row containing the given VRAM
+ * offset into the tile cache.
+ */
+static void __gb_update_tile_cache(struct gb_s *gb, const uint_fast16_t offset)
+{
+	uint_fast16_t lo = gb->vram[offset & ~1];
+	uint_fast16_t hi = gb->vram[offset | 1];
+
+	/* Spread bit n of each bitplane to bit 2n. */
+	lo = (lo | (lo << 4)) & 0x0F0F;
+	lo = (lo | (lo << 2)) & 0x3333;
+	lo = (lo | (lo << 1)) & 0x5555;
+	hi = (hi | (hi << 4)) & 0x0F0F;
+	hi = (hi | (hi << 2)) & 0x3333;
+	hi = (hi | (hi << 1)) & 0x5555;
+
+	gb->tile_cache[offset >> 1] = (uint16_t)(lo | (hi << 1));
+}
+#endif
 
-		/* Unusable memory area. Reading from this area returns 0xFF.*/
-		if(addr < IO_ADDR)
-			return 0xFF;
+/**
+ * Internal function used to update the cached ROM bank pointers. Must be
+ * called whenever the selected ROM bank, MBC1 mode or boot ROM mapping
+ * changes.
+ */
+static void __gb_update_rom_bank(struct gb_s *gb)
+{
+	uint_fast16_t bank = gb->selected_rom_bank;
 
-		/* APU registers. */
-		if((addr >= 0xFF10) && (addr <= 0xFF3F))
-		{
-#if ENABLE_SOUND
-			return audio_read(addr);
-#else
-			static const uint8_t ortab[] = {
-				0x80, 0x3f, 0x00, 0xff, 0xbf,
-				0xff, 0x3f, 0x00, 0xff, 0xbf,
-				0x7f, 0xff, 0x9f, 0xff, 0xbf,
-				0xff, 0xff, 0x00, 0x00, 0xbf,
-				0x00, 0x00, 0x70,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-			};
-			return gb->hram_io[addr - IO_ADDR] | ortab[addr - IO_ADDR];
-#endif
-		}
+	if(gb->mbc == 1 && gb->cart_mode_select)
+		bank &= 0x1F;
 
-		/* HRAM */
-		if(addr >= IO_ADDR)
-			return gb->hram_io[addr - IO_ADDR];
+	if(gb->gb_rom_bank_ptr != NULL)
+	{
+		gb->rom_bank0 = gb->gb_rom_bank_ptr(gb, 0);
+		gb->rom_bankn = gb->gb_rom_bank_ptr(gb, bank);
+	}
+	else
+	{
+		gb->rom_bank0 = NULL;
+		gb->rom_bankn = NULL;
 	}
 
+#if PEANUT_GB_USE_PAGE_TABLE
+	for(uint_fast8_t i = 0; i < 4; i++)
+	{
+		gb->rd_page[i] = gb->rom_bank0 != NULL ?
+			gb->rom_bank0 + i * 0x1000 : NULL;
+		gb->rd_page[i + 4] = gb->rom_bankn != NULL ?
+			gb->rom_bankn + i * 0x1000 : NULL;
+	}
 
-	/* Return address that caused read error. */
-	(gb->gb_error)(gb, GB_INVALID_READ, addr);
-	PGB_UNREACHABLE();
+	/* The boot ROM overlays the start of bank 0 until it is unmapped. */
+	if(gb->hram_io[IO_BANK] == 0)
+		gb->rd_page[0] = NULL;
+#endif
 }
 
 /**
- * Internal function used to write bytes.
+ * Internal functions used to read and write cartridge RAM, and to write the
+ * MBC registers between 0x0000 and 0x7FFF. "mbc" is gb->mbc, or a constant for
+ * the variants built with PEANUT_GB_MBC_VARIANTS.
  */
-void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+static PGB_ALWAYS_INLINE uint8_t __gb_read_cart_ram(struct gb_s *gb,
+		const int_fast8_t mbc, uint_fast16_t addr)
 {
-	switch(PEANUT_GB_GET_MSN16(addr))
+	if(gb->cart_ram && gb->enable_cart_ram)
 	{
-	case 0x0:
-	case 0x1:
-		/* Set RAM enable bit. MBC2 is handled in fall-through. */
-		if(gb->mbc > 0 && gb->mbc != 2 && gb->cart_ram)
+		if(mbc == 3 && gb->cart_ram_bank >= 0x08)
+			return gb->cart_rtc[gb->cart_ram_bank - 0x08];
+		else if(mbc == 2)
 		{
-			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-			return;
+			/* Only 9 bits are available in address. */
+			addr &= 0x1FF;
+			return gb->gb_cart_ram_read(gb, addr);
 		}
-
-	/* Intentional fall through. */
-	case 0x2:
-		if(gb->mbc == 5)
+		else if((gb->cart_mode_select || mbc != 1) &&
+				gb->cart_ram_bank < gb->num_ram_banks)
 		{
-			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
-			gb->selected_rom_bank =
-				gb->selected_rom_bank & gb->num_rom_banks_mask;
+			return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
+						    (gb->cart_ram_bank * CRAM_BANK_SIZE));
+		}
+		else
+			return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
+	}
+
+	return 0xFF;
+}
+
+static PGB_ALWAYS_INLINE void __gb_write_cart_ram(struct gb_s *gb,
+		const int_fast8_t mbc, uint_fast16_t addr, uint8_t val)
+{
+	/* Do not write to RAM if unavailable or disabled. */
+	if(gb->cart_ram && gb->enable_cart_ram)
+	{
+		if(mbc == 3 && gb->cart_ram_bank >= 0x08)
+			gb->cart_rtc[gb->cart_ram_bank - 0x08] = val;
+		else if(mbc == 2)
+		{
+			/* Only 9 bits are available in address. */
+			addr &= 0x1FF;
+			/* Data is only 4 bits wide in MBC2 RAM. */
+			val &= 0x0F;
+			gb->gb_cart_ram_write(gb, addr, val);
+		}
+		else if(gb->cart_mode_select &&
+				gb->cart_ram_bank < gb->num_ram_banks)
+		{
+			gb->gb_cart_ram_write(gb,
+					      addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), val);
+		}
+		else if(gb->num_ram_banks)
+			gb->gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
+	}
+}
+
+static PGB_ALWAYS_INLINE void __gb_write_mbc(struct gb_s *gb,
+		const int_fast8_t mbc, uint_fast16_t addr, uint8_t val)
+{
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+		/* Set RAM enable bit. MBC2 is handled in fall-through. */
+		if(mbc > 0 && mbc != 2 && gb->cart_ram)
+		{
+			gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+			return;
+		}
+
+	/* Intentional fall through. */
+	case 0x2:
+		if(mbc == 5)
+		{
+			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
+			gb->selected_rom_bank =
+				gb->selected_rom_bank & gb->num_rom_banks_mask;
+			__gb_update_rom_bank(gb);
 			return;
 		}
 
 	/* Intentional fall through. */
 	case 0x3:
-		if(gb->mbc == 1)
+		if(mbc == 1)
 		{
 			//selected_rom_bank = val & 0x7;
 			gb->selected_rom_bank = (val & 0x1F) | (gb->selected_rom_bank & 0x60);
@@ -835,7 +1191,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			if((gb->selected_rom_bank & 0x1F) == 0x00)
 				gb->selected_rom_bank++;
 		}
-		else if(gb->mbc == 2)
+		else if(mbc == 2)
 		{
 			/* If bit 8 is 1, then set ROM bank number. */
 			if(addr & 0x100)
@@ -852,30 +1208,32 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 				return;
 			}
 		}
-		else if(gb->mbc == 3)
+		else if(mbc == 3)
 		{
 			gb->selected_rom_bank = val & 0x7F;
 
 			if(!gb->selected_rom_bank)
 				gb->selected_rom_bank++;
 		}
-		else if(gb->mbc == 5)
+		else if(mbc == 5)
 			gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
 
 		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+		__gb_update_rom_bank(gb);
 		return;
 
 	case 0x4:
 	case 0x5:
-		if(gb->mbc == 1)
+		if(mbc == 1)
 		{
 			gb->cart_ram_bank = (val & 3);
 			gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
 			gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
+			__gb_update_rom_bank(gb);
 		}
-		else if(gb->mbc == 3)
+		else if(mbc == 3)
 			gb->cart_ram_bank = val;
-		else if(gb->mbc == 5)
+		else if(mbc == 5)
 			gb->cart_ram_bank = (val & 0x0F);
 
 		return;
@@ -883,38 +1241,217 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 	case 0x6:
 	case 0x7:
 		gb->cart_mode_select = (val & 1);
+		__gb_update_rom_bank(gb);
 		return;
+	}
+}
+
+#if PEANUT_GB_MBC_VARIANTS
+#define PGB_MBC_VARIANT(n)						\
+	static uint8_t __gb_read_cart_ram_mbc##n(struct gb_s *gb,	\
+			uint_fast16_t addr)				\
+	{								\
+		return __gb_read_cart_ram(gb, n, addr);			\
+	}								\
+	static void __gb_write_cart_ram_mbc##n(struct gb_s *gb,		\
+			uint_fast16_t addr, uint8_t val)		\
+	{								\
+		__gb_write_cart_ram(gb, n, addr, val);			\
+	}								\
+	static void __gb_write_mbc##n(struct gb_s *gb,			\
+			uint_fast16_t addr, uint8_t val)		\
+	{								\
+		__gb_write_mbc(gb, n, addr, val);			\
+	}
+
+PGB_MBC_VARIANT(0)
+PGB_MBC_VARIANT(1)
+PGB_MBC_VARIANT(2)
+PGB_MBC_VARIANT(3)
+PGB_MBC_VARIANT(5)
+#undef PGB_MBC_VARIANT
+
+# define PGB_READ_CART_RAM(gb, addr)	(gb)->mbc_read_cart_ram(gb, addr)
+# define PGB_WRITE_CART_RAM(gb, addr, val) (gb)->mbc_write_cart_ram(gb, addr, val)
+# define PGB_WRITE_MBC(gb, addr, val)	(gb)->mbc_write(gb, addr, val)
+#else
+# define PGB_READ_CART_RAM(gb, addr)	__gb_read_cart_ram(gb, (gb)->mbc, addr)
+# define PGB_WRITE_CART_RAM(gb, addr, val) __gb_write_cart_ram(gb, (gb)->mbc, addr, val)
+# define PGB_WRITE_MBC(gb, addr, val)	__gb_write_mbc(gb, (gb)->mbc, addr, val)
+#endif
+
+/**
+ * Internal function used to read bytes.
+ * addr is host platform endian.
+ * Heatmap builds read through __gb_peek() when a byte must not be counted.
+ */
+#if PEANUT_GB_HEATMAP
+static uint8_t __gb_peek(struct gb_s *gb, uint16_t addr)
+#else
+uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+#endif
+{
+#if PEANUT_GB_USE_PAGE_TABLE
+	const uint8_t *page = gb->rd_page[PEANUT_GB_GET_MSN16(addr)];
+
+	if(page != NULL)
+		return page[addr & 0x0FFF];
+#endif
+
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+		/* IO_BANK is only set to 1 if gb->gb_bootrom_read was not NULL
+		 * on reset. */
+		if(gb->hram_io[IO_BANK] == 0 && addr < 0x0100)
+		{
+			return gb->gb_bootrom_read(gb, addr);
+		}
+
+		/* Fallthrough */
+	case 0x1:
+	case 0x2:
+	case 0x3:
+		if(gb->rom_bank0 != NULL)
+			return gb->rom_bank0[addr];
+
+		return gb->gb_rom_read(gb, addr);
+
+	case 0x4:
+	case 0x5:
+	case 0x6:
+	case 0x7:
+		if(gb->rom_bankn != NULL)
+			return gb->rom_bankn[addr - ROM_N_ADDR];
+
+		if(gb->mbc == 1 && gb->cart_mode_select)
+			return gb->gb_rom_read(gb,
+					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
+		else
+			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
 
 	case 0x8:
 	case 0x9:
-		gb->vram[addr - VRAM_ADDR] = val;
-		return;
+		return gb->vram[addr - VRAM_ADDR];
 
 	case 0xA:
 	case 0xB:
-		/* Do not write to RAM if unavailable or disabled. */
-		if(gb->cart_ram && gb->enable_cart_ram)
+		return PGB_READ_CART_RAM(gb, addr);
+
+	case 0xC:
+	case 0xD:
+		return gb->wram[addr - WRAM_0_ADDR];
+
+	case 0xE:
+		return gb->wram[addr - ECHO_ADDR];
+
+	case 0xF:
+		if(addr < OAM_ADDR)
+			return gb->wram[addr - ECHO_ADDR];
+
+		if(addr < UNUSED_ADDR)
+			return gb->oam[addr - OAM_ADDR];
+
+		/* Unusable memory area. Reading from this area returns 0xFF.*/
+		if(addr < IO_ADDR)
+			return 0xFF;
+
+		/* APU registers. */
+		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
-			if(gb->mbc == 3 && gb->cart_ram_bank >= 0x08)
-				gb->cart_rtc[gb->cart_ram_bank - 0x08] = val;
-			else if(gb->mbc == 2)
-			{
-				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
-				/* Data is only 4 bits wide in MBC2 RAM. */
-				val &= 0x0F;
-				gb->gb_cart_ram_write(gb, addr, val);
-			}
-			else if(gb->cart_mode_select &&
-					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				gb->gb_cart_ram_write(gb,
-						      addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), val);
-			}
-			else if(gb->num_ram_banks)
-				gb->gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
+#if ENABLE_SOUND
+			return audio_read(addr);
+#else
+			static const uint8_t ortab[] = {
+				0x80, 0x3f, 0x00, 0xff, 0xbf,
+				0xff, 0x3f, 0x00, 0xff, 0xbf,
+				0x7f, 0xff, 0x9f, 0xff, 0xbf,
+				0xff, 0xff, 0x00, 0x00, 0xbf,
+				0x00, 0x00, 0x70,
+				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+			};
+			return gb->hram_io[addr - IO_ADDR] | ortab[addr - IO_ADDR];
+#endif
 		}
 
+#if PEANUT_GB_EVENT_SCHEDULER
+		/* DIV and TIMA are updated lazily. */
+		if(addr == 0xFF04 || addr == 0xFF05)
+			__gb_sync_peripherals(gb);
+#endif
+
+		/* HRAM */
+		if(addr >= IO_ADDR)
+			return gb->hram_io[addr - IO_ADDR];
+	}
+
+
+	/* Return address that caused read error. */
+	(gb->gb_error)(gb, GB_INVALID_READ, addr);
+	PGB_UNREACHABLE();
+}
+
+#if PEANUT_GB_HEATMAP
+uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+{
+	PGB_HEATMAP_COUNT(read, PEANUT_GB_GET_MSN16(addr));
+	return __gb_peek(gb, addr);
+}
+#else
+# define __gb_peek __gb_read
+#endif
+
+/**
+ * Internal function used to write bytes.
+ */
+void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	PGB_HEATMAP_COUNT(write, PEANUT_GB_GET_MSN16(addr));
+
+#if PEANUT_GB_USE_PAGE_TABLE
+	uint8_t *page = gb->wr_page[PEANUT_GB_GET_MSN16(addr)];
+
+	if(page != NULL)
+	{
+		page[addr & 0x0FFF] = val;
+		return;
+	}
+#endif
+
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+	case 0x2:
+	case 0x3:
+	case 0x4:
+	case 0x5:
+	case 0x6:
+	case 0x7:
+		PGB_WRITE_MBC(gb, addr, val);
+		return;
+
+	case 0x8:
+	case 0x9:
+#if ENABLE_LCD && PEANUT_GB_SPLIT_RENDER
+		/* Rewriting the same value does not wait for queued lines. */
+		if(gb->vram[addr - VRAM_ADDR] == val)
+			return;
+
+		__gb_render_wait(gb);
+#endif
+		gb->vram[addr - VRAM_ADDR] = val;
+#if PEANUT_GB_TILE_CACHE
+		if(addr < VRAM_ADDR + VRAM_BMAP_1)
+			__gb_update_tile_cache(gb, addr - VRAM_ADDR);
+#endif
+		return;
+
+	case 0xA:
+	case 0xB:
+		PGB_WRITE_CART_RAM(gb, addr, val);
 		return;
 
 	case 0xC:
@@ -938,6 +1475,8 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 
 		if(addr < UNUSED_ADDR)
 		{
+			if(gb->oam[addr - OAM_ADDR] != val)
+				__gb_oam_changed(gb);
 			gb->oam[addr - OAM_ADDR] = val;
 			return;
 		}
@@ -962,6 +1501,19 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 		}
 
+#if PEANUT_GB_EVENT_SCHEDULER
+		/* Apply pending cycles before changing registers that the
+		 * timers, serial or LCD depend on, and reschedule after. */
+		switch(PEANUT_GB_GET_LSB16(addr))
+		{
+		case 0x02: case 0x04: case 0x05: case 0x06: case 0x07:
+		case 0x40:
+			__gb_sync_peripherals(gb);
+			gb->counter.next_event = 0;
+			break;
+		}
+#endif
+
 		/* IO and Interrupts. */
 		switch(PEANUT_GB_GET_LSB16(addr))
 		{
@@ -1020,6 +1572,11 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			/* Check if LCD is already enabled. */
 			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
 
+#if PEANUT_GB_SPRITE_BUCKETS
+			if((gb->hram_io[IO_LCDC] ^ val) & LCDC_OBJ_SIZE)
+				__gb_oam_changed(gb);
+#endif
+
 			gb->hram_io[IO_LCDC] = val;
 
 			/* Check if LCD is going to be switched on. */
@@ -1074,6 +1631,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 				gb->oam[i] = __gb_read(gb, dma_addr + i);
 			}
 
+			__gb_oam_changed(gb);
 			return;
 		}
 
@@ -1114,6 +1672,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* Turn off boot ROM */
 		case 0x50:
 			gb->hram_io[IO_BANK] = val;
+			__gb_update_rom_bank(gb);
 			return;
 
 		/* Interrupt Enable Register */
@@ -1137,6 +1696,7 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 	uint8_t val;
 	uint8_t writeback = 1;
 
+	PGB_HEATMAP_COUNT(cb_op, cbop);
 	inst_cycles = 8;
 	/* Add an additional 8 cycles to these sets of instructions. */
 	switch(cbop & 0xC7)
@@ -1328,7 +1888,62 @@ struct sprite_data {
 	uint8_t x;
 };
 
-#if PEANUT_GB_HIGH_LCD_ACCURACY
+#if PEANUT_GB_SPRITE_BUCKETS
+/**
+ * Internal function used to sort sprites into the lines that they are drawn
+ * on. Like the Game Boy, the first ten sprites in OAM found on a line are
+ * selected. They are then ordered by X coordinate, and by OAM index for
+ * sprites with the same X coordinate.
+ */
+static void __gb_update_sprite_lines(struct gb_sprite_lines_s *sprites,
+		const uint8_t *oam, const uint8_t lcdc)
+{
+	const int_fast16_t height = (lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+
+	memset(sprites->count, 0, sizeof(sprites->count));
+
+	for(uint_fast8_t s = 0; s < NUM_SPRITES; s++)
+	{
+		/* Sprite Y position. */
+		const uint8_t OY = oam[4 * s + 0];
+		/* Sprite X position. */
+		const uint8_t OX = oam[4 * s + 1];
+		int_fast16_t y = (int_fast16_t)OY - 16;
+		int_fast16_t end = y + height;
+
+		if(y < 0)
+			y = 0;
+
+		if(end > LCD_HEIGHT)
+			end = LCD_HEIGHT;
+
+		for(; y < end; y++)
+		{
+			uint8_t *line = sprites->line[y];
+			uint_fast8_t n = sprites->count[y];
+
+			if(n == MAX_SPRITES_LINE)
+				continue;
+
+			sprites->count[y] = n + 1;
+
+			/* Insert sorted by X. Sprites are added in OAM order,
+			 * so the sort is stable. */
+			while(n > 0 && oam[4 * line[n - 1] + 1] > OX)
+			{
+				line[n] = line[n - 1];
+				n--;
+			}
+
+			line[n] = s;
+		}
+	}
+
+	sprites->valid = 1;
+}
+#endif
+
+#if PEANUT_GB_HIGH_LCD_ACCURACY && !PEANUT_GB_SPRITE_BUCKETS
 static int compare_sprites(const void *in1, const void *in2)
 {
 	const struct sprite_data *sd1, *sd2;
@@ -1343,59 +1958,87 @@ static int compare_sprites(const void *in1, const void *in2)
 }
 #endif
 
-void __gb_draw_line(struct gb_s *gb)
+#if PEANUT_GB_TILE_CACHE
+/**
+ * Internal function used to draw background or window tiles from the tile
+ * cache, from right to left, one tile row at a time.
+ *
+ * \param map		First entry of the tile map row to draw.
+ * \param ofs		Added to the display X coordinate to get the tile map
+ * 			X coordinate.
+ * \param py		Row within the tile.
+ * \param disp_x	First display X coordinate to draw.
+ * \param end		Display X coordinate to stop at, exclusive.
+ */
+static void __gb_draw_tiles(const struct gb_s *gb,
+		const struct gb_line_s *line, uint8_t *pixels,
+		const uint8_t *map, const uint8_t ofs, const uint8_t py,
+		uint8_t disp_x, const uint8_t end)
 {
-	uint8_t pixels[160] = {0};
+	const uint_fast8_t unsigned_idx = line->lcdc & LCDC_TILE_SELECT;
 
-	/* If LCD not initialised by front-end, don't render anything. */
-	if(gb->display.lcd_draw_line == NULL)
-		return;
+	do
+	{
+		const uint8_t x = disp_x + ofs;
+		uint_fast16_t tile = map[x >> 3];
+		uint_fast16_t row;
+		uint_fast8_t n;
 
-	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
-		return;
+		/* In 0x8800 addressing mode, tiles 0-127 are at 0x9000. */
+		if(!unsigned_idx && tile < 0x80)
+			tile += 0x100;
 
-	/* If interlaced mode is activated, check if we need to draw the current
-	 * line. */
-	if(gb->direct.interlace)
-	{
-		if((gb->display.interlace_count == 0
-				&& (gb->hram_io[IO_LY] & 1) == 0)
-				|| (gb->display.interlace_count == 1
-				    && (gb->hram_io[IO_LY] & 1) == 1))
+		/* Skip the pixels right of the display X coordinate. */
+		row = gb->tile_cache[tile * 8 + py] >> (2 * (7 - (x & 0x07)));
+		n = (x & 0x07) + 1;
+
+		do
 		{
-			/* Compensate for missing window draw if required. */
-			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-					&& gb->hram_io[IO_LY] >= gb->display.WY
-					&& gb->hram_io[IO_WX] <= 166)
-				gb->display.window_clear++;
+			pixels[disp_x] = line->bg_palette[row & 0x3] |
+					 LCD_PALETTE_BG;
+			row >>= 2;
+			disp_x--;
+		} while(--n != 0 && disp_x != end);
+	} while(disp_x != end);
+}
+#endif
 
-			return;
-		}
-	}
+/**
+ * Internal function used to render a line from the captured line registers,
+ * and pass it to lcd_draw_line.
+ */
+static void __gb_render_line(struct gb_s *gb, const struct gb_line_s *line)
+{
+	uint8_t pixels[160] = {0};
 
 	/* If background is enabled, draw it. */
-	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	if(line->lcdc & LCDC_BG_ENABLE)
 	{
 		/* Calculate current background line to draw. Constant because
 		 * this function draws only this one line each time it is
 		 * called. */
-		const uint8_t bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+		const uint8_t bg_y = line->ly + line->scy;
 
 		/* Get selected background map address for first tile
 		 * corresponding to current line.
 		 * 0x20 (32) is the width of a background tile, and the bit
 		 * shift is to calculate the address. */
 		const uint16_t bg_map =
-			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			((line->lcdc & LCDC_BG_MAP) ?
 			 VRAM_BMAP_2 : VRAM_BMAP_1)
 			+ (bg_y >> 3) * 0x20;
 
+#if PEANUT_GB_TILE_CACHE
+		__gb_draw_tiles(gb, line, pixels, &gb->vram[bg_map],
+				line->scx, bg_y & 0x07,
+				LCD_WIDTH - 1, 0xFF);
+#else
 		/* The displays (what the player sees) X coordinate, drawn right
 		 * to left. */
 		uint8_t disp_x = LCD_WIDTH - 1;
 
 		/* The X coordinate to begin drawing the background at. */
-		uint8_t bg_x = disp_x + gb->hram_io[IO_SCX];
+		uint8_t bg_x = disp_x + line->scx;
 
 		/* Get tile index for current background tile. */
 		uint8_t idx = gb->vram[bg_map + (bg_x >> 3)];
@@ -1407,7 +2050,7 @@ void __gb_draw_line(struct gb_s *gb)
 		uint16_t tile;
 
 		/* Select addressing mode. */
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+		if(line->lcdc & LCDC_TILE_SELECT)
 			tile = VRAM_TILES_1 + idx * 0x10;
 		else
 			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
@@ -1424,10 +2067,10 @@ void __gb_draw_line(struct gb_s *gb)
 			{
 				/* fetch next tile */
 				px = 0;
-				bg_x = disp_x + gb->hram_io[IO_SCX];
+				bg_x = disp_x + line->scx;
 				idx = gb->vram[bg_map + (bg_x >> 3)];
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+				if(line->lcdc & LCDC_TILE_SELECT)
 					tile = VRAM_TILES_1 + idx * 0x10;
 				else
 					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
@@ -1439,35 +2082,42 @@ void __gb_draw_line(struct gb_s *gb)
 
 			/* copy background */
 			uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
+			pixels[disp_x] = line->bg_palette[c];
 			pixels[disp_x] |= LCD_PALETTE_BG;
 			t1 = t1 >> 1;
 			t2 = t2 >> 1;
 			px++;
 		}
+#endif
 	}
 
 	/* draw window */
-	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-			&& gb->hram_io[IO_LY] >= gb->display.WY
-			&& gb->hram_io[IO_WX] <= 166)
+	if(line->lcdc & LCDC_WINDOW_ENABLE
+			&& line->ly >= line->wy
+			&& line->wx <= 166)
 	{
 		/* Calculate Window Map Address. */
-		uint16_t win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+		uint16_t win_line = (line->lcdc & LCDC_WINDOW_MAP) ?
 				    VRAM_BMAP_2 : VRAM_BMAP_1;
-		win_line += (gb->display.window_clear >> 3) * 0x20;
+		win_line += (line->window_line >> 3) * 0x20;
 
+#if PEANUT_GB_TILE_CACHE
+		__gb_draw_tiles(gb, line, pixels, &gb->vram[win_line],
+				7 - line->wx,
+				line->window_line & 0x07, LCD_WIDTH - 1,
+				(line->wx < 7 ? 0 : line->wx - 7) - 1);
+#else
 		uint8_t disp_x = LCD_WIDTH - 1;
-		uint8_t win_x = disp_x - gb->hram_io[IO_WX] + 7;
+		uint8_t win_x = disp_x - line->wx + 7;
 
 		// look up tile
-		uint8_t py = gb->display.window_clear & 0x07;
+		uint8_t py = line->window_line & 0x07;
 		uint8_t px = 7 - (win_x & 0x07);
 		uint8_t idx = gb->vram[win_line + (win_x >> 3)];
 
 		uint16_t tile;
 
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+		if(line->lcdc & LCDC_TILE_SELECT)
 			tile = VRAM_TILES_1 + idx * 0x10;
 		else
 			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
@@ -1479,7 +2129,7 @@ void __gb_draw_line(struct gb_s *gb)
 		uint8_t t2 = gb->vram[tile + 1] >> px;
 
 		// loop & copy window
-		uint8_t end = (gb->hram_io[IO_WX] < 7 ? 0 : gb->hram_io[IO_WX] - 7) - 1;
+		uint8_t end = (line->wx < 7 ? 0 : line->wx - 7) - 1;
 
 		for(; disp_x != end; disp_x--)
 		{
@@ -1487,10 +2137,10 @@ void __gb_draw_line(struct gb_s *gb)
 			{
 				// fetch next tile
 				px = 0;
-				win_x = disp_x - gb->hram_io[IO_WX] + 7;
+				win_x = disp_x - line->wx + 7;
 				idx = gb->vram[win_line + (win_x >> 3)];
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+				if(line->lcdc & LCDC_TILE_SELECT)
 					tile = VRAM_TILES_1 + idx * 0x10;
 				else
 					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
@@ -1502,24 +2152,45 @@ void __gb_draw_line(struct gb_s *gb)
 
 			// copy window
 			uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
-			pixels[disp_x] = gb->display.bg_palette[c];
+			pixels[disp_x] = line->bg_palette[c];
 			pixels[disp_x] |= LCD_PALETTE_BG;
 			t1 = t1 >> 1;
 			t2 = t2 >> 1;
 			px++;
 		}
-
-		gb->display.window_clear++; // advance window line
+#endif
 	}
 
 	// draw sprites
-	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
+	if(line->lcdc & LCDC_OBJ_ENABLE)
 	{
-#if PEANUT_GB_HIGH_LCD_ACCURACY
-		uint8_t number_of_sprites = 0;
-		struct sprite_data sprites_to_render[NUM_SPRITES];
-
-		/* Record number of sprites on the line being rendered, limited
+#if PEANUT_GB_SPLIT_RENDER
+		struct gb_oam_snapshot_s *snapshot =
+			&gb->display.oam_snapshot[line->oam];
+		const uint8_t *oam = snapshot->oam;
+# if PEANUT_GB_SPRITE_BUCKETS
+		struct gb_sprite_lines_s *sprites = &snapshot->sprites;
+# endif
+#else
+		const uint8_t *oam = gb->oam;
+# if PEANUT_GB_SPRITE_BUCKETS
+		struct gb_sprite_lines_s *sprites = &gb->display.sprites;
+# endif
+#endif
+#if PEANUT_GB_SPRITE_BUCKETS
+		uint8_t number_of_sprites;
+		const uint8_t *sprites_to_render;
+
+		if(!sprites->valid)
+			__gb_update_sprite_lines(sprites, oam, line->lcdc);
+
+		number_of_sprites = sprites->count[line->ly];
+		sprites_to_render = sprites->line[line->ly];
+#elif PEANUT_GB_HIGH_LCD_ACCURACY
+		uint8_t number_of_sprites = 0;
+		struct sprite_data sprites_to_render[NUM_SPRITES];
+
+		/* Record number of sprites on the line being rendered, limited
 		 * to the maximum number sprites that the Game Boy is able to
 		 * render on each line (10 sprites). */
 		for(uint8_t sprite_number = 0;
@@ -1527,14 +2198,14 @@ void __gb_draw_line(struct gb_s *gb)
 				sprite_number++)
 		{
 			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * sprite_number + 0];
+			uint8_t OY = oam[4 * sprite_number + 0];
 			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * sprite_number + 1];
+			uint8_t OX = oam[4 * sprite_number + 1];
 
 			/* If sprite isn't on this line, continue. */
-			if (gb->hram_io[IO_LY] +
-				(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY
-					|| gb->hram_io[IO_LY] + 16 < OY)
+			if (line->ly +
+				(line->lcdc & LCDC_OBJ_SIZE ? 0 : 8) >= OY
+					|| line->ly + 16 < OY)
 				continue;
 
 
@@ -1558,7 +2229,11 @@ void __gb_draw_line(struct gb_s *gb)
 				sprite_number != 0xFF;
 				sprite_number--)
 		{
+#if PEANUT_GB_SPRITE_BUCKETS
+			uint8_t s = sprites_to_render[sprite_number];
+#else
 			uint8_t s = sprites_to_render[sprite_number].sprite_number;
+#endif
 #else
 		for (uint8_t sprite_number = NUM_SPRITES - 1;
 			sprite_number != 0xFF;
@@ -1567,20 +2242,20 @@ void __gb_draw_line(struct gb_s *gb)
 			uint8_t s = sprite_number;
 #endif
 			/* Sprite Y position. */
-			uint8_t OY = gb->oam[4 * s + 0];
+			uint8_t OY = oam[4 * s + 0];
 			/* Sprite X position. */
-			uint8_t OX = gb->oam[4 * s + 1];
+			uint8_t OX = oam[4 * s + 1];
 			/* Sprite Tile/Pattern Number. */
-			uint8_t OT = gb->oam[4 * s + 2]
-				     & (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
+			uint8_t OT = oam[4 * s + 2]
+				     & (line->lcdc & LCDC_OBJ_SIZE ? 0xFE : 0xFF);
 			/* Additional attributes. */
-			uint8_t OF = gb->oam[4 * s + 3];
+			uint8_t OF = oam[4 * s + 3];
 
 #if !PEANUT_GB_HIGH_LCD_ACCURACY
 			/* If sprite isn't on this line, continue. */
-			if(gb->hram_io[IO_LY] +
-					(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
-					gb->hram_io[IO_LY] + 16 < OY)
+			if(line->ly +
+					(line->lcdc & LCDC_OBJ_SIZE ? 0 : 8) >= OY ||
+					line->ly + 16 < OY)
 				continue;
 #endif
 
@@ -1589,14 +2264,18 @@ void __gb_draw_line(struct gb_s *gb)
 				continue;
 
 			// y flip
-			uint8_t py = gb->hram_io[IO_LY] - OY + 16;
+			uint8_t py = line->ly - OY + 16;
 
 			if(OF & OBJ_FLIP_Y)
-				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
+				py = (line->lcdc & LCDC_OBJ_SIZE ? 15 : 7) - py;
 
 			// fetch the tile
+#if PEANUT_GB_TILE_CACHE
+			uint_fast16_t row = gb->tile_cache[OT * 8 + py];
+#else
 			uint8_t t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
 			uint8_t t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
+#endif
 
 			// handle x flip
 			uint8_t dir, start, end, shift;
@@ -1617,34 +2296,497 @@ void __gb_draw_line(struct gb_s *gb)
 			}
 
 			// copy tile
+#if PEANUT_GB_TILE_CACHE
+			row >>= 2 * shift;
+#else
 			t1 >>= shift;
 			t2 >>= shift;
+#endif
 
 			/* TODO: Put for loop within the to if statements
 			 * because the BG priority bit will be the same for
 			 * all the pixels in the tile. */
 			for(uint8_t disp_x = start; disp_x != end; disp_x += dir)
 			{
+#if PEANUT_GB_TILE_CACHE
+				uint8_t c = row & 0x3;
+#else
 				uint8_t c = (t1 & 0x1) | ((t2 & 0x1) << 1);
+#endif
 				// check transparency / sprite overlap / background overlap
 
-				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == gb->display.bg_palette[0])))
+				if(c && !(OF & OBJ_PRIORITY && !((pixels[disp_x] & 0x3) == line->bg_palette[0])))
 				{
 					/* Set pixel colour. */
 					pixels[disp_x] = (OF & OBJ_PALETTE)
-						? gb->display.sp_palette[c + 4]
-						: gb->display.sp_palette[c];
+						? line->sp_palette[c + 4]
+						: line->sp_palette[c];
 					/* Set pixel palette (OBJ0 or OBJ1). */
 					pixels[disp_x] |= (OF & OBJ_PALETTE);
 				}
 
+#if PEANUT_GB_TILE_CACHE
+				row >>= 2;
+#else
 				t1 = t1 >> 1;
 				t2 = t2 >> 1;
+#endif
 			}
 		}
 	}
 
-	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+	gb->display.lcd_draw_line(gb, pixels, line->ly);
+}
+
+#if PEANUT_GB_SPLIT_RENDER
+/**
+ * Internal function used to copy OAM to the next snapshot, once the lines
+ * queued with that snapshot are rendered.
+ */
+static void __gb_oam_snapshot(struct gb_s *gb)
+{
+	const uint_fast8_t next =
+		(gb->display.oam_current + 1) % PGB_OAM_SNAPSHOTS;
+	struct gb_oam_snapshot_s *snapshot = &gb->display.oam_snapshot[next];
+
+	if(snapshot->queued)
+	{
+		gb->display.lcd_wait_line(gb, snapshot->ticket);
+		snapshot->queued = 0;
+	}
+
+	memcpy(snapshot->oam, gb->oam, OAM_SIZE);
+#if PEANUT_GB_SPRITE_BUCKETS
+	snapshot->sprites.valid = 0;
+#endif
+	gb->display.oam_current = next;
+	gb->display.oam_changed = 0;
+}
+#endif
+
+void __gb_draw_line(struct gb_s *gb)
+{
+	struct gb_line_s line;
+
+	/* If LCD not initialised by front-end, don't render anything. */
+	if(gb->display.lcd_draw_line == NULL)
+		return;
+
+	if(gb->direct.frame_skip &&
+			gb->display.frame_skip_count < gb->direct.frame_skip_ratio)
+		return;
+
+	/* If interlaced mode is activated, check if we need to draw the current
+	 * line. */
+	if(gb->direct.interlace)
+	{
+		if((gb->display.interlace_count == 0
+				&& (gb->hram_io[IO_LY] & 1) == 0)
+				|| (gb->display.interlace_count == 1
+				    && (gb->hram_io[IO_LY] & 1) == 1))
+		{
+			/* Compensate for missing window draw if required. */
+			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+					&& gb->hram_io[IO_LY] >= gb->display.WY
+					&& gb->hram_io[IO_WX] <= 166)
+				gb->display.window_clear++;
+
+			return;
+		}
+	}
+
+	line.ly = gb->hram_io[IO_LY];
+	line.lcdc = gb->hram_io[IO_LCDC];
+	line.scy = gb->hram_io[IO_SCY];
+	line.scx = gb->hram_io[IO_SCX];
+	line.wy = gb->display.WY;
+	line.wx = gb->hram_io[IO_WX];
+	line.window_line = gb->display.window_clear;
+	memcpy(line.bg_palette, gb->display.bg_palette, sizeof(line.bg_palette));
+	memcpy(line.sp_palette, gb->display.sp_palette, sizeof(line.sp_palette));
+
+	/* Advance window line. */
+	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& gb->hram_io[IO_LY] >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
+		gb->display.window_clear++;
+
+#if PEANUT_GB_SPLIT_RENDER
+	if(gb->display.oam_changed)
+		__gb_oam_snapshot(gb);
+	line.oam = gb->display.oam_current;
+
+	/* Let the front-end render the line elsewhere. */
+	if(gb->display.lcd_queue_line != NULL)
+	{
+		struct gb_oam_snapshot_s *snapshot =
+			&gb->display.oam_snapshot[line.oam];
+
+		gb->display.line_ticket = gb->display.lcd_queue_line(gb, &line);
+		gb->display.lines_queued = 1;
+		snapshot->ticket = gb->display.line_ticket;
+		snapshot->queued = 1;
+		return;
+	}
+#endif
+
+	__gb_render_line(gb, &line);
+}
+#endif
+
+#if PEANUT_GB_EVENT_SCHEDULER || PEANUT_GB_FAST_HALT
+static uint_fast16_t __gb_next_event(const struct gb_s *gb,
+		const uint_fast8_t halted);
+#endif
+
+/**
+ * Internal function used to advance the timers, serial and LCD by the given
+ * number of cycles. If the CPU is halted, keeps on advancing until an
+ * interrupt is pending.
+ */
+static inline void __gb_tick(struct gb_s *gb, uint_fast16_t inst_cycles)
+{
+	do
+	{
+#if PEANUT_GB_FAST_HALT
+		if(gb->gb_halt)
+			gb->counter.halt_cycles += inst_cycles;
+#endif
+
+		/* DIV register timing */
+		gb->counter.div_count += inst_cycles;
+		while(gb->counter.div_count >= DIV_CYCLES)
+		{
+			gb->hram_io[IO_DIV]++;
+			gb->counter.div_count -= DIV_CYCLES;
+		}
+
+		/* Check serial transmission. */
+		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+		{
+			/* If new transfer, call TX function. */
+			if(gb->counter.serial_count == 0 &&
+				gb->gb_serial_tx != NULL)
+				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+
+			gb->counter.serial_count += inst_cycles;
+
+			/* If it's time to receive byte, call RX function. */
+			if(gb->counter.serial_count >= SERIAL_CYCLES)
+			{
+				/* If RX can be done, do it. */
+				/* If RX failed, do not change SB if using external
+				 * clock, or set to 0xFF if using internal clock. */
+				uint8_t rx;
+				const enum gb_serial_rx_ret_e ret =
+					gb->gb_serial_rx != NULL ?
+					gb->gb_serial_rx(gb, &rx) :
+					GB_SERIAL_RX_NO_CONNECTION;
+
+				if(ret == GB_SERIAL_RX_SUCCESS)
+				{
+					gb->hram_io[IO_SB] = rx;
+
+					/* Inform game of serial TX/RX completion. */
+					gb->hram_io[IO_SC] &= 0x01;
+					gb->hram_io[IO_IF] |= SERIAL_INTR;
+				}
+				else if(ret == GB_SERIAL_RX_NO_CONNECTION &&
+					(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC))
+				{
+					/* If using internal clock, and console is not
+					 * attached to any external peripheral, shifted
+					 * bits are replaced with logic 1. */
+					gb->hram_io[IO_SB] = 0xFF;
+
+					/* Inform game of serial TX/RX completion. */
+					gb->hram_io[IO_SC] &= 0x01;
+					gb->hram_io[IO_IF] |= SERIAL_INTR;
+				}
+				else
+				{
+					/* If using external clock, and console is not
+					 * attached to any external peripheral, bits are
+					 * not shifted, so SB is not modified. */
+				}
+
+				gb->counter.serial_count = 0;
+			}
+		}
+
+		/* TIMA register timing */
+		/* TODO: Change tac_enable to struct of TAC timer control bits. */
+		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+		{
+			gb->counter.tima_count += inst_cycles;
+
+			while(gb->counter.tima_count >=
+				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
+			{
+				gb->counter.tima_count -=
+					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+
+				if(++gb->hram_io[IO_TIMA] == 0)
+				{
+					gb->hram_io[IO_IF] |= TIMER_INTR;
+					/* On overflow, set TMA to TIMA. */
+					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
+				}
+			}
+		}
+
+		/* If LCD is off, don't update LCD state or increase the LCD
+		 * ticks. */
+		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+		{
+#if PEANUT_GB_FAST_HALT
+			if(gb->gb_halt)
+				inst_cycles = __gb_next_event(gb, 1);
+#endif
+			continue;
+		}
+
+		/* LCD Timing */
+		gb->counter.lcd_count += inst_cycles;
+
+#if PEANUT_GB_FAST_HALT
+		/* A halted CPU may skip several VBlank lines at once. The last
+		 * line is handled as a normal new scanline below. */
+		while(gb->counter.lcd_count >= 2 * LCD_LINE_CYCLES &&
+				gb->hram_io[IO_LY] >= LCD_HEIGHT &&
+				gb->hram_io[IO_LY] < LCD_VERT_LINES - 1)
+		{
+			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+			gb->hram_io[IO_LY]++;
+
+			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
+			{
+				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+
+				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
+			}
+			else
+				gb->hram_io[IO_STAT] &= 0xFB;
+		}
+#endif
+
+		/* New Scanline */
+		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
+		{
+			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+
+			/* Next line */
+			gb->hram_io[IO_LY] = (gb->hram_io[IO_LY] + 1) % LCD_VERT_LINES;
+
+			/* LYC Update */
+			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
+			{
+				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+
+				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
+			}
+			else
+				gb->hram_io[IO_STAT] &= 0xFB;
+
+			/* VBLANK Start */
+			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
+			{
+				gb->hram_io[IO_STAT] =
+					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
+				gb->gb_frame = 1;
+				gb->hram_io[IO_IF] |= VBLANK_INTR;
+				gb->lcd_blank = 0;
+
+				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
+
+#if ENABLE_LCD
+				/* If frame skip is activated, check if we need to draw
+				 * the frame or skip it. */
+				if(gb->direct.frame_skip)
+				{
+					if(gb->display.frame_skip_count >=
+							gb->direct.frame_skip_ratio)
+						gb->display.frame_skip_count = 0;
+					else
+						gb->display.frame_skip_count++;
+				}
+
+				/* If interlaced is activated, change which lines get
+				 * updated. Also, only update lines on frames that are
+				 * actually drawn when frame skip is enabled. */
+				if(gb->direct.interlace &&
+						(!gb->direct.frame_skip ||
+						 gb->display.frame_skip_count >=
+						 gb->direct.frame_skip_ratio))
+				{
+					gb->display.interlace_count =
+						!gb->display.interlace_count;
+				}
+#endif
+			}
+			/* Normal Line */
+			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
+			{
+				if(gb->hram_io[IO_LY] == 0)
+				{
+					/* Clear Screen */
+					gb->display.WY = gb->hram_io[IO_WY];
+					gb->display.window_clear = 0;
+				}
+
+				gb->hram_io[IO_STAT] =
+					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+
+				if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
+
+				/* If halted immediately jump to next LCD mode. */
+				if(gb->counter.lcd_count < LCD_MODE_2_CYCLES)
+					inst_cycles = LCD_MODE_2_CYCLES - gb->counter.lcd_count;
+			}
+		}
+		/* OAM access */
+		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_HBLANK &&
+				gb->counter.lcd_count >= LCD_MODE_2_CYCLES)
+		{
+			gb->hram_io[IO_STAT] =
+				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_OAM;
+
+			if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
+
+			/* If halted immediately jump to next LCD mode. */
+			if (gb->counter.lcd_count < LCD_MODE_3_CYCLES)
+				inst_cycles = LCD_MODE_3_CYCLES - gb->counter.lcd_count;
+		}
+		/* Update LCD */
+		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_SEARCH_OAM &&
+				gb->counter.lcd_count >= LCD_MODE_3_CYCLES)
+		{
+			gb->hram_io[IO_STAT] =
+				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_TRANSFER;
+#if ENABLE_LCD
+			if(!gb->lcd_blank)
+				__gb_draw_line(gb);
+#endif
+			/* If halted immediately jump to next LCD mode. */
+			if (gb->counter.lcd_count < LCD_MODE_0_CYCLES)
+				inst_cycles = LCD_MODE_0_CYCLES - gb->counter.lcd_count;
+		}
+
+#if PEANUT_GB_FAST_HALT
+		if(gb->gb_halt)
+			inst_cycles = __gb_next_event(gb, 1);
+#endif
+	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
+	/* If halted, loop until an interrupt occurs. */
+}
+
+#if PEANUT_GB_EVENT_SCHEDULER || PEANUT_GB_FAST_HALT
+/**
+ * Internal function used to calculate the number of cycles until the next LCD
+ * mode change, TIMA overflow or serial transfer event. Limited to one scanline.
+ *
+ * If halted, only timer and serial events that can raise an enabled interrupt
+ * are considered, VBlank lines up to the end of VBlank or the next LYC
+ * interrupt are skipped, and the result is not limited to one scanline.
+ */
+static uint_fast16_t __gb_next_event(const struct gb_s *gb,
+		const uint_fast8_t halted)
+{
+	uint_fast32_t cycles = halted ? INT16_MAX : LCD_LINE_CYCLES;
+
+	if(gb->hram_io[IO_LCDC] & LCDC_ENABLE)
+	{
+		uint_fast16_t target;
+
+		switch(gb->hram_io[IO_STAT] & STAT_MODE)
+		{
+		case IO_STAT_MODE_HBLANK:
+			target = LCD_MODE_2_CYCLES;
+			break;
+
+		case IO_STAT_MODE_SEARCH_OAM:
+			target = LCD_MODE_3_CYCLES;
+			break;
+
+		case IO_STAT_MODE_VBLANK:
+		{
+			uint_fast16_t lines = 1;
+
+			if(!halted)
+			{
+				target = LCD_LINE_CYCLES;
+				break;
+			}
+
+			if(gb->hram_io[IO_LY] < LCD_VERT_LINES)
+				lines = LCD_VERT_LINES - gb->hram_io[IO_LY];
+
+			if((gb->hram_io[IO_IE] & LCDC_INTR) &&
+					(gb->hram_io[IO_STAT] & STAT_LYC_INTR) &&
+					gb->hram_io[IO_LYC] > gb->hram_io[IO_LY] &&
+					gb->hram_io[IO_LYC] < LCD_VERT_LINES)
+				lines = gb->hram_io[IO_LYC] - gb->hram_io[IO_LY];
+
+			target = lines * LCD_LINE_CYCLES;
+			break;
+		}
+
+		default:
+			target = LCD_LINE_CYCLES;
+			break;
+		}
+
+		if(target <= gb->counter.lcd_count)
+			cycles = 0;
+		else if(target - gb->counter.lcd_count < cycles)
+			cycles = target - gb->counter.lcd_count;
+	}
+
+	if((gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK) &&
+			(!halted || (gb->hram_io[IO_IE] & TIMER_INTR)))
+	{
+		const uint_fast32_t period =
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+		const uint_fast32_t tima_cycles =
+			(0x100 - gb->hram_io[IO_TIMA]) * period -
+			gb->counter.tima_count;
+
+		if(tima_cycles < cycles)
+			cycles = tima_cycles;
+	}
+
+	if((gb->hram_io[IO_SC] & SERIAL_SC_TX_START) &&
+			(!halted || (gb->hram_io[IO_IE] & SERIAL_INTR)))
+	{
+		const uint_fast32_t serial_cycles =
+			gb->counter.serial_count < SERIAL_CYCLES ?
+			SERIAL_CYCLES - gb->counter.serial_count : 0;
+
+		if(serial_cycles < cycles)
+			cycles = serial_cycles;
+	}
+
+	return (uint_fast16_t)cycles;
+}
+#endif
+
+#if PEANUT_GB_EVENT_SCHEDULER
+/**
+ * Internal function used to apply all pending cycles to the peripherals and
+ * schedule the next event.
+ */
+static void __gb_sync_peripherals(struct gb_s *gb)
+{
+	const uint_fast16_t cycles = gb->counter.pending;
+
+	gb->counter.pending = 0;
+	__gb_tick(gb, cycles);
+	gb->counter.next_event = __gb_next_event(gb, 0);
 }
 #endif
 
@@ -1655,7 +2797,7 @@ void __gb_step_cpu(struct gb_s *gb)
 {
 	uint8_t opcode;
 	uint_fast16_t inst_cycles;
-	static const uint8_t op_cycles[0x100] =
+	static const uint8_t PEANUT_GB_CORE_DATA op_cycles[0x100] =
 	{
 		/* *INDENT-OFF* */
 		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
@@ -1677,7 +2819,46 @@ void __gb_step_cpu(struct gb_s *gb)
 		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
 		/* *INDENT-ON* */
 	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+#if PEANUT_GB_USE_COMPUTED_GOTO
+	/* Address of each opcode handler within the switch below. */
+	static const void *const PEANUT_GB_CORE_DATA op_labels[0x100] =
+	{
+		/* *INDENT-OFF* */
+		&&pgb_op_0x00, &&pgb_op_0x01, &&pgb_op_0x02, &&pgb_op_0x03, &&pgb_op_0x04, &&pgb_op_0x05, &&pgb_op_0x06, &&pgb_op_0x07,
+		&&pgb_op_0x08, &&pgb_op_0x09, &&pgb_op_0x0A, &&pgb_op_0x0B, &&pgb_op_0x0C, &&pgb_op_0x0D, &&pgb_op_0x0E, &&pgb_op_0x0F,
+		&&pgb_op_0x10, &&pgb_op_0x11, &&pgb_op_0x12, &&pgb_op_0x13, &&pgb_op_0x14, &&pgb_op_0x15, &&pgb_op_0x16, &&pgb_op_0x17,
+		&&pgb_op_0x18, &&pgb_op_0x19, &&pgb_op_0x1A, &&pgb_op_0x1B, &&pgb_op_0x1C, &&pgb_op_0x1D, &&pgb_op_0x1E, &&pgb_op_0x1F,
+		&&pgb_op_0x20, &&pgb_op_0x21, &&pgb_op_0x22, &&pgb_op_0x23, &&pgb_op_0x24, &&pgb_op_0x25, &&pgb_op_0x26, &&pgb_op_0x27,
+		&&pgb_op_0x28, &&pgb_op_0x29, &&pgb_op_0x2A, &&pgb_op_0x2B, &&pgb_op_0x2C, &&pgb_op_0x2D, &&pgb_op_0x2E, &&pgb_op_0x2F,
+		&&pgb_op_0x30, &&pgb_op_0x31, &&pgb_op_0x32, &&pgb_op_0x33, &&pgb_op_0x34, &&pgb_op_0x35, &&pgb_op_0x36, &&pgb_op_0x37,
+		&&pgb_op_0x38, &&pgb_op_0x39, &&pgb_op_0x3A, &&pgb_op_0x3B, &&pgb_op_0x3C, &&pgb_op_0x3D, &&pgb_op_0x3E, &&pgb_op_0x3F,
+		&&pgb_op_0x40, &&pgb_op_0x41, &&pgb_op_0x42, &&pgb_op_0x43, &&pgb_op_0x44, &&pgb_op_0x45, &&pgb_op_0x46, &&pgb_op_0x47,
+		&&pgb_op_0x48, &&pgb_op_0x49, &&pgb_op_0x4A, &&pgb_op_0x4B, &&pgb_op_0x4C, &&pgb_op_0x4D, &&pgb_op_0x4E, &&pgb_op_0x4F,
+		&&pgb_op_0x50, &&pgb_op_0x51, &&pgb_op_0x52, &&pgb_op_0x53, &&pgb_op_0x54, &&pgb_op_0x55, &&pgb_op_0x56, &&pgb_op_0x57,
+		&&pgb_op_0x58, &&pgb_op_0x59, &&pgb_op_0x5A, &&pgb_op_0x5B, &&pgb_op_0x5C, &&pgb_op_0x5D, &&pgb_op_0x5E, &&pgb_op_0x5F,
+		&&pgb_op_0x60, &&pgb_op_0x61, &&pgb_op_0x62, &&pgb_op_0x63, &&pgb_op_0x64, &&pgb_op_0x65, &&pgb_op_0x66, &&pgb_op_0x67,
+		&&pgb_op_0x68, &&pgb_op_0x69, &&pgb_op_0x6A, &&pgb_op_0x6B, &&pgb_op_0x6C, &&pgb_op_0x6D, &&pgb_op_0x6E, &&pgb_op_0x6F,
+		&&pgb_op_0x70, &&pgb_op_0x71, &&pgb_op_0x72, &&pgb_op_0x73, &&pgb_op_0x74, &&pgb_op_0x75, &&pgb_op_0x76, &&pgb_op_0x77,
+		&&pgb_op_0x78, &&pgb_op_0x79, &&pgb_op_0x7A, &&pgb_op_0x7B, &&pgb_op_0x7C, &&pgb_op_0x7D, &&pgb_op_0x7E, &&pgb_op_0x7F,
+		&&pgb_op_0x80, &&pgb_op_0x81, &&pgb_op_0x82, &&pgb_op_0x83, &&pgb_op_0x84, &&pgb_op_0x85, &&pgb_op_0x86, &&pgb_op_0x87,
+		&&pgb_op_0x88, &&pgb_op_0x89, &&pgb_op_0x8A, &&pgb_op_0x8B, &&pgb_op_0x8C, &&pgb_op_0x8D, &&pgb_op_0x8E, &&pgb_op_0x8F,
+		&&pgb_op_0x90, &&pgb_op_0x91, &&pgb_op_0x92, &&pgb_op_0x93, &&pgb_op_0x94, &&pgb_op_0x95, &&pgb_op_0x96, &&pgb_op_0x97,
+		&&pgb_op_0x98, &&pgb_op_0x99, &&pgb_op_0x9A, &&pgb_op_0x9B, &&pgb_op_0x9C, &&pgb_op_0x9D, &&pgb_op_0x9E, &&pgb_op_0x9F,
+		&&pgb_op_0xA0, &&pgb_op_0xA1, &&pgb_op_0xA2, &&pgb_op_0xA3, &&pgb_op_0xA4, &&pgb_op_0xA5, &&pgb_op_0xA6, &&pgb_op_0xA7,
+		&&pgb_op_0xA8, &&pgb_op_0xA9, &&pgb_op_0xAA, &&pgb_op_0xAB, &&pgb_op_0xAC, &&pgb_op_0xAD, &&pgb_op_0xAE, &&pgb_op_0xAF,
+		&&pgb_op_0xB0, &&pgb_op_0xB1, &&pgb_op_0xB2, &&pgb_op_0xB3, &&pgb_op_0xB4, &&pgb_op_0xB5, &&pgb_op_0xB6, &&pgb_op_0xB7,
+		&&pgb_op_0xB8, &&pgb_op_0xB9, &&pgb_op_0xBA, &&pgb_op_0xBB, &&pgb_op_0xBC, &&pgb_op_0xBD, &&pgb_op_0xBE, &&pgb_op_0xBF,
+		&&pgb_op_0xC0, &&pgb_op_0xC1, &&pgb_op_0xC2, &&pgb_op_0xC3, &&pgb_op_0xC4, &&pgb_op_0xC5, &&pgb_op_0xC6, &&pgb_op_0xC7,
+		&&pgb_op_0xC8, &&pgb_op_0xC9, &&pgb_op_0xCA, &&pgb_op_0xCB, &&pgb_op_0xCC, &&pgb_op_0xCD, &&pgb_op_0xCE, &&pgb_op_0xCF,
+		&&pgb_op_0xD0, &&pgb_op_0xD1, &&pgb_op_0xD2, &&pgb_op_invalid, &&pgb_op_0xD4, &&pgb_op_0xD5, &&pgb_op_0xD6, &&pgb_op_0xD7,
+		&&pgb_op_0xD8, &&pgb_op_0xD9, &&pgb_op_0xDA, &&pgb_op_invalid, &&pgb_op_0xDC, &&pgb_op_invalid, &&pgb_op_0xDE, &&pgb_op_0xDF,
+		&&pgb_op_0xE0, &&pgb_op_0xE1, &&pgb_op_0xE2, &&pgb_op_invalid, &&pgb_op_invalid, &&pgb_op_0xE5, &&pgb_op_0xE6, &&pgb_op_0xE7,
+		&&pgb_op_0xE8, &&pgb_op_0xE9, &&pgb_op_0xEA, &&pgb_op_invalid, &&pgb_op_invalid, &&pgb_op_invalid, &&pgb_op_0xEE, &&pgb_op_0xEF,
+		&&pgb_op_0xF0, &&pgb_op_0xF1, &&pgb_op_0xF2, &&pgb_op_0xF3, &&pgb_op_invalid, &&pgb_op_0xF5, &&pgb_op_0xF6, &&pgb_op_0xF7,
+		&&pgb_op_0xF8, &&pgb_op_0xF9, &&pgb_op_0xFA, &&pgb_op_0xFB, &&pgb_op_invalid, &&pgb_op_invalid, &&pgb_op_0xFE, &&pgb_op_0xFF
+		/* *INDENT-ON* */
+	};
+#endif
 
 	/* Handle interrupts */
 	/* If gb_halt is positive, then an interrupt must have occured by the
@@ -1731,42 +2912,48 @@ void __gb_step_cpu(struct gb_s *gb)
 	/* Obtain opcode */
 	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
 	inst_cycles = op_cycles[opcode];
+	PGB_HEATMAP_COUNT(op, opcode);
 
 	/* Execute opcode */
+#if PEANUT_GB_USE_COMPUTED_GOTO
+	goto *op_labels[opcode];
+#endif
 	switch(opcode)
 	{
-	case 0x00: /* NOP */
+	PGB_OPCODE(0x00): /* NOP */
 		break;
 
-	case 0x01: /* LD BC, imm */
+	PGB_OPCODE(0x01): /* LD BC, imm */
 		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x02: /* LD (BC), A */
+	PGB_OPCODE(0x02): /* LD (BC), A */
 		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);
 		break;
 
-	case 0x03: /* INC BC */
+	PGB_OPCODE(0x03): /* INC BC */
 		gb->cpu_reg.bc.reg++;
 		break;
 
-	case 0x04: /* INC B */
+	PGB_OPCODE(0x04): /* INC B */
 		gb->cpu_reg.bc.bytes.b++;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.bc.bytes.b == 0x00);
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.bc.bytes.b & 0x0F) == 0x00);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x05: /* DEC B */
+	PGB_OPCODE(0x05): /* DEC B */
 		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x06: /* LD B, imm */
+	PGB_OPCODE(0x06): /* LD B, imm */
 		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x07: /* RLCA */
+	PGB_OPCODE(0x07): /* RLCA */
 		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
 		gb->cpu_reg.f_bits.z = 0;
 		gb->cpu_reg.f_bits.n = 0;
@@ -1774,7 +2961,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		gb->cpu_reg.f_bits.c = (gb->cpu_reg.a & 0x01);
 		break;
 
-	case 0x08: /* LD (imm), SP */
+	PGB_OPCODE(0x08): /* LD (imm), SP */
 	{
 		uint8_t h, l;
 		uint16_t temp;
@@ -1786,7 +2973,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x09: /* ADD HL, BC */
+	PGB_OPCODE(0x09): /* ADD HL, BC */
 	{
 		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
 		gb->cpu_reg.f_bits.n = 0;
@@ -1797,30 +2984,32 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x0A: /* LD A, (BC) */
+	PGB_OPCODE(0x0A): /* LD A, (BC) */
 		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
 		break;
 
-	case 0x0B: /* DEC BC */
+	PGB_OPCODE(0x0B): /* DEC BC */
 		gb->cpu_reg.bc.reg--;
 		break;
 
-	case 0x0C: /* INC C */
+	PGB_OPCODE(0x0C): /* INC C */
 		gb->cpu_reg.bc.bytes.c++;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.bc.bytes.c == 0x00);
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.bc.bytes.c & 0x0F) == 0x00);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x0D: /* DEC C */
+	PGB_OPCODE(0x0D): /* DEC C */
 		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x0E: /* LD C, imm */
+	PGB_OPCODE(0x0E): /* LD C, imm */
 		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x0F: /* RRCA */
+	PGB_OPCODE(0x0F): /* RRCA */
 		gb->cpu_reg.f_bits.c = gb->cpu_reg.a & 0x01;
 		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
 		gb->cpu_reg.f_bits.z = 0;
@@ -1828,39 +3017,41 @@ void __gb_step_cpu(struct gb_s *gb)
 		gb->cpu_reg.f_bits.h = 0;
 		break;
 
-	case 0x10: /* STOP */
+	PGB_OPCODE(0x10): /* STOP */
 		//gb->gb_halt = 1;
 		break;
 
-	case 0x11: /* LD DE, imm */
+	PGB_OPCODE(0x11): /* LD DE, imm */
 		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x12: /* LD (DE), A */
+	PGB_OPCODE(0x12): /* LD (DE), A */
 		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
 		break;
 
-	case 0x13: /* INC DE */
+	PGB_OPCODE(0x13): /* INC DE */
 		gb->cpu_reg.de.reg++;
 		break;
 
-	case 0x14: /* INC D */
+	PGB_OPCODE(0x14): /* INC D */
 		gb->cpu_reg.de.bytes.d++;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.de.bytes.d == 0x00);
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.de.bytes.d & 0x0F) == 0x00);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x15: /* DEC D */
+	PGB_OPCODE(0x15): /* DEC D */
 		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x16: /* LD D, imm */
+	PGB_OPCODE(0x16): /* LD D, imm */
 		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x17: /* RLA */
+	PGB_OPCODE(0x17): /* RLA */
 	{
 		uint8_t temp = gb->cpu_reg.a;
 		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f_bits.c;
@@ -1871,14 +3062,14 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x18: /* JR imm */
+	PGB_OPCODE(0x18): /* JR imm */
 	{
 		int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
 		gb->cpu_reg.pc.reg += temp;
 		break;
 	}
 
-	case 0x19: /* ADD HL, DE */
+	PGB_OPCODE(0x19): /* ADD HL, DE */
 	{
 		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
 		gb->cpu_reg.f_bits.n = 0;
@@ -1889,30 +3080,32 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x1A: /* LD A, (DE) */
+	PGB_OPCODE(0x1A): /* LD A, (DE) */
 		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
 		break;
 
-	case 0x1B: /* DEC DE */
+	PGB_OPCODE(0x1B): /* DEC DE */
 		gb->cpu_reg.de.reg--;
 		break;
 
-	case 0x1C: /* INC E */
+	PGB_OPCODE(0x1C): /* INC E */
 		gb->cpu_reg.de.bytes.e++;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.de.bytes.e == 0x00);
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.de.bytes.e & 0x0F) == 0x00);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x1D: /* DEC E */
+	PGB_OPCODE(0x1D): /* DEC E */
 		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x1E: /* LD E, imm */
+	PGB_OPCODE(0x1E): /* LD E, imm */
 		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x1F: /* RRA */
+	PGB_OPCODE(0x1F): /* RRA */
 	{
 		uint8_t temp = gb->cpu_reg.a;
 		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f_bits.c << 7);
@@ -1923,7 +3116,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x20: /* JR NZ, imm */
+	PGB_OPCODE(0x20): /* JR NZ, imm */
 		if(!gb->cpu_reg.f_bits.z)
 		{
 			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -1935,36 +3128,38 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0x21: /* LD HL, imm */
+	PGB_OPCODE(0x21): /* LD HL, imm */
 		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x22: /* LDI (HL), A */
+	PGB_OPCODE(0x22): /* LDI (HL), A */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
 		gb->cpu_reg.hl.reg++;
 		break;
 
-	case 0x23: /* INC HL */
+	PGB_OPCODE(0x23): /* INC HL */
 		gb->cpu_reg.hl.reg++;
 		break;
 
-	case 0x24: /* INC H */
+	PGB_OPCODE(0x24): /* INC H */
 		gb->cpu_reg.hl.bytes.h++;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.hl.bytes.h == 0x00);
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.hl.bytes.h & 0x0F) == 0x00);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x25: /* DEC H */
+	PGB_OPCODE(0x25): /* DEC H */
 		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x26: /* LD H, imm */
+	PGB_OPCODE(0x26): /* LD H, imm */
 		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x27: /* DAA */
+	PGB_OPCODE(0x27): /* DAA */
 	{
 		/* The following is from SameBoy. MIT License. */
 		int16_t a = gb->cpu_reg.a;
@@ -1996,7 +3191,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x28: /* JP Z, imm */
+	PGB_OPCODE(0x28): /* JP Z, imm */
 		if(gb->cpu_reg.f_bits.z)
 		{
 			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -2008,7 +3203,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0x29: /* ADD HL, HL */
+	PGB_OPCODE(0x29): /* ADD HL, HL */
 	{
 		gb->cpu_reg.f_bits.c = (gb->cpu_reg.hl.reg & 0x8000) > 0;
 		gb->cpu_reg.hl.reg <<= 1;
@@ -2017,36 +3212,38 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x2A: /* LD A, (HL+) */
+	PGB_OPCODE(0x2A): /* LD A, (HL+) */
 		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
 		break;
 
-	case 0x2B: /* DEC HL */
+	PGB_OPCODE(0x2B): /* DEC HL */
 		gb->cpu_reg.hl.reg--;
 		break;
 
-	case 0x2C: /* INC L */
+	PGB_OPCODE(0x2C): /* INC L */
 		gb->cpu_reg.hl.bytes.l++;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.hl.bytes.l == 0x00);
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.hl.bytes.l & 0x0F) == 0x00);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x2D: /* DEC L */
+	PGB_OPCODE(0x2D): /* DEC L */
 		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.l);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x2E: /* LD L, imm */
+	PGB_OPCODE(0x2E): /* LD L, imm */
 		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x2F: /* CPL */
+	PGB_OPCODE(0x2F): /* CPL */
 		gb->cpu_reg.a = ~gb->cpu_reg.a;
 		gb->cpu_reg.f_bits.n = 1;
 		gb->cpu_reg.f_bits.h = 1;
 		break;
 
-	case 0x30: /* JP NC, imm */
+	PGB_OPCODE(0x30): /* JP NC, imm */
 		if(!gb->cpu_reg.f_bits.c)
 		{
 			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -2058,21 +3255,21 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0x31: /* LD SP, imm */
+	PGB_OPCODE(0x31): /* LD SP, imm */
 		gb->cpu_reg.sp.bytes.p = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		gb->cpu_reg.sp.bytes.s = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x32: /* LD (HL), A */
+	PGB_OPCODE(0x32): /* LD (HL), A */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
 		gb->cpu_reg.hl.reg--;
 		break;
 
-	case 0x33: /* INC SP */
+	PGB_OPCODE(0x33): /* INC SP */
 		gb->cpu_reg.sp.reg++;
 		break;
 
-	case 0x34: /* INC (HL) */
+	PGB_OPCODE(0x34): /* INC (HL) */
 	{
 		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg) + 1;
 		gb->cpu_reg.f_bits.z = (temp == 0x00);
@@ -2082,7 +3279,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x35: /* DEC (HL) */
+	PGB_OPCODE(0x35): /* DEC (HL) */
 	{
 		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg) - 1;
 		gb->cpu_reg.f_bits.z = (temp == 0x00);
@@ -2092,17 +3289,17 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x36: /* LD (HL), imm */
+	PGB_OPCODE(0x36): /* LD (HL), imm */
 		__gb_write(gb, gb->cpu_reg.hl.reg, __gb_read(gb, gb->cpu_reg.pc.reg++));
 		break;
 
-	case 0x37: /* SCF */
+	PGB_OPCODE(0x37): /* SCF */
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = 0;
 		gb->cpu_reg.f_bits.c = 1;
 		break;
 
-	case 0x38: /* JP C, imm */
+	PGB_OPCODE(0x38): /* JP C, imm */
 		if(gb->cpu_reg.f_bits.c)
 		{
 			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -2114,7 +3311,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0x39: /* ADD HL, SP */
+	PGB_OPCODE(0x39): /* ADD HL, SP */
 	{
 		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.sp.reg;
 		gb->cpu_reg.f_bits.n = 0;
@@ -2125,252 +3322,260 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x3A: /* LD A, (HL) */
+	PGB_OPCODE(0x3A): /* LD A, (HL) */
 		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg--);
 		break;
 
-	case 0x3B: /* DEC SP */
+	PGB_OPCODE(0x3B): /* DEC SP */
 		gb->cpu_reg.sp.reg--;
 		break;
 
-	case 0x3C: /* INC A */
+	PGB_OPCODE(0x3C): /* INC A */
 		gb->cpu_reg.a++;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a & 0x0F) == 0x00);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x3D: /* DEC A */
+	PGB_OPCODE(0x3D): /* DEC A */
 		gb->cpu_reg.a--;
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
 		gb->cpu_reg.f_bits.n = 1;
 		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.a & 0x0F) == 0x0F);
+		PGB_FUSE_JR();
 		break;
 
-	case 0x3E: /* LD A, imm */
+	PGB_OPCODE(0x3E): /* LD A, imm */
 		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x3F: /* CCF */
+	PGB_OPCODE(0x3F): /* CCF */
 		gb->cpu_reg.f_bits.n = 0;
 		gb->cpu_reg.f_bits.h = 0;
 		gb->cpu_reg.f_bits.c = ~gb->cpu_reg.f_bits.c;
 		break;
 
-	case 0x40: /* LD B, B */
+	PGB_OPCODE(0x40): /* LD B, B */
 		break;
 
-	case 0x41: /* LD B, C */
+	PGB_OPCODE(0x41): /* LD B, C */
 		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.bc.bytes.c;
 		break;
 
-	case 0x42: /* LD B, D */
+	PGB_OPCODE(0x42): /* LD B, D */
 		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x43: /* LD B, E */
+	PGB_OPCODE(0x43): /* LD B, E */
 		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.e;
 		break;
 
-	case 0x44: /* LD B, H */
+	PGB_OPCODE(0x44): /* LD B, H */
 		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x45: /* LD B, L */
+	PGB_OPCODE(0x45): /* LD B, L */
 		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x46: /* LD B, (HL) */
+	PGB_OPCODE(0x46): /* LD B, (HL) */
 		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x47: /* LD B, A */
+	PGB_OPCODE(0x47): /* LD B, A */
 		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.a;
 		break;
 
-	case 0x48: /* LD C, B */
+	PGB_OPCODE(0x48): /* LD C, B */
 		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.bc.bytes.b;
 		break;
 
-	case 0x49: /* LD C, C */
+	PGB_OPCODE(0x49): /* LD C, C */
 		break;
 
-	case 0x4A: /* LD C, D */
+	PGB_OPCODE(0x4A): /* LD C, D */
 		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x4B: /* LD C, E */
+	PGB_OPCODE(0x4B): /* LD C, E */
 		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.e;
 		break;
 
-	case 0x4C: /* LD C, H */
+	PGB_OPCODE(0x4C): /* LD C, H */
 		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x4D: /* LD C, L */
+	PGB_OPCODE(0x4D): /* LD C, L */
 		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x4E: /* LD C, (HL) */
+	PGB_OPCODE(0x4E): /* LD C, (HL) */
 		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x4F: /* LD C, A */
+	PGB_OPCODE(0x4F): /* LD C, A */
 		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.a;
 		break;
 
-	case 0x50: /* LD D, B */
+	PGB_OPCODE(0x50): /* LD D, B */
 		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.b;
 		break;
 
-	case 0x51: /* LD D, C */
+	PGB_OPCODE(0x51): /* LD D, C */
 		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.c;
 		break;
 
-	case 0x52: /* LD D, D */
+	PGB_OPCODE(0x52): /* LD D, D */
 		break;
 
-	case 0x53: /* LD D, E */
+	PGB_OPCODE(0x53): /* LD D, E */
 		gb->cpu_reg.de.bytes.d = gb->cpu_reg.de.bytes.e;
 		break;
 
-	case 0x54: /* LD D, H */
+	PGB_OPCODE(0x54): /* LD D, H */
 		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x55: /* LD D, L */
+	PGB_OPCODE(0x55): /* LD D, L */
 		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x56: /* LD D, (HL) */
+	PGB_OPCODE(0x56): /* LD D, (HL) */
 		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x57: /* LD D, A */
+	PGB_OPCODE(0x57): /* LD D, A */
 		gb->cpu_reg.de.bytes.d = gb->cpu_reg.a;
 		break;
 
-	case 0x58: /* LD E, B */
+	PGB_OPCODE(0x58): /* LD E, B */
 		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.b;
 		break;
 
-	case 0x59: /* LD E, C */
+	PGB_OPCODE(0x59): /* LD E, C */
 		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.c;
 		break;
 
-	case 0x5A: /* LD E, D */
+	PGB_OPCODE(0x5A): /* LD E, D */
 		gb->cpu_reg.de.bytes.e = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x5B: /* LD E, E */
+	PGB_OPCODE(0x5B): /* LD E, E */
 		break;
 
-	case 0x5C: /* LD E, H */
+	PGB_OPCODE(0x5C): /* LD E, H */
 		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x5D: /* LD E, L */
+	PGB_OPCODE(0x5D): /* LD E, L */
 		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x5E: /* LD E, (HL) */
+	PGB_OPCODE(0x5E): /* LD E, (HL) */
 		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x5F: /* LD E, A */
+	PGB_OPCODE(0x5F): /* LD E, A */
 		gb->cpu_reg.de.bytes.e = gb->cpu_reg.a;
 		break;
 
-	case 0x60: /* LD H, B */
+	PGB_OPCODE(0x60): /* LD H, B */
 		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.b;
 		break;
 
-	case 0x61: /* LD H, C */
+	PGB_OPCODE(0x61): /* LD H, C */
 		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.c;
 		break;
 
-	case 0x62: /* LD H, D */
+	PGB_OPCODE(0x62): /* LD H, D */
 		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x63: /* LD H, E */
+	PGB_OPCODE(0x63): /* LD H, E */
 		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.e;
 		break;
 
-	case 0x64: /* LD H, H */
+	PGB_OPCODE(0x64): /* LD H, H */
 		break;
 
-	case 0x65: /* LD H, L */
+	PGB_OPCODE(0x65): /* LD H, L */
 		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x66: /* LD H, (HL) */
+	PGB_OPCODE(0x66): /* LD H, (HL) */
 		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x67: /* LD H, A */
+	PGB_OPCODE(0x67): /* LD H, A */
 		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.a;
 		break;
 
-	case 0x68: /* LD L, B */
+	PGB_OPCODE(0x68): /* LD L, B */
 		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.b;
 		break;
 
-	case 0x69: /* LD L, C */
+	PGB_OPCODE(0x69): /* LD L, C */
 		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.c;
 		break;
 
-	case 0x6A: /* LD L, D */
+	PGB_OPCODE(0x6A): /* LD L, D */
 		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x6B: /* LD L, E */
+	PGB_OPCODE(0x6B): /* LD L, E */
 		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.e;
 		break;
 
-	case 0x6C: /* LD L, H */
+	PGB_OPCODE(0x6C): /* LD L, H */
 		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x6D: /* LD L, L */
+	PGB_OPCODE(0x6D): /* LD L, L */
 		break;
 
-	case 0x6E: /* LD L, (HL) */
+	PGB_OPCODE(0x6E): /* LD L, (HL) */
 		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x6F: /* LD L, A */
+	PGB_OPCODE(0x6F): /* LD L, A */
 		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.a;
 		break;
 
-	case 0x70: /* LD (HL), B */
+	PGB_OPCODE(0x70): /* LD (HL), B */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0x71: /* LD (HL), C */
+	PGB_OPCODE(0x71): /* LD (HL), C */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0x72: /* LD (HL), D */
+	PGB_OPCODE(0x72): /* LD (HL), D */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0x73: /* LD (HL), E */
+	PGB_OPCODE(0x73): /* LD (HL), E */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0x74: /* LD (HL), H */
+	PGB_OPCODE(0x74): /* LD (HL), H */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0x75: /* LD (HL), L */
+	PGB_OPCODE(0x75): /* LD (HL), L */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0x76: /* HALT */
+	PGB_OPCODE(0x76): /* HALT */
 	{
 		int_fast16_t halt_cycles = INT_FAST16_MAX;
 
+#if PEANUT_GB_EVENT_SCHEDULER
+		/* Cycles until the next event are counted from up to date
+		 * peripherals. */
+		__gb_sync_peripherals(gb);
+#endif
+
 		/* TODO: Emulate HALT bug? */
 		gb->gb_halt = 1;
 
@@ -2383,6 +3588,9 @@ void __gb_step_cpu(struct gb_s *gb)
 			PGB_UNREACHABLE();
 		}
 
+#if PEANUT_GB_FAST_HALT
+		halt_cycles = __gb_next_event(gb, 1);
+#else
 		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
 		{
 			int serial_cycles = SERIAL_CYCLES -
@@ -2433,6 +3641,7 @@ void __gb_step_cpu(struct gb_s *gb)
 			if(lcd_cycles < halt_cycles)
 				halt_cycles = lcd_cycles;
 		}
+#endif
 
 		/* Some halt cycles may already be very high, so make sure we
 		 * don't underflow here. */
@@ -2443,134 +3652,134 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x77: /* LD (HL), A */
+	PGB_OPCODE(0x77): /* LD (HL), A */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
 		break;
 
-	case 0x78: /* LD A, B */
+	PGB_OPCODE(0x78): /* LD A, B */
 		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.b;
 		break;
 
-	case 0x79: /* LD A, C */
+	PGB_OPCODE(0x79): /* LD A, C */
 		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.c;
 		break;
 
-	case 0x7A: /* LD A, D */
+	PGB_OPCODE(0x7A): /* LD A, D */
 		gb->cpu_reg.a = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x7B: /* LD A, E */
+	PGB_OPCODE(0x7B): /* LD A, E */
 		gb->cpu_reg.a = gb->cpu_reg.de.bytes.e;
 		break;
 
-	case 0x7C: /* LD A, H */
+	PGB_OPCODE(0x7C): /* LD A, H */
 		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x7D: /* LD A, L */
+	PGB_OPCODE(0x7D): /* LD A, L */
 		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x7E: /* LD A, (HL) */
+	PGB_OPCODE(0x7E): /* LD A, (HL) */
 		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x7F: /* LD A, A */
+	PGB_OPCODE(0x7F): /* LD A, A */
 		break;
 
-	case 0x80: /* ADD A, B */
+	PGB_OPCODE(0x80): /* ADD A, B */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, 0);
 		break;
 
-	case 0x81: /* ADD A, C */
+	PGB_OPCODE(0x81): /* ADD A, C */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, 0);
 		break;
 
-	case 0x82: /* ADD A, D */
+	PGB_OPCODE(0x82): /* ADD A, D */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, 0);
 		break;
 
-	case 0x83: /* ADD A, E */
+	PGB_OPCODE(0x83): /* ADD A, E */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, 0);
 		break;
 
-	case 0x84: /* ADD A, H */
+	PGB_OPCODE(0x84): /* ADD A, H */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, 0);
 		break;
 
-	case 0x85: /* ADD A, L */
+	PGB_OPCODE(0x85): /* ADD A, L */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, 0);
 		break;
 
-	case 0x86: /* ADD A, (HL) */
+	PGB_OPCODE(0x86): /* ADD A, (HL) */
 		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
 		break;
 
-	case 0x87: /* ADD A, A */
+	PGB_OPCODE(0x87): /* ADD A, A */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.a, 0);
 		break;
 
-	case 0x88: /* ADC A, B */
+	PGB_OPCODE(0x88): /* ADC A, B */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x89: /* ADC A, C */
+	PGB_OPCODE(0x89): /* ADC A, C */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x8A: /* ADC A, D */
+	PGB_OPCODE(0x8A): /* ADC A, D */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x8B: /* ADC A, E */
+	PGB_OPCODE(0x8B): /* ADC A, E */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x8C: /* ADC A, H */
+	PGB_OPCODE(0x8C): /* ADC A, H */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x8D: /* ADC A, L */
+	PGB_OPCODE(0x8D): /* ADC A, L */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x8E: /* ADC A, (HL) */
+	PGB_OPCODE(0x8E): /* ADC A, (HL) */
 		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x8F: /* ADC A, A */
+	PGB_OPCODE(0x8F): /* ADC A, A */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.a, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x90: /* SUB B */
+	PGB_OPCODE(0x90): /* SUB B */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, 0);
 		break;
 
-	case 0x91: /* SUB C */
+	PGB_OPCODE(0x91): /* SUB C */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, 0);
 		break;
 
-	case 0x92: /* SUB D */
+	PGB_OPCODE(0x92): /* SUB D */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, 0);
 		break;
 
-	case 0x93: /* SUB E */
+	PGB_OPCODE(0x93): /* SUB E */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, 0);
 		break;
 
-	case 0x94: /* SUB H */
+	PGB_OPCODE(0x94): /* SUB H */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, 0);
 		break;
 
-	case 0x95: /* SUB L */
+	PGB_OPCODE(0x95): /* SUB L */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, 0);
 		break;
 
-	case 0x96: /* SUB (HL) */
+	PGB_OPCODE(0x96): /* SUB (HL) */
 		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
 		break;
 
-	case 0x97: /* SUB A */
+	PGB_OPCODE(0x97): /* SUB A */
 		gb->cpu_reg.a = 0;
 		gb->cpu_reg.f_bits.z = 1;
 		gb->cpu_reg.f_bits.n = 1;
@@ -2578,173 +3787,180 @@ void __gb_step_cpu(struct gb_s *gb)
 		gb->cpu_reg.f_bits.c = 0;
 		break;
 
-	case 0x98: /* SBC A, B */
+	PGB_OPCODE(0x98): /* SBC A, B */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x99: /* SBC A, C */
+	PGB_OPCODE(0x99): /* SBC A, C */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x9A: /* SBC A, D */
+	PGB_OPCODE(0x9A): /* SBC A, D */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x9B: /* SBC A, E */
+	PGB_OPCODE(0x9B): /* SBC A, E */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x9C: /* SBC A, H */
+	PGB_OPCODE(0x9C): /* SBC A, H */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x9D: /* SBC A, L */
+	PGB_OPCODE(0x9D): /* SBC A, L */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x9E: /* SBC A, (HL) */
+	PGB_OPCODE(0x9E): /* SBC A, (HL) */
 		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f_bits.c);
 		break;
 
-	case 0x9F: /* SBC A, A */
+	PGB_OPCODE(0x9F): /* SBC A, A */
 		gb->cpu_reg.a = gb->cpu_reg.f_bits.c ? 0xFF : 0x00;
 		gb->cpu_reg.f_bits.z = !gb->cpu_reg.f_bits.c;
 		gb->cpu_reg.f_bits.n = 1;
 		gb->cpu_reg.f_bits.h = gb->cpu_reg.f_bits.c;
 		break;
 
-	case 0xA0: /* AND B */
+	PGB_OPCODE(0xA0): /* AND B */
 		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0xA1: /* AND C */
+	PGB_OPCODE(0xA1): /* AND C */
 		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xA2: /* AND D */
+	PGB_OPCODE(0xA2): /* AND D */
 		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0xA3: /* AND E */
+	PGB_OPCODE(0xA3): /* AND E */
 		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xA4: /* AND H */
+	PGB_OPCODE(0xA4): /* AND H */
 		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0xA5: /* AND L */
+	PGB_OPCODE(0xA5): /* AND L */
 		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xA6: /* AND (HL) */
+	PGB_OPCODE(0xA6): /* AND (HL) */
 		PGB_INSTR_AND_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xA7: /* AND A */
+	PGB_OPCODE(0xA7): /* AND A */
 		PGB_INSTR_AND_R8(gb->cpu_reg.a);
 		break;
 
-	case 0xA8: /* XOR B */
+	PGB_OPCODE(0xA8): /* XOR B */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0xA9: /* XOR C */
+	PGB_OPCODE(0xA9): /* XOR C */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xAA: /* XOR D */
+	PGB_OPCODE(0xAA): /* XOR D */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0xAB: /* XOR E */
+	PGB_OPCODE(0xAB): /* XOR E */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xAC: /* XOR H */
+	PGB_OPCODE(0xAC): /* XOR H */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0xAD: /* XOR L */
+	PGB_OPCODE(0xAD): /* XOR L */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xAE: /* XOR (HL) */
+	PGB_OPCODE(0xAE): /* XOR (HL) */
 		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xAF: /* XOR A */
+	PGB_OPCODE(0xAF): /* XOR A */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.a);
 		break;
 
-	case 0xB0: /* OR B */
+	PGB_OPCODE(0xB0): /* OR B */
 		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.b);
+		PGB_FUSE_JR();
 		break;
 
-	case 0xB1: /* OR C */
+	PGB_OPCODE(0xB1): /* OR C */
 		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.c);
+		PGB_FUSE_JR();
 		break;
 
-	case 0xB2: /* OR D */
+	PGB_OPCODE(0xB2): /* OR D */
 		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.d);
+		PGB_FUSE_JR();
 		break;
 
-	case 0xB3: /* OR E */
+	PGB_OPCODE(0xB3): /* OR E */
 		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.e);
+		PGB_FUSE_JR();
 		break;
 
-	case 0xB4: /* OR H */
+	PGB_OPCODE(0xB4): /* OR H */
 		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.h);
+		PGB_FUSE_JR();
 		break;
 
-	case 0xB5: /* OR L */
+	PGB_OPCODE(0xB5): /* OR L */
 		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.l);
+		PGB_FUSE_JR();
 		break;
 
-	case 0xB6: /* OR (HL) */
+	PGB_OPCODE(0xB6): /* OR (HL) */
 		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xB7: /* OR A */
+	PGB_OPCODE(0xB7): /* OR A */
 		PGB_INSTR_OR_R8(gb->cpu_reg.a);
+		PGB_FUSE_JR();
 		break;
 
-	case 0xB8: /* CP B */
+	PGB_OPCODE(0xB8): /* CP B */
 		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0xB9: /* CP C */
+	PGB_OPCODE(0xB9): /* CP C */
 		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xBA: /* CP D */
+	PGB_OPCODE(0xBA): /* CP D */
 		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0xBB: /* CP E */
+	PGB_OPCODE(0xBB): /* CP E */
 		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xBC: /* CP H */
+	PGB_OPCODE(0xBC): /* CP H */
 		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0xBD: /* CP L */
+	PGB_OPCODE(0xBD): /* CP L */
 		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xBE: /* CP (HL) */
+	PGB_OPCODE(0xBE): /* CP (HL) */
 		PGB_INSTR_CP_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xBF: /* CP A */
+	PGB_OPCODE(0xBF): /* CP A */
 		gb->cpu_reg.f_bits.z = 1;
 		gb->cpu_reg.f_bits.n = 1;
 		gb->cpu_reg.f_bits.h = 0;
 		gb->cpu_reg.f_bits.c = 0;
 		break;
 
-	case 0xC0: /* RET NZ */
+	PGB_OPCODE(0xC0): /* RET NZ */
 		if(!gb->cpu_reg.f_bits.z)
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2754,12 +3970,12 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xC1: /* POP BC */
+	PGB_OPCODE(0xC1): /* POP BC */
 		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		break;
 
-	case 0xC2: /* JP NZ, imm */
+	PGB_OPCODE(0xC2): /* JP NZ, imm */
 		if(!gb->cpu_reg.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2774,7 +3990,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xC3: /* JP imm */
+	PGB_OPCODE(0xC3): /* JP imm */
 	{
 		uint8_t p, c;
 		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -2784,7 +4000,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0xC4: /* CALL NZ imm */
+	PGB_OPCODE(0xC4): /* CALL NZ imm */
 		if(!gb->cpu_reg.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2801,25 +4017,25 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xC5: /* PUSH BC */
+	PGB_OPCODE(0xC5): /* PUSH BC */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.b);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xC6: /* ADD A, imm */
+	PGB_OPCODE(0xC6): /* ADD A, imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		PGB_INSTR_ADC_R8(val, 0);
 		break;
 	}
 
-	case 0xC7: /* RST 0x0000 */
+	PGB_OPCODE(0xC7): /* RST 0x0000 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0000;
 		break;
 
-	case 0xC8: /* RET Z */
+	PGB_OPCODE(0xC8): /* RET Z */
 		if(gb->cpu_reg.f_bits.z)
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2828,14 +4044,14 @@ void __gb_step_cpu(struct gb_s *gb)
 		}
 		break;
 
-	case 0xC9: /* RET */
+	PGB_OPCODE(0xC9): /* RET */
 	{
 		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		break;
 	}
 
-	case 0xCA: /* JP Z, imm */
+	PGB_OPCODE(0xCA): /* JP Z, imm */
 		if(gb->cpu_reg.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2850,11 +4066,11 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xCB: /* CB INST */
+	PGB_OPCODE(0xCB): /* CB INST */
 		inst_cycles = __gb_execute_cb(gb);
 		break;
 
-	case 0xCC: /* CALL Z, imm */
+	PGB_OPCODE(0xCC): /* CALL Z, imm */
 		if(gb->cpu_reg.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2871,7 +4087,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xCD: /* CALL imm */
+	PGB_OPCODE(0xCD): /* CALL imm */
 	{
 		uint8_t p, c;
 		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -2883,20 +4099,20 @@ void __gb_step_cpu(struct gb_s *gb)
 	}
 	break;
 
-	case 0xCE: /* ADC A, imm */
+	PGB_OPCODE(0xCE): /* ADC A, imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		PGB_INSTR_ADC_R8(val, gb->cpu_reg.f_bits.c);
 		break;
 	}
 
-	case 0xCF: /* RST 0x0008 */
+	PGB_OPCODE(0xCF): /* RST 0x0008 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0008;
 		break;
 
-	case 0xD0: /* RET NC */
+	PGB_OPCODE(0xD0): /* RET NC */
 		if(!gb->cpu_reg.f_bits.c)
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2906,12 +4122,12 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xD1: /* POP DE */
+	PGB_OPCODE(0xD1): /* POP DE */
 		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		break;
 
-	case 0xD2: /* JP NC, imm */
+	PGB_OPCODE(0xD2): /* JP NC, imm */
 		if(!gb->cpu_reg.f_bits.c)
 		{
 			uint8_t p, c;
@@ -2926,7 +4142,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xD4: /* CALL NC, imm */
+	PGB_OPCODE(0xD4): /* CALL NC, imm */
 		if(!gb->cpu_reg.f_bits.c)
 		{
 			uint8_t p, c;
@@ -2943,12 +4159,12 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xD5: /* PUSH DE */
+	PGB_OPCODE(0xD5): /* PUSH DE */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.d);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xD6: /* SUB imm */
+	PGB_OPCODE(0xD6): /* SUB imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		uint16_t temp = gb->cpu_reg.a - val;
@@ -2961,13 +4177,13 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0xD7: /* RST 0x0010 */
+	PGB_OPCODE(0xD7): /* RST 0x0010 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0010;
 		break;
 
-	case 0xD8: /* RET C */
+	PGB_OPCODE(0xD8): /* RET C */
 		if(gb->cpu_reg.f_bits.c)
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2977,7 +4193,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xD9: /* RETI */
+	PGB_OPCODE(0xD9): /* RETI */
 	{
 		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2985,7 +4201,7 @@ void __gb_step_cpu(struct gb_s *gb)
 	}
 	break;
 
-	case 0xDA: /* JP C, imm */
+	PGB_OPCODE(0xDA): /* JP C, imm */
 		if(gb->cpu_reg.f_bits.c)
 		{
 			uint8_t p, c;
@@ -3000,7 +4216,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xDC: /* CALL C, imm */
+	PGB_OPCODE(0xDC): /* CALL C, imm */
 		if(gb->cpu_reg.f_bits.c)
 		{
 			uint8_t p, c;
@@ -3017,39 +4233,39 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xDE: /* SBC A, imm */
+	PGB_OPCODE(0xDE): /* SBC A, imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		PGB_INSTR_SBC_R8(val, gb->cpu_reg.f_bits.c);
 		break;
 	}
 
-	case 0xDF: /* RST 0x0018 */
+	PGB_OPCODE(0xDF): /* RST 0x0018 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0018;
 		break;
 
-	case 0xE0: /* LD (0xFF00+imm), A */
+	PGB_OPCODE(0xE0): /* LD (0xFF00+imm), A */
 		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
 			   gb->cpu_reg.a);
 		break;
 
-	case 0xE1: /* POP HL */
+	PGB_OPCODE(0xE1): /* POP HL */
 		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		break;
 
-	case 0xE2: /* LD (C), A */
+	PGB_OPCODE(0xE2): /* LD (C), A */
 		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
 		break;
 
-	case 0xE5: /* PUSH HL */
+	PGB_OPCODE(0xE5): /* PUSH HL */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xE6: /* AND imm */
+	PGB_OPCODE(0xE6): /* AND imm */
 		/* TODO: Optimisation? */
 		gb->cpu_reg.a = gb->cpu_reg.a & __gb_read(gb, gb->cpu_reg.pc.reg++);
 		gb->cpu_reg.f_bits.z = (gb->cpu_reg.a == 0x00);
@@ -3058,13 +4274,13 @@ void __gb_step_cpu(struct gb_s *gb)
 		gb->cpu_reg.f_bits.c = 0;
 		break;
 
-	case 0xE7: /* RST 0x0020 */
+	PGB_OPCODE(0xE7): /* RST 0x0020 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0020;
 		break;
 
-	case 0xE8: /* ADD SP, imm */
+	PGB_OPCODE(0xE8): /* ADD SP, imm */
 	{
 		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
 		gb->cpu_reg.f_bits.z = 0;
@@ -3075,11 +4291,11 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0xE9: /* JP (HL) */
+	PGB_OPCODE(0xE9): /* JP (HL) */
 		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
 		break;
 
-	case 0xEA: /* LD (imm), A */
+	PGB_OPCODE(0xEA): /* LD (imm), A */
 	{
 		uint8_t h, l;
 		uint16_t addr;
@@ -3090,22 +4306,22 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0xEE: /* XOR imm */
+	PGB_OPCODE(0xEE): /* XOR imm */
 		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
 		break;
 
-	case 0xEF: /* RST 0x0028 */
+	PGB_OPCODE(0xEF): /* RST 0x0028 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0028;
 		break;
 
-	case 0xF0: /* LD A, (0xFF00+imm) */
+	PGB_OPCODE(0xF0): /* LD A, (0xFF00+imm) */
 		gb->cpu_reg.a =
 			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
 		break;
 
-	case 0xF1: /* POP AF */
+	PGB_OPCODE(0xF1): /* POP AF */
 	{
 		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.f_bits.z = (temp_8 >> 7) & 1;
@@ -3116,274 +4332,98 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0xF2: /* LD A, (C) */
+	PGB_OPCODE(0xF2): /* LD A, (C) */
 		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xF3: /* DI */
+	PGB_OPCODE(0xF3): /* DI */
 		gb->gb_ime = 0;
 		break;
 
-	case 0xF5: /* PUSH AF */
+	PGB_OPCODE(0xF5): /* PUSH AF */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
 		__gb_write(gb, --gb->cpu_reg.sp.reg,
 			   gb->cpu_reg.f_bits.z << 7 | gb->cpu_reg.f_bits.n << 6 |
-			   gb->cpu_reg.f_bits.h << 5 | gb->cpu_reg.f_bits.c << 4);
-		break;
-
-	case 0xF6: /* OR imm */
-		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
-
-	case 0xF7: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0030;
-		break;
-
-	case 0xF8: /* LD HL, SP+/-imm */
-	{
-		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
-		gb->cpu_reg.f_bits.z = 0;
-		gb->cpu_reg.f_bits.n = 0;
-		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 :
-				       0;
-		break;
-	}
-
-	case 0xF9: /* LD SP, HL */
-		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
-		break;
-
-	case 0xFA: /* LD A, (imm) */
-	{
-		uint8_t h, l;
-		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		addr = PEANUT_GB_U8_TO_U16(h, l);
-		gb->cpu_reg.a = __gb_read(gb, addr);
-		break;
-	}
-
-	case 0xFB: /* EI */
-		gb->gb_ime = 1;
-		break;
-
-	case 0xFE: /* CP imm */
-	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_CP_R8(val);
-		break;
-	}
-
-	case 0xFF: /* RST 0x0038 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
-		break;
-
-	default:
-		/* Return address where invlid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
-		PGB_UNREACHABLE();
-	}
-
-	do
-	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
-
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
-
-			gb->counter.serial_count += inst_cycles;
-
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= SERIAL_CYCLES)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
-
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
-
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
-
-				gb->counter.serial_count = 0;
-			}
-		}
-
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			gb->counter.tima_count += inst_cycles;
-
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
-
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
-
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-			continue;
-
-		/* LCD Timing */
-		gb->counter.lcd_count += inst_cycles;
-
-		/* New Scanline */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+			   gb->cpu_reg.f_bits.h << 5 | gb->cpu_reg.f_bits.c << 4);
+		break;
 
-			/* Next line */
-			gb->hram_io[IO_LY] = (gb->hram_io[IO_LY] + 1) % LCD_VERT_LINES;
+	PGB_OPCODE(0xF6): /* OR imm */
+		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
 
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+	PGB_OPCODE(0xF7): /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0030;
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
+	PGB_OPCODE(0xF8): /* LD HL, SP+/-imm */
+	{
+		/* Taken from SameBoy, which is released under MIT Licence. */
+		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
+		gb->cpu_reg.f_bits.z = 0;
+		gb->cpu_reg.f_bits.n = 0;
+		gb->cpu_reg.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
+		gb->cpu_reg.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 :
+				       0;
+		break;
+	}
 
-			/* VBLANK Start */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = 1;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = 0;
+	PGB_OPCODE(0xF9): /* LD SP, HL */
+		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	PGB_OPCODE(0xFA): /* LD A, (imm) */
+	{
+		uint8_t h, l;
+		uint16_t addr;
+		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		addr = PEANUT_GB_U8_TO_U16(h, l);
+		gb->cpu_reg.a = __gb_read(gb, addr);
+		break;
+	}
 
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+	PGB_OPCODE(0xFB): /* EI */
+		gb->gb_ime = 1;
+		break;
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
-#endif
-			}
-			/* Normal Line */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+	PGB_OPCODE(0xFE): /* CP imm */
+	{
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		PGB_INSTR_CP_R8(val);
+		PGB_FUSE_JR();
+		break;
+	}
 
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+	PGB_OPCODE(0xFF): /* RST 0x0038 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0038;
+		break;
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	default:
+#if PEANUT_GB_USE_COMPUTED_GOTO
+	pgb_op_invalid:
+#endif
+		/* Return address where invlid opcode that was read. */
+		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		PGB_UNREACHABLE();
+	}
 
-				/* If halted immediately jump to next LCD mode. */
-				if(gb->counter.lcd_count < LCD_MODE_2_CYCLES)
-					inst_cycles = LCD_MODE_2_CYCLES - gb->counter.lcd_count;
-			}
-		}
-		/* OAM access */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_HBLANK &&
-				gb->counter.lcd_count >= LCD_MODE_2_CYCLES)
-		{
-			gb->hram_io[IO_STAT] =
-				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_OAM;
+#if PEANUT_GB_EVENT_SCHEDULER
+	/* Peripherals are only brought up to date once the next event is due,
+	 * or when the CPU is halted. */
+	gb->counter.pending += inst_cycles;
 
-			if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+	if(gb->counter.pending < gb->counter.next_event && !gb->gb_halt)
+		return;
 
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE_3_CYCLES)
-				inst_cycles = LCD_MODE_3_CYCLES - gb->counter.lcd_count;
-		}
-		/* Update LCD */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_SEARCH_OAM &&
-				gb->counter.lcd_count >= LCD_MODE_3_CYCLES)
-		{
-			gb->hram_io[IO_STAT] =
-				(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_SEARCH_TRANSFER;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
+	__gb_sync_peripherals(gb);
+#else
+	__gb_tick(gb, inst_cycles);
 #endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE_0_CYCLES)
-				inst_cycles = LCD_MODE_0_CYCLES - gb->counter.lcd_count;
-		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
 }
 
 void gb_run_frame(struct gb_s *gb)
@@ -3422,6 +4462,35 @@ void gb_init_serial(struct gb_s *gb,
 	gb->gb_serial_rx = gb_serial_rx;
 }
 
+void gb_set_joypad(struct gb_s *gb, const uint8_t joypad)
+{
+	/* Buttons go from 1 to 0 when pressed. */
+	const uint8_t pressed = gb->direct.joypad & ~joypad;
+
+	gb->direct.joypad = joypad;
+
+	/* Update the buttons read from JOYP as when it is written. */
+	if((gb->hram_io[IO_JOYP] & 0b010000) == 0)
+	{
+		gb->hram_io[IO_JOYP] = (gb->hram_io[IO_JOYP] & 0xF0) |
+			(joypad >> 4);
+	}
+	else
+	{
+		gb->hram_io[IO_JOYP] = (gb->hram_io[IO_JOYP] & 0xF0) |
+			(joypad & 0x0F);
+	}
+
+	/* The interrupt is requested when an input line of a selected group
+	 * goes low. */
+	if(((gb->hram_io[IO_JOYP] & 0b010000) == 0 && (pressed >> 4)) ||
+			((gb->hram_io[IO_JOYP] & 0b100000) == 0 &&
+			 (pressed & 0x0F)))
+	{
+		gb->hram_io[IO_IF] |= CONTROL_INTR;
+	}
+}
+
 uint8_t gb_colour_hash(struct gb_s *gb)
 {
 #define ROM_TITLE_START_ADDR	0x0134
@@ -3435,6 +4504,22 @@ uint8_t gb_colour_hash(struct gb_s *gb)
 	return x;
 }
 
+uint_fast32_t gb_get_frame_cycles(const struct gb_s *gb)
+{
+	/* Frames start at VBlank, when gb_frame is set. */
+	uint_fast32_t line = (gb->hram_io[IO_LY] + LCD_VERT_LINES - LCD_HEIGHT) %
+		LCD_VERT_LINES;
+	uint_fast32_t cycles = line * LCD_LINE_CYCLES + gb->counter.lcd_count;
+
+#if PEANUT_GB_EVENT_SCHEDULER
+	/* Include cycles not yet passed to the peripherals. */
+	if(gb->hram_io[IO_LCDC] & LCDC_ENABLE)
+		cycles += gb->counter.pending;
+#endif
+
+	return cycles;
+}
+
 /**
  * Resets the context, and initialises startup values for a DMG console.
  */
@@ -3484,10 +4569,51 @@ void gb_reset(struct gb_s *gb)
 		gb->hram_io[IO_BANK] = 0x00;
 	}
 
+	__gb_update_rom_bank(gb);
+
+#if PEANUT_GB_TILE_CACHE
+	for(uint_fast16_t i = 0; i < TILE_CACHE_ROWS; i++)
+		__gb_update_tile_cache(gb, 2 * i);
+#endif
+
+	__gb_oam_changed(gb);
+
+#if PEANUT_GB_USE_PAGE_TABLE
+	/* Cartridge RAM, OAM and IO always take the slow path, as their
+	 * accesses depend on MBC state or have side effects. */
+	for(uint_fast8_t i = 0x8; i <= 0xF; i++)
+	{
+		gb->rd_page[i] = NULL;
+		gb->wr_page[i] = NULL;
+	}
+
+	for(uint_fast8_t i = 0x0; i <= 0x7; i++)
+		gb->wr_page[i] = NULL;
+
+	gb->rd_page[0x8] = &gb->vram[0x0000];
+	gb->rd_page[0x9] = &gb->vram[0x1000];
+#if !PEANUT_GB_TILE_CACHE && !PEANUT_GB_SPLIT_RENDER
+	/* Writes to tile data must update the tile cache, and wait for the
+	 * lines being rendered from VRAM by the split renderer. */
+	gb->wr_page[0x8] = &gb->vram[0x0000];
+	gb->wr_page[0x9] = &gb->vram[0x1000];
+#endif
+	gb->rd_page[0xC] = gb->wr_page[0xC] = &gb->wram[0x0000];
+	gb->rd_page[0xD] = gb->wr_page[0xD] = &gb->wram[0x1000];
+	gb->rd_page[0xE] = gb->wr_page[0xE] = &gb->wram[0x0000];
+#endif
+
 	gb->counter.lcd_count = 0;
 	gb->counter.div_count = 0;
 	gb->counter.tima_count = 0;
 	gb->counter.serial_count = 0;
+#if PEANUT_GB_EVENT_SCHEDULER
+	gb->counter.pending = 0;
+	gb->counter.next_event = 0;
+#endif
+#if PEANUT_GB_FAST_HALT
+	gb->counter.halt_cycles = 0;
+#endif
 
 	gb->direct.joypad = 0xFF;
 	gb->hram_io[IO_JOYP] = 0xCF;
@@ -3563,6 +4689,10 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	gb->gb_serial_rx = NULL;
 
 	gb->gb_bootrom_read = NULL;
+	gb->gb_rom_bank_ptr = NULL;
+#if PEANUT_GB_HEATMAP
+	memset(&gb->heatmap, 0, sizeof(gb->heatmap));
+#endif
 
 	/* Check valid ROM using checksum value. */
 	{
@@ -3584,6 +4714,27 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 			return GB_INIT_CARTRIDGE_UNSUPPORTED;
 	}
 
+#if PEANUT_GB_MBC_VARIANTS
+	switch(gb->mbc)
+	{
+#define PGB_MBC_SELECT(n)						\
+	case n:								\
+		gb->mbc_read_cart_ram = __gb_read_cart_ram_mbc##n;	\
+		gb->mbc_write_cart_ram = __gb_write_cart_ram_mbc##n;	\
+		gb->mbc_write = __gb_write_mbc##n;			\
+		break
+
+	PGB_MBC_SELECT(0);
+	PGB_MBC_SELECT(1);
+	PGB_MBC_SELECT(2);
+	PGB_MBC_SELECT(3);
+	PGB_MBC_SELECT(5);
+#undef PGB_MBC_SELECT
+	default:
+		return GB_INIT_CARTRIDGE_UNSUPPORTED;
+	}
+#endif
+
 	gb->cart_ram = cart_ram[gb->gb_rom_read(gb, mbc_location)];
 	gb->num_rom_banks_mask = num_rom_banks_mask[gb->gb_rom_read(gb, bank_count_location)] - 1;
 	gb->num_ram_banks = num_ram_banks[gb->gb_rom_read(gb, ram_size_location)];
@@ -3631,10 +4782,20 @@ void gb_init_lcd(struct gb_s *gb,
 			const uint_fast8_t line))
 {
 	gb->display.lcd_draw_line = lcd_draw_line;
+#if PEANUT_GB_SPLIT_RENDER
+	gb->display.lcd_queue_line = NULL;
+	gb->display.lcd_wait_line = NULL;
+	gb->display.oam_current = 0;
+	gb->display.oam_changed = 1;
+	gb->display.lines_queued = 0;
+	for(uint_fast8_t i = 0; i < PGB_OAM_SNAPSHOTS; i++)
+		gb->display.oam_snapshot[i].queued = 0;
+#endif
 
 	gb->direct.interlace = 0;
 	gb->display.interlace_count = 0;
 	gb->direct.frame_skip = 0;
+	gb->direct.frame_skip_ratio = 1;
 	gb->display.frame_skip_count = 0;
 
 	gb->display.window_clear = 0;
@@ -3642,6 +4803,22 @@ void gb_init_lcd(struct gb_s *gb,
 
 	return;
 }
+
+#if PEANUT_GB_SPLIT_RENDER
+void gb_set_split_render(struct gb_s *gb,
+		uint32_t (*lcd_queue_line)(struct gb_s *gb,
+			const struct gb_line_s *line),
+		void (*lcd_wait_line)(struct gb_s *gb, uint32_t ticket))
+{
+	gb->display.lcd_queue_line = lcd_queue_line;
+	gb->display.lcd_wait_line = lcd_wait_line;
+}
+
+void gb_render_line(struct gb_s *gb, const struct gb_line_s *line)
+{
+	__gb_render_line(gb, line);
+}
+#endif
 #endif
 
 void gb_set_bootrom(struct gb_s *gb,
@@ -3650,6 +4827,159 @@ void gb_set_bootrom(struct gb_s *gb,
 	gb->gb_bootrom_read = gb_bootrom_read;
 }
 
+void gb_set_rom_bank_ptr(struct gb_s *gb,
+		const uint8_t *(*gb_rom_bank_ptr)(struct gb_s*, const uint_fast16_t))
+{
+	gb->gb_rom_bank_ptr = gb_rom_bank_ptr;
+	__gb_update_rom_bank(gb);
+}
+
+void gb_set_rom_page(struct gb_s *gb, const uint_fast8_t page,
+		const uint8_t *ptr)
+{
+#if PEANUT_GB_USE_PAGE_TABLE
+	gb->rd_page[ROM_N_ADDR / 0x1000 + page] = ptr;
+#else
+	(void) gb;
+	(void) page;
+	(void) ptr;
+#endif
+}
+
+#define PEANUT_GB_STATE_MAGIC	0x53424750	/* "PGBS" */
+/* Must be incremented whenever the fields saved by __gb_state_copy() or their
+ * layout change. */
+#define PEANUT_GB_STATE_VERSION	1
+
+/* Saved before the fields of the emulator context. */
+struct gb_state_header_s
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t global_checksum;
+	uint8_t header_checksum;
+	uint8_t reserved[3];
+	/* Size of the fields following the header. */
+	uint32_t size;
+};
+
+/**
+ * Internal function used to copy the fields of the emulator context that make
+ * up a save state to or from "state". Only the size is computed if "state" is
+ * NULL. Pointers, callbacks and caches derived from these fields are not
+ * saved, so a state is only valid for the build it was saved with.
+ * \return	Size of the fields in bytes.
+ */
+static size_t __gb_state_copy(struct gb_s *gb, uint8_t *state,
+		const uint_fast8_t save)
+{
+	size_t size = 0;
+	uint8_t flags = gb->gb_halt | (gb->gb_ime << 1) | (gb->lcd_blank << 2);
+
+#define PEANUT_GB_STATE_FIELD(field)					\
+	do {								\
+		if(state != NULL && save)				\
+			memcpy(state + size, &(field), sizeof(field));	\
+		else if(state != NULL)					\
+			memcpy(&(field), state + size, sizeof(field));	\
+		size += sizeof(field);					\
+	} while(0)
+
+	PEANUT_GB_STATE_FIELD(flags);
+	PEANUT_GB_STATE_FIELD(gb->cpu_reg);
+	PEANUT_GB_STATE_FIELD(gb->counter);
+	PEANUT_GB_STATE_FIELD(gb->selected_rom_bank);
+	PEANUT_GB_STATE_FIELD(gb->cart_ram_bank);
+	PEANUT_GB_STATE_FIELD(gb->enable_cart_ram);
+	PEANUT_GB_STATE_FIELD(gb->cart_mode_select);
+	PEANUT_GB_STATE_FIELD(gb->cart_rtc);
+	PEANUT_GB_STATE_FIELD(gb->wram);
+	PEANUT_GB_STATE_FIELD(gb->vram);
+	PEANUT_GB_STATE_FIELD(gb->oam);
+	PEANUT_GB_STATE_FIELD(gb->hram_io);
+	PEANUT_GB_STATE_FIELD(gb->display.bg_palette);
+	PEANUT_GB_STATE_FIELD(gb->display.sp_palette);
+	PEANUT_GB_STATE_FIELD(gb->display.window_clear);
+	PEANUT_GB_STATE_FIELD(gb->display.WY);
+#undef PEANUT_GB_STATE_FIELD
+
+	if(state != NULL && !save)
+	{
+		gb->gb_halt = flags & 1;
+		gb->gb_ime = (flags >> 1) & 1;
+		gb->lcd_blank = (flags >> 2) & 1;
+	}
+
+	return size;
+}
+
+static void __gb_state_header(struct gb_s *gb, struct gb_state_header_s *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = PEANUT_GB_STATE_MAGIC;
+	hdr->version = PEANUT_GB_STATE_VERSION;
+	hdr->header_checksum = gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC);
+	hdr->global_checksum = (gb->gb_rom_read(gb, 0x014E) << 8) |
+		gb->gb_rom_read(gb, 0x014F);
+	hdr->size = __gb_state_copy(gb, NULL, 1);
+}
+
+size_t gb_state_size(struct gb_s *gb)
+{
+	return sizeof(struct gb_state_header_s) +
+		__gb_state_copy(gb, NULL, 1);
+}
+
+size_t gb_state_save(struct gb_s *gb, void *state, const size_t size)
+{
+	struct gb_state_header_s hdr;
+
+	if(size < gb_state_size(gb))
+		return 0;
+
+	__gb_state_header(gb, &hdr);
+	memcpy(state, &hdr, sizeof(hdr));
+	__gb_state_copy(gb, (uint8_t *)state + sizeof(hdr), 1);
+	return sizeof(hdr) + hdr.size;
+}
+
+enum gb_state_error_e gb_state_load(struct gb_s *gb, const void *state,
+		const size_t size)
+{
+	struct gb_state_header_s hdr, expected;
+
+	if(size < sizeof(hdr))
+		return GB_STATE_INVALID_SIZE;
+
+	memcpy(&hdr, state, sizeof(hdr));
+	__gb_state_header(gb, &expected);
+	if(hdr.magic != expected.magic)
+		return GB_STATE_INVALID_FORMAT;
+	if(hdr.version != expected.version || hdr.size != expected.size)
+		return GB_STATE_VERSION_MISMATCH;
+	if(hdr.header_checksum != expected.header_checksum ||
+			hdr.global_checksum != expected.global_checksum)
+		return GB_STATE_ROM_MISMATCH;
+	if(size < sizeof(hdr) + hdr.size)
+		return GB_STATE_INVALID_SIZE;
+
+#if ENABLE_LCD && PEANUT_GB_SPLIT_RENDER
+	/* Queued lines are rendered from VRAM. */
+	__gb_render_wait(gb);
+#endif
+	__gb_state_copy(gb, (uint8_t *)state + sizeof(hdr), 0);
+
+	/* Rebuild what is derived from the restored fields. */
+	__gb_update_rom_bank(gb);
+#if PEANUT_GB_TILE_CACHE
+	for(uint_fast16_t i = 0; i < TILE_CACHE_ROWS; i++)
+		__gb_update_tile_cache(gb, 2 * i);
+#endif
+	__gb_oam_changed(gb);
+
+	return GB_STATE_NO_ERROR;
+}
+
 /**
  * This was taken from SameBoy, which is released under MIT Licence.
  */
@@ -3765,6 +5095,40 @@ void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
 			const uint8_t *pixels,
 			const uint_fast8_t line));
+
+#if PEANUT_GB_SPLIT_RENDER
+/**
+ * Queue lines instead of rendering them during emulation, so that they may be
+ * rendered elsewhere with gb_render_line(). Must be called after
+ * gb_init_lcd().
+ *
+ * Lines are rendered from the VRAM of the emulator context and from one of
+ * PGB_OAM_SNAPSHOTS copies of OAM, taken when OAM or the sprite size changes.
+ * lcd_queue_line returns a ticket for the line, and lcd_wait_line must not
+ * return until the line queued with the given ticket and all lines before it
+ * are rendered. The emulator calls it before modifying VRAM while lines are
+ * queued, and before replacing a snapshot that queued lines use.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param lcd_queue_line Pointer to function that queues a copy of line and
+ *		returns its ticket. NULL to render lines immediately.
+ * \param lcd_wait_line Pointer to function that waits until the line queued
+ *		with a ticket is rendered.
+ */
+void gb_set_split_render(struct gb_s *gb,
+		uint32_t (*lcd_queue_line)(struct gb_s *gb,
+			const struct gb_line_s *line),
+		void (*lcd_wait_line)(struct gb_s *gb, uint32_t ticket));
+
+/**
+ * Render a line queued by lcd_queue_line and pass it to lcd_draw_line. May be
+ * called from another thread or core than the one running the emulator.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param line	Line registers given to lcd_queue_line.
+ */
+void gb_render_line(struct gb_s *gb, const struct gb_line_s *line);
+#endif
 #endif
 
 /**
@@ -3777,13 +5141,27 @@ void gb_init_lcd(struct gb_s *gb,
  *		the serial connection. Must not be NULL.
  * \param gb_serial_rx Pointer to function that receives a byte of data over the
  *		serial connection. If no byte is received,
- *		return GB_SERIAL_RX_NO_CONNECTION. Must not be NULL.
+ *		return GB_SERIAL_RX_NO_CONNECTION, or GB_SERIAL_RX_PENDING to
+ *		try again after SERIAL_CYCLES without completing the transfer.
+ *		Must not be NULL.
  */
 void gb_init_serial(struct gb_s *gb,
 		    void (*gb_serial_tx)(struct gb_s*, const uint8_t),
 		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
 			    uint8_t*));
 
+/**
+ * Sets the state of the joypad, in the format of gb->direct.joypad, at any
+ * time during emulation. Unlike writing gb->direct.joypad, the buttons read
+ * from JOYP are updated straight away, and the joypad interrupt is requested
+ * when a button of the selected group is pressed, which wakes a game waiting
+ * in HALT for input.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param joypad	Buttons, with a bit cleared for each button pressed.
+ */
+void gb_set_joypad(struct gb_s *gb, const uint8_t joypad);
+
 /**
  * Obtains the save size of the game (size of the Cart RAM). Required by the
  * frontend to allocate enough memory for the Cart RAM.
@@ -3804,6 +5182,17 @@ uint_fast32_t gb_get_save_size(struct gb_s *gb);
  */
 uint8_t gb_colour_hash(struct gb_s *gb);
 
+/**
+ * Returns the number of cycles since the start of the frame being emulated,
+ * which begins at VBlank. May be used to time events within a frame, such as
+ * writes to audio registers.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Cycles since the start of the frame. Normally less than
+ *		LCD_VERT_LINES * LCD_LINE_CYCLES while the LCD is on.
+ */
+uint_fast32_t gb_get_frame_cycles(const struct gb_s *gb);
+
 /**
  * Returns the title of ROM.
  *
@@ -3838,6 +5227,59 @@ void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
 void gb_set_bootrom(struct gb_s *gb,
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t));
 
+/**
+ * Read ROM banks through direct pointers instead of calling gb_rom_read for
+ * every access. gb_rom_bank_ptr is only called when the selected ROM bank
+ * changes. Should be called after gb_init().
+ * \param gb 	An initialised emulator context. Must not be NULL.
+ * \param gb_rom_bank_ptr Function pointer returning the start of a 16 KiB ROM
+ *		bank, or NULL if that bank must be read with gb_rom_read.
+ */
+void gb_set_rom_bank_ptr(struct gb_s *gb,
+	const uint8_t *(*gb_rom_bank_ptr)(struct gb_s*, const uint_fast16_t));
+
+/**
+ * Map 4 KiB of the selected ROM bank, which gb_rom_bank_ptr returned NULL for,
+ * once gb_rom_read has loaded it. Later reads of that part of the bank use the
+ * pointer directly, until the selected ROM bank changes. Does nothing without
+ * PEANUT_GB_USE_PAGE_TABLE.
+ * \param gb 	An initialised emulator context. Must not be NULL.
+ * \param page	Part of the bank, 0 for 0x4000-0x4FFF to 3 for 0x7000-0x7FFF.
+ * \param ptr	Pointer to the 4 KiB of ROM, which must stay valid while the
+ *		bank is selected.
+ */
+void gb_set_rom_page(struct gb_s *gb, const uint_fast8_t page,
+	const uint8_t *ptr);
+
+/**
+ * Returns the size in bytes of a save state of the emulator context.
+ * \param gb	An initialised emulator context. Must not be NULL.
+ */
+size_t gb_state_size(struct gb_s *gb);
+
+/**
+ * Save the state of the emulator to "state", in a versioned format which
+ * identifies the ROM. Cart RAM and the APU state are not included, and must be
+ * saved by the front-end. Should be called between frames.
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param state	Buffer of "size" bytes to save the state to.
+ * \return	Number of bytes saved, or 0 if "size" is smaller than
+ *		gb_state_size().
+ */
+size_t gb_state_save(struct gb_s *gb, void *state, const size_t size);
+
+/**
+ * Restore a state saved by gb_state_save(). The ROM bank pointers, page table
+ * and tile cache are rebuilt, and the sprite buckets are invalidated.
+ * \param gb	An initialised emulator context for the same ROM. Must not be
+ *		NULL.
+ * \param state	Buffer of "size" bytes holding the state.
+ * \return	GB_STATE_NO_ERROR on success, and leaves the context unchanged
+ *		otherwise.
+ */
+enum gb_state_error_e gb_state_load(struct gb_s *gb, const void *state,
+		const size_t size);
+
 /* Undefine CPU Flag helper functions. */
 #undef PEANUT_GB_CPUFLAG_MASK_CARRY
 #undef PEANUT_GB_CPUFLAG_MASK_HALFC
@@ -34,7 +34,9 @@ static spi_t spis[]={
         .miso_gpio=12,
         .mosi_gpio=15,
         .sck_gpio=14,
-        .baud_rate=12500*1000,
+        /* Highest clock tried for data transfer. The clock used is
+         * negotiated with the card by sd_init(). */
+        .baud_rate=31250*1000,
         .dma_isr=spi_dma_isr
     }
 };
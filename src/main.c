@@ -19,17 +19,174 @@
 #define ENABLE_SDCARD	1
 #define PEANUT_GB_HIGH_LCD_ACCURACY 1
 #define PEANUT_GB_USE_BIOS 0
+#define PEANUT_GB_USE_PAGE_TABLE 1
+#define PEANUT_GB_USE_COMPUTED_GOTO 1
+#define PEANUT_GB_FUSE_OPCODES 1
+#define PEANUT_GB_EVENT_SCHEDULER 1
+#define PEANUT_GB_FAST_HALT 1
+#define PEANUT_GB_TILE_CACHE 1
+#define PEANUT_GB_SPRITE_BUCKETS 1
+#define PEANUT_GB_SPLIT_RENDER 1
+#define PEANUT_GB_HEATMAP 0
+#define PEANUT_GB_MBC_VARIANTS 1
+/* The opcode tables of the CPU core are in scratch Y, beside the stack of
+ * core 0, where core 1 and the DMA never contend for them. */
+#define PEANUT_GB_CORE_DATA __scratch_y("peanut_gb")
 
-/* Use DMA for all drawing to LCD. Benefits aren't fully realised at the moment
- * due to busy loops waiting for DMA completion. */
-#define USE_DMA		0
+/* Number of lines that core 0 may queue for core 1 to send to the LCD, up to a
+ * full frame of 144 lines. Core 0 waits for core 1 when all are in use, and
+ * with PEANUT_GB_SPLIT_RENDER before changing VRAM while lines are queued. */
+#define LCD_LINE_RING_DEPTH	16
+
+/* Use DMA for sending lines to the LCD. Core 1 converts the next line while
+ * the previous one is sent. */
+#define USE_DMA		1
+
+/* Send data to the LCD with a state machine on LCD_PIO instead of the spi0
+ * peripheral, which allows bit rates above its 125 MHz / 4 limit. The bit rate
+ * is rounded down to clk_sys / 2N for an integer N. */
+#define LCD_USE_PIO	1
+#define LCD_PIO		pio1
+#define LCD_PIO_BAUD	(50 * 1000 * 1000)
+
+/* Do not send lines to the LCD that are unchanged since they were last sent. */
+#define LCD_SKIP_UNCHANGED_LINES	1
+
+/* Start each frame once the LCD has scanned past the DMG screen, which avoids
+ * tearing. Not supported with the wiring of this board, where the SDA line of
+ * the LCD is write only: the scan position is read back from the LCD, so this
+ * needs the LCD SDO pin connected to GPIO_SDO, MK_ILI9225_READ_AVAILABLE
+ * defined to 1 and LCD_USE_PIO 0. The LCD keeps its own refresh rate. */
+#define LCD_VSYNC	0
+/* Time to sleep between reads of the line being scanned by the LCD. */
+#define LCD_VSYNC_POLL_US	500
+
+/* Pace emulation to the DMG refresh rate of 59.7275 Hz with a timer alarm.
+ * Time lost beyond FRAME_PACER_MAX_LAG frames is dropped. Without
+ * AUTO_FRAME_SKIP_MAX, frame skip is enabled while emulation is behind. */
+#define ENABLE_FRAME_PACER	1
+#define FRAME_PACER_MAX_LAG	4
+
+/* Number of frames of audio that may be queued for I2S output. Each frame
+ * holds AUDIO_SAMPLES stereo samples played at AUDIO_SAMPLE_RATE Hz. */
+#define AUDIO_BUFFER_COUNT	3
+
+/* When MINIGB_APU_WRITE_LOG is set for the build, audio samples are generated
+ * on core 1 between LCD lines, this many stereo samples at a time. */
+#define AUDIO_RENDER_CHUNK	64
+
+/* Save cart RAM to the SD card in the background, a block of 512 bytes at a
+ * time. Blocks written by the game are saved once it has not written to cart
+ * RAM for AUTOSAVE_IDLE_FRAMES frames, at most AUTOSAVE_BLOCKS_PER_FRAME
+ * blocks per frame, and only in frames that finish ahead of time. */
+#define ENABLE_AUTOSAVE	1
+#define AUTOSAVE_IDLE_FRAMES	30
+#define AUTOSAVE_BLOCKS_PER_FRAME	1
+
+/* Save states, in STATE_SLOTS slots per game. A state is copied to RAM at the
+ * end of a frame, and written to the SD card STATE_WRITE_CHUNK bytes at a time
+ * in frames that finish ahead of time.
+ * Select + B: save the state of the current slot
+ * Start + B: load the state of the current slot
+ * Start + left / right: select the previous / next slot */
+#define ENABLE_SAVE_STATES	1
+#define STATE_SLOTS		4
+#define STATE_WRITE_CHUNK	4096
+
+/* Rewind while Start + up are held, going back one snapshot per frame.
+ * Snapshots are taken every REWIND_INTERVAL frames, and all but the last are
+ * stored as deltas in a ring buffer of REWIND_BUFFER_SIZE bytes. Only the
+ * emulator context is rewound: cart RAM and audio carry on from the present.
+ * Requires ENABLE_SDCARD, as snapshots are encoded in the SD card buffer. */
+#define ENABLE_REWIND		1
+#define REWIND_INTERVAL		4
+#define REWIND_BUFFER_SIZE	(32 * 1024)
+
+/* Play ROMs larger than the flash after FLASH_TARGET_OFFSET, up to 8 MiB. The
+ * start of the ROM is programmed to flash as usual. Beyond it, each 4 KiB of a
+ * selected bank is read from the SD card the first time the game reads it,
+ * into ROM_STREAM_CHUNKS chunks of SRAM replaced least recently used first.
+ * The chunks of the selected bank are not replaced. */
+#define ENABLE_ROM_STREAMING	1
+#define ROM_STREAM_CHUNKS	8
+
+/* Time each part of the emulator every frame, on both cores. The 'p' serial
+ * command prints the minimum, average and maximum time per frame of each part,
+ * and a histogram, over the frames since the previous report, along with the
+ * bus contention between the cores. Nothing is timed when 0. */
+#define ENABLE_PROFILER		0
+
+/* Record and replay the joypad over the serial console, to compare the speed
+ * of builds on the device with the input of the host replay suite. Traces are
+ * lines "J <frames> <joypad>", as read by host/gb_bench.
+ * 'R': reset the game and start recording, or stop recording
+ * 'r': read a trace ended by a line "E", reset the game and replay it, then
+ *      report the frame times and the hash of the frames drawn
+ * Cart RAM is cleared on reset and not saved, and the emulation ends once the
+ * replay is over. Hotkeys are not recorded. */
+#define ENABLE_REPLAY		0
+#define REPLAY_RUNS_MAX		512
+
+/* Read the joypad in a GPIO interrupt on every button edge, and pass changes to
+ * the game between two instructions instead of once per frame. A button
+ * ignores edges for JOYPAD_DEBOUNCE_US after it changes. */
+#define ENABLE_JOYPAD_IRQ	1
+#define JOYPAD_DEBOUNCE_US	2000
+
+/* Skip drawing up to this many frames for each drawn frame when frames take
+ * longer to emulate than the DMG refresh period. 0 to disable. */
+#define AUTO_FRAME_SKIP_MAX	3
+
+/* Fast forward speeds selected in turn with Select + A: 2x, 4x and so on up
+ * to TURBO_SPEED_MAX, then back to normal speed. Only the last of each group
+ * of frames is drawn and has its audio played, and with ENABLE_FRAME_PACER
+ * each group takes one DMG refresh period, as far as emulation keeps up. */
+#define TURBO_SPEED_MAX		8
+
+/* Link cable between two Pico-GB over LINK_UART at LINK_BAUD, whatever the
+ * clock state: wire the TX pin of each unit to the RX pin of the other, and
+ * join their grounds. The game clocking a transfer stalls at most
+ * LINK_WAIT_US for the byte of its peer, then runs on with the transfer
+ * pending until the byte arrives. Without a peer heard from in the last
+ * LINK_TIMEOUT_US, transfers complete with 0xFF at once. Transfers, stalls
+ * and latencies are reported with the 'b' command. */
+#define ENABLE_LINK		1
+#define LINK_UART		uart0
+#define LINK_GPIO_TX		0
+#define LINK_GPIO_RX		1
+#define LINK_BAUD		(1000 * 1000)
+#define LINK_WAIT_US		2000
+#define LINK_TIMEOUT_US		(1000 * 1000)
+#define LINK_HELLO_FRAMES	30
+
+/* Lower the system clock, and the core voltage with it, while the game leaves
+ * time to spare. Each frame is timed from its start to the end of its audio.
+ * The next slower clock state is selected when the longest of the last
+ * DVFS_WINDOW frames would take less than DVFS_DOWN_PERCENT of the frame
+ * period there, and the next faster one as soon as a frame takes more than
+ * DVFS_UP_PERCENT, frames are skipped or audio underruns. Fast forward runs at
+ * the fastest state. The time spent in each state is reported with the 'b'
+ * command. */
+#define ENABLE_DVFS		0
+#define DVFS_WINDOW		120
+#define DVFS_DOWN_PERCENT	75
+#define DVFS_UP_PERCENT		90
+#define DVFS_VREG_SETTLE_US	1000
+
+/* At power on, start the game left in flash straight away, without the ROM
+ * selector, unless a button is held. The LCD is then initialised on core 1
+ * while core 0 mounts the SD card and loads the save file. With
+ * FAST_BOOT_RESUME_STATE, the newest save state of the game is loaded too.
+ * The time from power on to the first frame is printed. */
+#define ENABLE_FAST_BOOT	1
+#define FAST_BOOT_RESUME_STATE	0
 
 /**
  * Reducing VSYNC calculation to lower multiple.
  * When setting a clock IRQ to DMG_CLOCK_FREQ_REDUCED, count to
  * SCREEN_REFRESH_CYCLES_REDUCED to obtain the time required each VSYNC.
  * DMG_CLOCK_FREQ_REDUCED = 2^18, and SCREEN_REFRESH_CYCLES_REDUCED = 4389.
- * Currently unused.
+ * Used by the frame pacer.
  */
 #define VSYNC_REDUCTION_FACTOR 16u
 #define SCREEN_REFRESH_CYCLES_REDUCED (SCREEN_REFRESH_CYCLES/VSYNC_REDUCTION_FACTOR)
@@ -39,6 +196,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 
 /* RP2040 Headers */
 #include <hardware/pio.h>
@@ -48,6 +207,7 @@
 #include <hardware/sync.h>
 #include <hardware/flash.h>
 #include <hardware/timer.h>
+#include <hardware/uart.h>
 #include <hardware/vreg.h>
 #include <pico/bootrom.h>
 #include <pico/stdio.h>
@@ -55,6 +215,7 @@
 #include <pico/multicore.h>
 #include <sys/unistd.h>
 #include <hardware/irq.h>
+#include <hardware/structs/busctrl.h>
 
 /* Project headers */
 #include "hedley.h"
@@ -63,6 +224,7 @@
 #include "mk_ili9225.h"
 #include "sdcard.h"
 #include "i2s.h"
+#include "lcd_spi.pio.h"
 #include "gbcolors.h"
 
 /* GPIO Connections. */
@@ -80,17 +242,32 @@
 #define GPIO_RS		20
 #define GPIO_RST	21
 #define GPIO_LED	22
+#if MK_ILI9225_READ_AVAILABLE
+# define GPIO_SDO	16
+#endif
 
-#if ENABLE_SOUND
-/**
- * Global variables for audio task
- * stream contains N=AUDIO_SAMPLES samples
- * each sample is 32 bits
- * 16 bits for the left channel + 16 bits for the right channel in stereo interleaved format)
- * This is intended to be played at AUDIO_SAMPLE_RATE Hz
- */
-uint16_t *stream;
+/* Scale the DMG screen by 11/9 to the full height of the LCD, with
+ * nearest-neighbour sampling. Columns are picked through a precomputed map and
+ * repeated lines are sent again from the same buffer, at the cost of half as
+ * much SPI time again per frame. Tearing is not avoided with LCD_VSYNC, as the
+ * LCD has no border below the screen to start frames in. */
+#define LCD_SCALE	0
+
+/* Size and position of the DMG screen on the LCD. */
+#if LCD_SCALE
+# define LCD_SCREEN_WIDTH	196
+# define LCD_SCREEN_HEIGHT	176
+# define LCD_OFFSET_X	12
+# define LCD_OFFSET_Y	0
+#else
+# define LCD_SCREEN_WIDTH	LCD_WIDTH
+# define LCD_SCREEN_HEIGHT	LCD_HEIGHT
+# define LCD_OFFSET_X	31
+# define LCD_OFFSET_Y	16
 #endif
+/* First row of the screen showing a DMG line. */
+#define LCD_SCREEN_ROW(line)						\
+	(((line) * LCD_SCREEN_HEIGHT + LCD_HEIGHT - 1) / LCD_HEIGHT)
 
 /** Definition of ROM data
  * We're going to erase and reprogram a region 1Mb from the start of the flash
@@ -98,33 +275,56 @@ uint16_t *stream;
  * Game Boy DMG ROM size ranges from 32768 bytes (e.g. Tetris) to 1,048,576 bytes (e.g. Pokemod Red)
  */
 #define FLASH_TARGET_OFFSET (1024 * 1024)
+#define ROM_FLASH_SIZE (PICO_FLASH_SIZE_BYTES - FLASH_TARGET_OFFSET)
 const uint8_t *rom = (const uint8_t *) (XIP_BASE + FLASH_TARGET_OFFSET);
-static unsigned char rom_bank0[65536];
+/* The sector before the ROM describes the ROM resident in flash, so that it is
+ * only reprogrammed when a different file is selected. */
+#define FLASH_HEADER_OFFSET (FLASH_TARGET_OFFSET - FLASH_SECTOR_SIZE)
+/* Bank 0 of the ROM, copied to SRAM as it holds the interrupt vectors and
+ * the routines most games run from. Other banks are read through the XIP
+ * cache. */
+static unsigned char rom_bank0[ROM_BANK_SIZE];
 
 static uint8_t ram[32768];
-static int lcd_line_busy = 0;
+/* Blocks of cart RAM written since they were last saved, one bit per block. */
+#define SAVE_BLOCK_SIZE	512
+#define SAVE_BLOCKS	(sizeof(ram) / SAVE_BLOCK_SIZE)
+static uint32_t ram_dirty[SAVE_BLOCKS / 32];
+/* Set on writes to cart RAM, cleared by the autosave every frame. */
+static bool ram_written;
 static palette_t palette;	// Colour palette
 static uint8_t manual_palette_selected=0;
+/* Fast forward enabled by the user, at turbo_speed frames emulated for each
+ * frame drawn. */
+static bool fast_forward = false;
+static uint_fast8_t turbo_speed = 1;
 
-static struct
+/* Buttons as they were when the hotkeys were last handled, in the format of
+ * gb.direct. Kept apart from gb.direct.joypad, which also changes while a
+ * frame is emulated. */
+static union
 {
-	unsigned a	: 1;
-	unsigned b	: 1;
-	unsigned select	: 1;
-	unsigned start	: 1;
-	unsigned right	: 1;
-	unsigned left	: 1;
-	unsigned up	: 1;
-	unsigned down	: 1;
-} prev_joypad_bits;
+	struct
+	{
+		unsigned a	: 1;
+		unsigned b	: 1;
+		unsigned select	: 1;
+		unsigned start	: 1;
+		unsigned right	: 1;
+		unsigned left	: 1;
+		unsigned up	: 1;
+		unsigned down	: 1;
+	} bits;
+	uint8_t joypad;
+} prev_joypad;
 
 /* Multicore command structure. */
 union core_cmd {
     struct {
 	/* Does nothing. */
 #define CORE_CMD_NOP		0
-	/* Set line "data" on the LCD. Pixel data is in pixels_buffer. */
-#define CORE_CMD_LCD_LINE	1
+	/* Send all following lines to the LCD, even if unchanged. */
+#define CORE_CMD_LCD_INVALIDATE	1
 	/* Control idle mode on the LCD. Limits colours to 2 bits. */
 #define CORE_CMD_IDLE_SET	2
 	/* Set a specific pixel. For debugging. */
@@ -137,11 +337,352 @@ union core_cmd {
     uint32_t full;
 };
 
-/* Pixel data is stored in here. */
-static uint8_t pixels_buffer[LCD_WIDTH];
+#if LCD_LINE_RING_DEPTH < 1 || LCD_LINE_RING_DEPTH > LCD_HEIGHT
+# error "LCD_LINE_RING_DEPTH must be between 1 and 144"
+#endif
+
+/* Lines waiting to be sent to the LCD by core 1. Core 0 only writes
+ * lcd_ring_head and core 1 only writes lcd_ring_tail. Each side signals the
+ * other with SEV after moving its index. */
+struct lcd_line_slot {
+#if PEANUT_GB_SPLIT_RENDER
+	/* Line registers to render on core 1. */
+	struct gb_line_s regs;
+#else
+	uint8_t pixels[LCD_WIDTH];
+	uint8_t line;
+#endif
+};
+static struct lcd_line_slot lcd_ring[LCD_LINE_RING_DEPTH];
+static uint32_t lcd_ring_head = 0;
+static uint32_t lcd_ring_tail = 0;
+
+/* Number of times core 0 waited for a free slot, and for how long. */
+static uint32_t lcd_ring_stalls = 0;
+static uint64_t lcd_ring_stall_us = 0;
+
+#if PEANUT_GB_SPLIT_RENDER
+/* Number of times core 0 waited for queued lines to be rendered before
+ * changing VRAM or replacing an OAM snapshot, and for how long. */
+static uint32_t lcd_ring_drains = 0;
+static uint64_t lcd_ring_drain_us = 0;
+/* Emulator context rendered from on core 1. */
+static struct gb_s *core1_gb;
+#endif
+
+#if ENABLE_SOUND && MINIGB_APU_WRITE_LOG
+# if !ENABLE_LCD
+#  error "MINIGB_APU_WRITE_LOG requires core 1, which is started with ENABLE_LCD"
+# endif
+/* Emulator context timing audio register writes, and the I2S output that
+ * core 1 generates samples for. */
+static struct gb_s *audio_gb;
+static i2s_config_t *core1_i2s;
+#endif
+
+#if ENABLE_PROFILER
+/* Parts of the emulator timed by the profiler. Each part is only timed on one
+ * core. */
+enum profile_part {
+	/* Core 0: the whole frame, from emulation to the end of pacing. */
+	PROFILE_FRAME,
+	/* Core 0: stepping the CPU for a frame, which includes the waits below
+	 * and, without PEANUT_GB_SPLIT_RENDER, drawing lines. */
+	PROFILE_CPU,
+	/* Core 0: waiting for core 1 to take lines from the line ring. */
+	PROFILE_LCD_WAIT,
+	/* Core 0: waiting for a free I2S buffer. */
+	PROFILE_I2S_WAIT,
+	/* Core 0, or core 1 with MINIGB_APU_WRITE_LOG: generating samples. */
+	PROFILE_AUDIO,
+	/* Core 1: rendering lines with PEANUT_GB_SPLIT_RENDER, including
+	 * sending them to the LCD. */
+	PROFILE_DRAW_LINE,
+	/* Core 1: sending lines to the LCD. */
+	PROFILE_LCD_SPI,
+	PROFILE_PARTS
+};
+
+static const char *const profile_names[PROFILE_PARTS] = {
+	"frame", "cpu", "lcd wait", "i2s wait", "audio", "draw line", "lcd spi"
+};
+
+/* Bin n of the histogram counts frames taking up to 2^n - 1 us in a part, and
+ * the last bin all longer frames. */
+#define PROFILE_HIST_BINS	16
+
+static struct {
+	/* Microseconds spent in each part, only written by the core timing
+	 * it, and their value at the end of the previous frame. */
+	uint32_t total[PROFILE_PARTS];
+	uint32_t last[PROFILE_PARTS];
+	/* Frames since the previous report, and the time spent in each part
+	 * per frame. */
+	uint32_t frames;
+	uint32_t min[PROFILE_PARTS];
+	uint32_t max[PROFILE_PARTS];
+	uint64_t sum[PROFILE_PARTS];
+	uint32_t hist[PROFILE_PARTS][PROFILE_HIST_BINS];
+	/* Bus fabric events counted by the counters of the bus controller,
+	 * which saturate and so are added up every frame. */
+	uint64_t bus[4];
+} profile;
+
+/* Accesses to one of the four striped SRAM banks, as a sample of all of them,
+ * and the accesses that waited for another master. Then the accesses to the
+ * scratch banks that waited: scratch X is used by core 1 and the LCD DMA,
+ * scratch Y by core 0. */
+static const uint8_t profile_bus_events[4] = {
+	arbiter_sram0_perf_event_access,
+	arbiter_sram0_perf_event_access_contested,
+	arbiter_sram4_perf_event_access_contested,
+	arbiter_sram5_perf_event_access_contested
+};
+
+# define PROFILE_BEGIN(part)	const uint32_t profile_start_##part = time_us_32()
+# define PROFILE_END(part)	\
+	profile.total[part] += time_us_32() - profile_start_##part
+
+static void profile_reset(void)
+{
+	profile.frames = 0;
+	memset(profile.bus, 0, sizeof(profile.bus));
+	memset(profile.min, 0xFF, sizeof(profile.min));
+	memset(profile.max, 0, sizeof(profile.max));
+	memset(profile.sum, 0, sizeof(profile.sum));
+	memset(profile.hist, 0, sizeof(profile.hist));
+}
+
+/**
+ * Start a report from the current frame.
+ */
+static void profile_start(void)
+{
+	for(unsigned part = 0; part < PROFILE_PARTS; part++)
+	{
+		profile.last[part] =
+			__atomic_load_n(&profile.total[part], __ATOMIC_RELAXED);
+	}
+
+	for(unsigned i = 0; i < count_of(profile_bus_events); i++)
+	{
+		busctrl_hw->counter[i].sel = profile_bus_events[i];
+		/* Any write clears the counter. */
+		busctrl_hw->counter[i].value = 0;
+	}
+
+	profile_reset();
+}
+
+/**
+ * Add the time spent in each part since the previous frame to the report.
+ * Called on core 0 at the end of each frame.
+ */
+static void profile_frame_end(void)
+{
+	for(unsigned part = 0; part < PROFILE_PARTS; part++)
+	{
+		const uint32_t total =
+			__atomic_load_n(&profile.total[part], __ATOMIC_RELAXED);
+		const uint32_t us = total - profile.last[part];
+		unsigned bin = us ? 32 - __builtin_clz(us) : 0;
+
+		profile.last[part] = total;
+		if(us < profile.min[part])
+			profile.min[part] = us;
+		if(us > profile.max[part])
+			profile.max[part] = us;
+		profile.sum[part] += us;
+		if(bin >= PROFILE_HIST_BINS)
+			bin = PROFILE_HIST_BINS - 1;
+		profile.hist[part][bin]++;
+	}
+
+	for(unsigned i = 0; i < count_of(profile_bus_events); i++)
+	{
+		profile.bus[i] += busctrl_hw->counter[i].value;
+		busctrl_hw->counter[i].value = 0;
+	}
+
+	profile.frames++;
+}
+
+static void profile_report(void)
+{
+	if(profile.frames == 0)
+		return;
+
+	printf("Profile of %lu frames, us per frame: min avg max | "
+		"frames up to 0, 1, 3, 7 ... us\n", profile.frames);
+	for(unsigned part = 0; part < PROFILE_PARTS; part++)
+	{
+		printf("%-9s %6lu %6lu %6lu |", profile_names[part],
+			profile.min[part],
+			(uint32_t)(profile.sum[part] / profile.frames),
+			profile.max[part]);
+		for(unsigned bin = 0; bin < PROFILE_HIST_BINS; bin++)
+			printf(" %lu", profile.hist[part][bin]);
+		putchar('\n');
+	}
+
+	printf("Bus per frame: SRAM0 %lu accesses, %lu contested (%lu%%), "
+		"scratch X %lu contested, scratch Y %lu contested\n",
+		(uint32_t)(profile.bus[0] / profile.frames),
+		(uint32_t)(profile.bus[1] / profile.frames),
+		profile.bus[0] ?
+		(uint32_t)(profile.bus[1] * 100 / profile.bus[0]) : 0,
+		(uint32_t)(profile.bus[2] / profile.frames),
+		(uint32_t)(profile.bus[3] / profile.frames));
+
+	profile_reset();
+}
+#else
+# define PROFILE_BEGIN(part)
+# define PROFILE_END(part)
+#endif
+
+#if ENABLE_REPLAY
+/* Bin n of the histogram counts frames taking up to 2^n - 1 us. */
+#define REPLAY_HIST_BINS	16
+
+static struct {
+	/* Frames drawn are hashed on core 1 while set. */
+	bool active;
+	bool recording;
+	/* Trace, as runs of frames holding the same joypad value. */
+	struct {
+		uint16_t frames;
+		uint8_t joypad;
+	} run[REPLAY_RUNS_MAX];
+	uint16_t runs;
+	/* Run being replayed or recorded, and its frames left or recorded. */
+	uint16_t pos;
+	uint16_t frames;
+	uint8_t joypad;
+	/* FNV-1a hash of the lines drawn, only written by core 1. */
+	uint32_t frame_hash;
+	/* Time per frame spent before frame pacing. */
+	uint32_t frame_count;
+	uint32_t frame_us_min;
+	uint32_t frame_us_max;
+	uint64_t frame_us_sum;
+	uint32_t hist[REPLAY_HIST_BINS];
+} replay;
+#endif
 
 #define putstdio(x) write(1, x, strlen(x))
 
+#if MK_ILI9225_READ_AVAILABLE && LCD_USE_PIO
+# error "Reading from the LCD requires LCD_USE_PIO 0"
+#endif
+
+#if LCD_USE_PIO
+/* State machine on LCD_PIO sending data to the LCD. */
+static uint lcd_pio_sm;
+#endif
+
+#if ENABLE_LCD && USE_DMA
+/* DMA channel sending pixels to the LCD, and whether a transfer is ongoing. */
+static int lcd_dma_chan = -1;
+static volatile bool lcd_dma_busy = false;
+
+/**
+ * Called on core 1 when the DMA has written all pixels to the SPI FIFO.
+ */
+static void __isr lcd_dma_irq_handler(void)
+{
+	dma_channel_acknowledge_irq1(lcd_dma_chan);
+	lcd_dma_busy = false;
+	__sev();
+}
+
+/**
+ * Wait for the SPI FIFO to be shifted out after a DMA transfer, and discard
+ * the data received during it.
+ */
+static void lcd_spi_flush(void)
+{
+#if LCD_USE_PIO
+	lcd_spi_wait_idle(LCD_PIO, lcd_pio_sm);
+#else
+	while(spi_is_busy(spi0))
+		tight_loop_contents();
+
+	while(spi_is_readable(spi0))
+		(void) spi_get_hw(spi0)->dr;
+	spi_get_hw(spi0)->icr = SPI_SSPICR_RORIC_BITS;
+#endif
+}
+
+/**
+ * Wait until the DMA has finished reading the pixels passed to
+ * lcd_dma_write_pixels().
+ */
+static inline void lcd_dma_wait(void)
+{
+	while(lcd_dma_busy)
+		__wfe();
+}
+
+/**
+ * Initialise the LCD DMA channel and its interrupt on the calling core.
+ */
+static void lcd_dma_init(void)
+{
+	dma_channel_config c;
+
+	if(lcd_dma_chan < 0)
+		lcd_dma_chan = dma_claim_unused_channel(true);
+
+	c = dma_channel_get_default_config(lcd_dma_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+#if LCD_USE_PIO
+	channel_config_set_dreq(&c, pio_get_dreq(LCD_PIO, lcd_pio_sm, true));
+	dma_channel_configure(lcd_dma_chan, &c, &LCD_PIO->txf[lcd_pio_sm], NULL,
+			0, false);
+#else
+	channel_config_set_dreq(&c, spi_get_dreq(spi0, true));
+	dma_channel_configure(lcd_dma_chan, &c, &spi_get_hw(spi0)->dr, NULL,
+			0, false);
+#endif
+
+	dma_channel_set_irq1_enabled(lcd_dma_chan, true);
+	irq_set_exclusive_handler(DMA_IRQ_1, lcd_dma_irq_handler);
+	irq_set_enabled(DMA_IRQ_1, true);
+}
+
+/**
+ * Stop using the LCD DMA after core 1 has been reset, which may have happened
+ * during a transfer.
+ */
+static void lcd_dma_stop(void)
+{
+	if(lcd_dma_chan < 0)
+		return;
+
+	dma_channel_set_irq1_enabled(lcd_dma_chan, false);
+	dma_channel_wait_for_finish_blocking(lcd_dma_chan);
+	lcd_spi_flush();
+
+	gpio_put(GPIO_CS, 1);
+	lcd_dma_busy = false;
+}
+
+/**
+ * Start sending pixels to the LCD GRAM and return immediately. GRAM writes
+ * must already have been started with mk_ili9225_write_pixels_start(). The
+ * pixels must not be modified until lcd_dma_wait() returns.
+ */
+static void lcd_dma_write_pixels(const uint16_t *pixels, uint_fast16_t nmemb)
+{
+	lcd_dma_wait();
+	lcd_dma_busy = true;
+	dma_channel_transfer_from_buffer_now(lcd_dma_chan, pixels, nmemb);
+}
+#endif
+
 /* Functions required for communication with the ILI9225. */
 void mk_ili9225_set_rst(bool state)
 {
@@ -150,11 +691,17 @@ void mk_ili9225_set_rst(bool state)
 
 void mk_ili9225_set_rs(bool state)
 {
+#if ENABLE_LCD && USE_DMA
+	lcd_dma_wait();
+#endif
 	gpio_put(GPIO_RS, state);
 }
 
 void mk_ili9225_set_cs(bool state)
 {
+#if ENABLE_LCD && USE_DMA
+	lcd_dma_wait();
+#endif
 	gpio_put(GPIO_CS, state);
 }
 
@@ -165,26 +712,184 @@ void mk_ili9225_set_led(bool state)
 
 void mk_ili9225_spi_write16(const uint16_t *halfwords, size_t len)
 {
+#if ENABLE_LCD && USE_DMA
+	lcd_dma_wait();
+#endif
+#if LCD_USE_PIO
+	lcd_spi_put16(LCD_PIO, lcd_pio_sm, halfwords, len);
+	lcd_spi_wait_idle(LCD_PIO, lcd_pio_sm);
+#else
 	spi_write16_blocking(spi0, halfwords, len);
+#endif
+}
+
+#if MK_ILI9225_READ_AVAILABLE
+uint16_t mk_ili9225_spi_read16(void)
+{
+	uint16_t halfword;
+
+#if ENABLE_LCD && USE_DMA
+	lcd_dma_wait();
+#endif
+	spi_read16_blocking(spi0, 0, &halfword, 1);
+	return halfword;
 }
+#endif
 
 void mk_ili9225_delay_ms(unsigned ms)
 {
 	sleep_ms(ms);
 }
 
+#if ENABLE_SDCARD && ENABLE_ROM_STREAMING
+/* The chunks of the selected bank are kept, so one more is needed to read the
+ * others. */
+#if ROM_STREAM_CHUNKS < 5
+# error "ROM_STREAM_CHUNKS must be at least 5"
+#endif
+
+/* Number of entries of the cluster link map of a streamed ROM. A contiguous
+ * file needs 4, each further fragment 2 more. */
+#define ROM_STREAM_CLMT_SIZE	64
+
+/* A chunk is one page of the memory map of the emulator, so that it can be
+ * mapped with gb_set_rom_page(). */
+#define ROM_STREAM_CHUNK_SIZE	0x1000
+#define ROM_STREAM_BANK_CHUNKS	(ROM_BANK_SIZE / ROM_STREAM_CHUNK_SIZE)
+
+/* Chunks of the ROM file beyond the flash, read from the SD card when they are
+ * first read. */
+static uint8_t rom_stream_chunks[ROM_STREAM_CHUNKS][ROM_STREAM_CHUNK_SIZE];
+
+static struct {
+	FIL fil;
+	bool open;
+	/* Chunk of the ROM file held in each slot, or 0xFFFF. */
+	uint16_t chunk[ROM_STREAM_CHUNKS];
+	/* Time each slot was last used, for the least recently used. */
+	uint32_t used[ROM_STREAM_CHUNKS];
+	uint32_t clock;
+	/* Streamed bank selected by the emulator, or 0xFFFF. */
+	uint16_t bank;
+	uint32_t switches;
+	uint32_t faults;
+	uint64_t fault_us;
+	uint32_t fault_max_us;
+	DWORD clmt[ROM_STREAM_CLMT_SIZE];
+} rom_stream;
+
+/**
+ * Returns the slot holding the given chunk, reading it from the SD card into
+ * the least recently used slot not holding the selected bank if it is not
+ * held.
+ */
+static uint_fast8_t rom_stream_slot(const uint_fast16_t chunk)
+{
+	uint_fast8_t slot = ROM_STREAM_CHUNKS;
+	uint8_t *dst;
+	uint64_t start;
+	uint32_t us;
+	FRESULT fr;
+	UINT br = 0;
+
+	for(uint_fast8_t i = 0; i < ROM_STREAM_CHUNKS; i++)
+	{
+		if(rom_stream.chunk[i] == chunk)
+		{
+			rom_stream.used[i] = ++rom_stream.clock;
+			return i;
+		}
+
+		if(rom_stream.chunk[i] / ROM_STREAM_BANK_CHUNKS == rom_stream.bank)
+			continue;
+
+		if(slot == ROM_STREAM_CHUNKS
+				|| rom_stream.used[i] < rom_stream.used[slot])
+			slot = i;
+	}
+
+	start = time_us_64();
+	dst = rom_stream_chunks[slot];
+	fr = f_lseek(&rom_stream.fil, (FSIZE_t)chunk * ROM_STREAM_CHUNK_SIZE);
+	if(fr == FR_OK)
+		fr = f_read(&rom_stream.fil, dst, ROM_STREAM_CHUNK_SIZE, &br);
+	if(fr != FR_OK)
+		printf("E ROM chunk %u read error: %s (%d)\n", (unsigned)chunk,
+			FRESULT_str(fr), fr);
+
+	/* Reads beyond the end of the ROM return open bus. */
+	memset(dst + br, 0xFF, ROM_STREAM_CHUNK_SIZE - br);
+
+	rom_stream.chunk[slot] = chunk;
+	rom_stream.used[slot] = ++rom_stream.clock;
+	us = time_us_64() - start;
+	rom_stream.faults++;
+	rom_stream.fault_us += us;
+	if(us > rom_stream.fault_max_us)
+		rom_stream.fault_max_us = us;
+
+	return slot;
+}
+#endif
+
 /**
  * Returns a byte from the ROM file at the given address.
  */
 uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
 {
-	(void) gb;
 	if(addr < sizeof(rom_bank0))
 		return rom_bank0[addr];
 
+#if ENABLE_SDCARD && ENABLE_ROM_STREAMING
+	if(addr >= ROM_FLASH_SIZE && rom_stream.open)
+	{
+		const uint_fast16_t chunk = addr / ROM_STREAM_CHUNK_SIZE;
+		const uint8_t *src = rom_stream_chunks[rom_stream_slot(chunk)];
+
+		/* Further reads of the selected bank then skip this function. */
+		if(chunk / ROM_STREAM_BANK_CHUNKS == rom_stream.bank)
+			gb_set_rom_page(gb, chunk % ROM_STREAM_BANK_CHUNKS, src);
+
+		return src[addr % ROM_STREAM_CHUNK_SIZE];
+	}
+#else
+	(void) gb;
+#endif
+
 	return rom[addr];
 }
 
+/**
+ * Returns a pointer to the given 16 KiB ROM bank. Bank 0 is read from SRAM,
+ * all others directly from flash. Banks beyond the flash are streamed: NULL is
+ * returned, and gb_rom_read() maps each chunk when it is first read.
+ */
+const uint8_t *gb_rom_bank_ptr(struct gb_s *gb, const uint_fast16_t bank)
+{
+	const uint_fast32_t offset = (uint_fast32_t)bank * ROM_BANK_SIZE;
+
+	(void) gb;
+	if(offset < sizeof(rom_bank0))
+		return rom_bank0;
+
+#if ENABLE_SDCARD && ENABLE_ROM_STREAMING
+	if(rom_stream.open)
+	{
+		if(offset >= ROM_FLASH_SIZE)
+		{
+			if(rom_stream.bank != bank)
+				rom_stream.switches++;
+			rom_stream.bank = bank;
+			return NULL;
+		}
+
+		rom_stream.bank = 0xFFFF;
+	}
+#endif
+
+	return rom + offset;
+}
+
 /**
  * Returns a byte from the cartridge RAM at the given address.
  */
@@ -200,7 +905,13 @@ uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
 void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
 		       const uint8_t val)
 {
+	if(ram[addr] == val)
+		return;
+
 	ram[addr] = val;
+	ram_dirty[addr / (SAVE_BLOCK_SIZE * 32)] |=
+		1u << ((addr / SAVE_BLOCK_SIZE) % 32);
+	ram_written = true;
 }
 
 /**
@@ -221,342 +932,2910 @@ void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr
 }
 
 #if ENABLE_LCD 
-void core1_lcd_draw_line(const uint_fast8_t line)
-{
-	static uint16_t fb[LCD_WIDTH];
+/* Line expected next while GRAM writes are held open for a frame, or
+ * LCD_HEIGHT if no GRAM write is open. Only used by core 1. */
+static uint_fast8_t lcd_stream_line = LCD_HEIGHT;
+/* Set once the ROM selector has initialised the LCD, so that core 1 does not
+ * initialise it again. */
+static bool lcd_initialised = false;
 
-	for(unsigned int x = 0; x < LCD_WIDTH; x++)
-	{
-		fb[x] = palette[(pixels_buffer[x] & LCD_PALETTE_ALL) >> 4]
-				[pixels_buffer[x] & 3];
-	}
+#if LCD_SKIP_UNCHANGED_LINES
+/* Hash of the pixels last sent for each line, and whether it is valid. Only
+ * used by core 1, so kept in scratch X beside its stack. */
+static uint32_t __scratch_x("lcd") lcd_line_hash[LCD_HEIGHT];
+static bool __scratch_x("lcd") lcd_line_sent[LCD_HEIGHT];
 
-	mk_ili9225_set_x(line + 16);
-	mk_ili9225_write_pixels(fb, LCD_WIDTH);
-	__atomic_store_n(&lcd_line_busy, 0, __ATOMIC_SEQ_CST);
-}
+/* Number of unchanged lines that were not sent. */
+static uint32_t lcd_lines_skipped = 0;
+#endif
 
-_Noreturn
-void main_core1(void)
+/**
+ * Close the GRAM write opened by core1_lcd_draw_line(). Must be called before
+ * any other command is sent to the LCD.
+ */
+static void lcd_stream_end(void)
 {
-	union core_cmd cmd;
-
-	/* Initialise and control LCD on core 1. */
-	mk_ili9225_init();
-
-	/* Clear LCD screen. */
-	mk_ili9225_fill(0x0000);
+	if(lcd_stream_line == LCD_HEIGHT)
+		return;
 
-	/* Set LCD window to DMG size. */
-	mk_ili9225_fill_rect(31,16,LCD_WIDTH,LCD_HEIGHT,0x0000);
+#if USE_DMA
+	lcd_dma_wait();
+	lcd_spi_flush();
+#endif
+	mk_ili9225_write_pixels_end();
+	lcd_stream_line = LCD_HEIGHT;
+}
 
-	// Sleep used for debugging LCD window.
-	//sleep_ms(1000);
+#if LCD_VSYNC && MK_ILI9225_READ_AVAILABLE && !LCD_SCALE
+/**
+ * Wait until the LCD is not scanning the DMG screen. A frame written from
+ * then on stays ahead of the scan as long as lines are written faster than the
+ * LCD scans them.
+ */
+static void lcd_wait_for_scan(void)
+{
+	unsigned scan;
 
-	/* Handle commands coming from core0. */
-	while(1)
+	while((scan = mk_ili9225_read_driving_line()) >= LCD_OFFSET_Y &&
+			scan < LCD_OFFSET_Y + LCD_HEIGHT)
 	{
-		cmd.full = multicore_fifo_pop_blocking();
-		switch(cmd.cmd)
-		{
-		case CORE_CMD_LCD_LINE:
-			core1_lcd_draw_line(cmd.data);
-			break;
+		best_effort_wfe_or_timeout(make_timeout_time_us(LCD_VSYNC_POLL_US));
+	}
+}
+#endif
 
-		case CORE_CMD_IDLE_SET:
-			mk_ili9225_display_control(true, cmd.data);
-			break;
+/* RGB565 colours of each pair of pixels given to lcd_draw_line(), indexed by
+ * the palette and colour bits of the first pixel in bits 5-4 and 1-0, and of
+ * the second pixel in bits 7-6 and 3-2. The first pixel is in the lower half,
+ * so that a word is stored as two consecutive pixels. */
+static uint32_t palette_pairs[256];
+/* RGB565 colour of each pixel, indexed by bits 5-0. Bits 3-2 are undefined,
+ * and palette 3 is not used. */
+static uint16_t palette_colours[64];
 
-		case CORE_CMD_NOP:
-		default:
-			break;
-		}
-	}
+#if LCD_SCALE
+/* Pixel of the DMG line shown in each column of the screen. */
+static uint8_t lcd_columns[LCD_SCREEN_WIDTH];
 
-	HEDLEY_UNREACHABLE();
+/**
+ * Fill lcd_columns with the nearest pixel to the centre of each column.
+ */
+static void lcd_columns_init(void)
+{
+	for(unsigned int x = 0; x < LCD_SCREEN_WIDTH; x++)
+	{
+		lcd_columns[x] = ((2 * x + 1) * LCD_WIDTH) /
+			(2 * LCD_SCREEN_WIDTH);
+	}
 }
 #endif
 
-#if ENABLE_LCD
-void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[LCD_WIDTH],
-		   const uint_fast8_t line)
+/**
+ * Rebuild palette_colours and palette_pairs from palette. Must be called
+ * after the palette is assigned.
+ */
+static void palette_update(void)
 {
-	union core_cmd cmd;
-
-	/* Wait until previous line is sent. */
-	while(__atomic_load_n(&lcd_line_busy, __ATOMIC_SEQ_CST))
-		tight_loop_contents();
-
-	memcpy(pixels_buffer, pixels, LCD_WIDTH);
-	
-	/* Populate command. */
-	cmd.cmd = CORE_CMD_LCD_LINE;
-	cmd.data = line;
+	for(unsigned int i = 0; i < 64; i++)
+	{
+		palette_colours[i] =
+			palette[MIN((i & LCD_PALETTE_ALL) >> 4, 2)][i & 3];
+	}
 
-	__atomic_store_n(&lcd_line_busy, 1, __ATOMIC_SEQ_CST);
-	multicore_fifo_push_blocking(cmd.full);
+	for(unsigned int i = 0; i < 256; i++)
+	{
+		palette_pairs[i] = palette_colours[i & 0x33] |
+			(uint32_t) palette_colours[(i >> 2) & 0x33] << 16;
+	}
 }
-#endif
 
-#if ENABLE_SDCARD
 /**
- * Load a save file from the SD card
+ * Send a line to the LCD. Consecutive lines are streamed into the GRAM window
+ * without setting the address again, so that a full frame only needs the
+ * address set on its first line.
  */
-void read_cart_ram_file(struct gb_s *gb) {
-	char filename[16];
-	uint_fast32_t save_size;
-	UINT br;
-	
-	gb_get_rom_name(gb,filename);
-	save_size=gb_get_save_size(gb);
-	if(save_size>0) {
-		sd_card_t *pSD=sd_get_by_num(0);
+void core1_lcd_draw_line(const uint8_t pixels[LCD_WIDTH],
+		const uint_fast8_t line)
+{
+#if ENABLE_REPLAY
+	if(__atomic_load_n(&replay.active, __ATOMIC_ACQUIRE))
+	{
+		uint32_t hash = replay.frame_hash;
+
+		for(unsigned int x = 0; x < LCD_WIDTH; x++)
+			hash = (hash ^ (pixels[x] & LCD_COLOUR)) * 16777619u;
+
+		replay.frame_hash = hash;
+	}
+#endif
+
+#if LCD_VSYNC && MK_ILI9225_READ_AVAILABLE && !LCD_SCALE
+	/* Core 0 waits on the full line ring meanwhile. */
+	if(line == 0)
+	{
+		lcd_stream_end();
+		lcd_wait_for_scan();
+	}
+#endif
+
+#if LCD_SKIP_UNCHANGED_LINES
+	/* FNV-1a hash of the palette and colour index of each pixel. */
+	uint32_t hash = 2166136261u;
+
+	for(unsigned int x = 0; x < LCD_WIDTH; x++)
+		hash = (hash ^ pixels[x]) * 16777619u;
+
+	if(lcd_line_sent[line] && lcd_line_hash[line] == hash)
+	{
+		lcd_lines_skipped++;
+		return;
+	}
+
+	lcd_line_hash[line] = hash;
+	lcd_line_sent[line] = true;
+#endif
+
+	union lcd_line_buf {
+		uint16_t pixels[LCD_SCREEN_WIDTH];
+		uint32_t pairs[LCD_SCREEN_WIDTH / 2];
+	};
+#if USE_DMA
+	/* One buffer is converted into while the other is being sent. Both
+	 * are in scratch X, which only core 1 and the LCD DMA use. */
+	static union lcd_line_buf __scratch_x("lcd") fb_buffers[2];
+	static uint_fast8_t fb_sel = 0;
+	union lcd_line_buf *buf = &fb_buffers[fb_sel];
+#else
+	static union lcd_line_buf __scratch_x("lcd") fb_buffer;
+	union lcd_line_buf *buf = &fb_buffer;
+#endif
+	const uint16_t *fb = buf->pixels;
+
+#if LCD_SCALE
+	for(unsigned int x = 0; x < LCD_SCREEN_WIDTH; x++)
+		buf->pixels[x] = palette_colours[pixels[lcd_columns[x]] & 0x3F];
+#else
+	/* Two pixels are converted with each lookup and 32-bit store. */
+	for(unsigned int x = 0; x < LCD_WIDTH; x += 2)
+	{
+		buf->pairs[x / 2] = palette_pairs[(pixels[x] & 0x33) |
+				((pixels[x + 1] & 0x33) << 2)];
+	}
+#endif
+
+	if(line != lcd_stream_line)
+	{
+		/* Waits for the previous line to be sent. */
+		lcd_stream_end();
+
+		/* The window wraps the address to the start of the next line
+		 * after each LCD_SCREEN_WIDTH pixels. */
+		if(line == 0)
+		{
+			mk_ili9225_set_window(LCD_OFFSET_Y,
+				LCD_OFFSET_Y + LCD_SCREEN_HEIGHT - 1,
+				219 - (LCD_OFFSET_X + LCD_SCREEN_WIDTH - 1),
+				219 - LCD_OFFSET_X);
+		}
+
+		mk_ili9225_set_address(LCD_SCREEN_ROW(line) + LCD_OFFSET_Y,
+				219 - LCD_OFFSET_X);
+		mk_ili9225_write_pixels_start();
+	}
+
+	/* Lines shown on two rows of the screen are sent twice. */
+	for(unsigned int row = LCD_SCREEN_ROW(line);
+			row < LCD_SCREEN_ROW(line + 1); row++)
+	{
+#if USE_DMA
+		lcd_dma_write_pixels(fb, LCD_SCREEN_WIDTH);
+#else
+		mk_ili9225_spi_write16(fb, LCD_SCREEN_WIDTH);
+#endif
+	}
+#if USE_DMA
+	fb_sel = !fb_sel;
+#endif
+
+	lcd_stream_line = line + 1;
+	if(lcd_stream_line == LCD_HEIGHT)
+		lcd_stream_end();
+}
+
+#if ENABLE_SOUND && MINIGB_APU_WRITE_LOG
+uint_fast32_t audio_frame_cycles(void)
+{
+	return gb_get_frame_cycles(audio_gb);
+}
+
+/**
+ * Generate the next AUDIO_RENDER_CHUNK samples of audio into the next free I2S
+ * buffer, playing it once the frame is complete.
+ * \return	false if no samples could be generated.
+ */
+static bool core1_audio_step(void)
+{
+	static int16_t *buf = NULL;
+
+	if(buf == NULL)
+	{
+		if(!i2s_dma_buffer_free(core1_i2s))
+			return false;
+
+		buf = i2s_dma_get_buffer(core1_i2s);
+	}
+
+	PROFILE_BEGIN(PROFILE_AUDIO);
+	const enum audio_render_e rendered =
+		audio_render(buf, AUDIO_RENDER_CHUNK);
+	PROFILE_END(PROFILE_AUDIO);
+
+	switch(rendered)
+	{
+	case AUDIO_RENDER_IDLE:
+		return false;
+
+	case AUDIO_RENDER_FRAME:
+		i2s_dma_commit(core1_i2s);
+		buf = NULL;
+		break;
+
+	case AUDIO_RENDER_BUSY:
+	case AUDIO_RENDER_FRAME_MUTED:
+		/* A muted frame's buffer is reused for the next frame. */
+		break;
+	}
+
+	return true;
+}
+#endif
+
+_Noreturn
+void main_core1(void)
+{
+	union core_cmd cmd;
+
+#if USE_DMA
+	/* LCD DMA interrupt is handled on core 1. */
+	lcd_dma_init();
+#endif
+
+	/* Initialise and control LCD on core 1. */
+	if(!lcd_initialised)
+		mk_ili9225_init();
+
+	/* Clear LCD screen. */
+	mk_ili9225_fill(0x0000);
+
+	/* Set LCD window to DMG size. */
+	mk_ili9225_fill_rect(LCD_OFFSET_X,LCD_OFFSET_Y,LCD_SCREEN_WIDTH,
+			LCD_SCREEN_HEIGHT,0x0000);
+	lcd_stream_line = LCD_HEIGHT;
+#if LCD_SCALE
+	lcd_columns_init();
+#endif
+#if LCD_SKIP_UNCHANGED_LINES
+	memset(lcd_line_sent, 0, sizeof(lcd_line_sent));
+#endif
+
+	// Sleep used for debugging LCD window.
+	//sleep_ms(1000);
+
+	/* Handle lines and commands coming from core0. */
+	while(1)
+	{
+		const uint32_t tail = lcd_ring_tail;
+		struct lcd_line_slot *slot;
+
+		if(!multicore_fifo_rvalid())
+		{
+			if(tail == __atomic_load_n(&lcd_ring_head, __ATOMIC_ACQUIRE))
+			{
+#if ENABLE_SOUND && MINIGB_APU_WRITE_LOG
+				/* Generate audio while no lines are queued. */
+				if(core1_audio_step())
+					continue;
+#endif
+				/* Sleep until core 0 queues a line or a command. */
+				__wfe();
+				continue;
+			}
+
+			slot = &lcd_ring[tail % LCD_LINE_RING_DEPTH];
+#if PEANUT_GB_SPLIT_RENDER
+			/* Calls lcd_draw_line() on this core. */
+			PROFILE_BEGIN(PROFILE_DRAW_LINE);
+			gb_render_line(core1_gb, &slot->regs);
+			PROFILE_END(PROFILE_DRAW_LINE);
+#else
+			PROFILE_BEGIN(PROFILE_LCD_SPI);
+			core1_lcd_draw_line(slot->pixels, slot->line);
+			PROFILE_END(PROFILE_LCD_SPI);
+#endif
+			__atomic_store_n(&lcd_ring_tail, tail + 1, __ATOMIC_RELEASE);
+			__sev();
+			continue;
+		}
+
+		cmd.full = multicore_fifo_pop_blocking();
+		switch(cmd.cmd)
+		{
+		case CORE_CMD_IDLE_SET:
+			lcd_stream_end();
+			mk_ili9225_display_control(true, cmd.data);
+			break;
+
+		case CORE_CMD_LCD_INVALIDATE:
+#if LCD_SKIP_UNCHANGED_LINES
+			memset(lcd_line_sent, 0, sizeof(lcd_line_sent));
+#endif
+			break;
+
+		case CORE_CMD_NOP:
+		default:
+			break;
+		}
+	}
+
+	HEDLEY_UNREACHABLE();
+}
+#endif
+
+#if ENABLE_LCD
+/**
+ * Returns the next free slot of the LCD line ring, waiting for core 1 to send
+ * a line if the ring is full.
+ */
+static struct lcd_line_slot *lcd_ring_acquire(void)
+{
+	const uint32_t head = lcd_ring_head;
+
+	if(head - __atomic_load_n(&lcd_ring_tail, __ATOMIC_ACQUIRE) ==
+			LCD_LINE_RING_DEPTH)
+	{
+		const uint64_t start = time_us_64();
+
+		lcd_ring_stalls++;
+		PROFILE_BEGIN(PROFILE_LCD_WAIT);
+		while(head - __atomic_load_n(&lcd_ring_tail, __ATOMIC_ACQUIRE) ==
+				LCD_LINE_RING_DEPTH)
+			__wfe();
+		PROFILE_END(PROFILE_LCD_WAIT);
+
+		lcd_ring_stall_us += time_us_64() - start;
+	}
+
+	return &lcd_ring[head % LCD_LINE_RING_DEPTH];
+}
+
+/**
+ * Passes the slot returned by lcd_ring_acquire() to core 1.
+ */
+static void lcd_ring_commit(void)
+{
+	__atomic_store_n(&lcd_ring_head, lcd_ring_head + 1, __ATOMIC_RELEASE);
+	__sev();
+}
+
+/**
+ * Make core 1 send all following lines to the LCD. Must be called after
+ * changing the palette.
+ */
+static void lcd_invalidate(void)
+{
+	union core_cmd cmd;
+
+	cmd.cmd = CORE_CMD_LCD_INVALIDATE;
+	cmd.data = 0;
+	multicore_fifo_push_blocking(cmd.full);
+}
+#endif
+
+#if ENABLE_LCD && PEANUT_GB_SPLIT_RENDER
+/**
+ * Called by gb_render_line() on core 1.
+ */
+void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[LCD_WIDTH],
+		   const uint_fast8_t line)
+{
+	(void) gb;
+	PROFILE_BEGIN(PROFILE_LCD_SPI);
+	core1_lcd_draw_line(pixels, line);
+	PROFILE_END(PROFILE_LCD_SPI);
+}
+
+/**
+ * Queue line registers captured on core 0 to be rendered on core 1.
+ * \return	The ticket of the line, the ring index following it.
+ */
+uint32_t lcd_queue_line(struct gb_s *gb, const struct gb_line_s *line)
+{
+	(void) gb;
+	lcd_ring_acquire()->regs = *line;
+	lcd_ring_commit();
+	return lcd_ring_head;
+}
+
+/**
+ * Wait until core 1 has rendered the line with the given ticket, as it reads
+ * VRAM and an OAM snapshot while rendering.
+ */
+void lcd_wait_line(struct gb_s *gb, uint32_t ticket)
+{
+	uint64_t start;
+
+	(void) gb;
+
+	if((int32_t)(ticket - __atomic_load_n(&lcd_ring_tail,
+			__ATOMIC_ACQUIRE)) <= 0)
+		return;
+
+	lcd_ring_drains++;
+	start = time_us_64();
+	PROFILE_BEGIN(PROFILE_LCD_WAIT);
+	while((int32_t)(ticket - __atomic_load_n(&lcd_ring_tail,
+			__ATOMIC_ACQUIRE)) > 0)
+		__wfe();
+	PROFILE_END(PROFILE_LCD_WAIT);
+	lcd_ring_drain_us += time_us_64() - start;
+}
+#elif ENABLE_LCD
+void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[LCD_WIDTH],
+		   const uint_fast8_t line)
+{
+	struct lcd_line_slot *slot = lcd_ring_acquire();
+
+	(void) gb;
+	memcpy(slot->pixels, pixels, LCD_WIDTH);
+	slot->line = line;
+	lcd_ring_commit();
+}
+#endif
+
+#if ENABLE_SDCARD
+/* Buffer for large transfers with the SD card. Also holds a save state while
+ * it is written, which is the size of the emulator context, the APU state and
+ * up to 32 KiB of cart RAM, and a rewind snapshot with its delta while they are
+ * encoded. */
+#define SD_BUFFER_SIZE		(32 * 1024)
+#if ENABLE_SAVE_STATES || ENABLE_REWIND
+#define STATE_BUFFER_SIZE	(52 * 1024)
+static uint8_t sd_buffer[STATE_BUFFER_SIZE];
+#else
+static uint8_t sd_buffer[SD_BUFFER_SIZE];
+#endif
+
+/**
+ * Mount the SD card, once per session.
+ * \return	The mounted SD card, or NULL on error.
+ */
+static sd_card_t *sd_mount(void)
+{
+	sd_card_t *pSD=sd_get_by_num(0);
+
+	if(!pSD->mounted) {
 		FRESULT fr=f_mount(&pSD->fatfs,pSD->pcName,1);
 		if (FR_OK!=fr) {
 			printf("E f_mount error: %s (%d)\n",FRESULT_str(fr),fr);
+			return NULL;
+		}
+		pSD->mounted=true;
+	}
+	return pSD;
+}
+
+/* Number of entries of the cluster link map of the save file. A contiguous
+ * file needs 4, each further fragment 2 more. */
+#define SAVE_CLMT_SIZE	16
+
+/* The save file of the game being played. It is kept open while the game is
+ * played, and its size is allocated when it is opened, so that dirty blocks
+ * of cart RAM can be written to it in place. */
+static struct {
+	FIL fil;
+	bool open;
+	/* Written to since the directory entry was updated. */
+	bool unsynced;
+	uint32_t size;
+	uint32_t idle_frames;
+	DWORD clmt[SAVE_CLMT_SIZE];
+} save_file;
+
+static void ram_dirty_set(uint32_t first, uint32_t end)
+{
+	for(uint32_t blk=first;blk<end;blk++)
+		ram_dirty[blk/32] |= 1u << (blk%32);
+}
+
+/**
+ * Load a save file from the SD card, and keep it open for the autosave.
+ * A new save file is allocated in one contiguous run of clusters.
+ */
+void read_cart_ram_file(struct gb_s *gb) {
+	char filename[16];
+	uint_fast32_t save_size;
+	UINT br=0;
+	
+	memset(ram_dirty,0,sizeof(ram_dirty));
+	ram_written=false;
+	save_file.idle_frames=0;
+
+	gb_get_rom_name(gb,filename);
+	save_size=MIN(gb_get_save_size(gb),sizeof(ram));
+	if(save_size>0) {
+		FRESULT fr;
+		FSIZE_t size;
+		if(!sd_mount())
+			return;
+
+		FIL *fil=&save_file.fil;
+		fr=f_open(fil,filename,FA_READ | FA_WRITE | FA_OPEN_ALWAYS);
+		if (fr!=FR_OK) {
+			printf("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+			return;
+		}
+
+		size=f_size(fil);
+		if(size==0) {
+			fr=f_expand(fil,save_size,1);
+			if(fr!=FR_OK) {
+				printf("W f_expand(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+			}
+		} else {
+			f_read(fil,ram,MIN(size,save_size),&br);
+		}
+		if(f_size(fil)<save_size) {
+			/* extend the file, if it could not be allocated */
+			fr=f_lseek(fil,save_size);
+			if(fr!=FR_OK || f_size(fil)<save_size) {
+				printf("E f_lseek(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+				f_close(fil);
+				return;
+			}
+		}
+		if(size<save_size) {
+			/* the new part of the file is written by the autosave */
+			ram_dirty_set(size/SAVE_BLOCK_SIZE,
+				(save_size+SAVE_BLOCK_SIZE-1)/SAVE_BLOCK_SIZE);
+		}
+
+		/* Seek with the cluster link map, without following the FAT. */
+		save_file.clmt[0]=SAVE_CLMT_SIZE;
+		fil->cltbl=save_file.clmt;
+		fr=f_lseek(fil,CREATE_LINKMAP);
+		if(fr!=FR_OK) {
+			printf("W %s is fragmented, fast seek disabled\n",filename);
+			fil->cltbl=NULL;
+		}
+
+		save_file.size=save_size;
+		save_file.unsynced=(size<save_size);
+		save_file.open=true;
+	}
+	printf("I read_cart_ram_file(%s) COMPLETE (%lu bytes)\n",filename,save_size);
+}
+
+/**
+ * Write up to "max_blocks" dirty blocks of cart RAM to the save file. The
+ * directory entry is updated once no dirty blocks are left.
+ */
+static void save_file_flush(uint32_t max_blocks)
+{
+	const uint32_t blocks=(save_file.size+SAVE_BLOCK_SIZE-1)/SAVE_BLOCK_SIZE;
+
+	if(!save_file.open)
+		return;
+
+	for(uint32_t w=0;w<count_of(ram_dirty) && w*32<blocks;w++) {
+		while(ram_dirty[w]!=0) {
+			const uint32_t blk=w*32+__builtin_ctz(ram_dirty[w]);
+			const uint32_t offset=blk*SAVE_BLOCK_SIZE;
+			UINT bw;
+			FRESULT fr;
+
+			if(blk>=blocks || max_blocks==0)
+				break;
+
+			ram_dirty[w] &= ~(1u << (blk%32));
+			fr=f_lseek(&save_file.fil,offset);
+			if(fr==FR_OK)
+				fr=f_write(&save_file.fil,ram+offset,
+					MIN(SAVE_BLOCK_SIZE,save_file.size-offset),&bw);
+			if(fr!=FR_OK) {
+				printf("E save file error: %s (%d)\n",FRESULT_str(fr),fr);
+				ram_dirty[w] |= 1u << (blk%32);
+				f_close(&save_file.fil);
+				save_file.open=false;
+				return;
+			}
+			save_file.unsynced=true;
+			max_blocks--;
+		}
+		if(max_blocks==0)
 			return;
+	}
+
+	if(save_file.unsynced) {
+		f_sync(&save_file.fil);
+		save_file.unsynced=false;
+	}
+}
+
+#if ENABLE_AUTOSAVE
+/**
+ * Called once per frame, when there is time left in the frame. Saves dirty
+ * blocks once the game has stopped writing to cart RAM.
+ */
+static void autosave_frame(void)
+{
+	if(ram_written) {
+		ram_written=false;
+		save_file.idle_frames=0;
+		return;
+	}
+	if(save_file.idle_frames<AUTOSAVE_IDLE_FRAMES) {
+		save_file.idle_frames++;
+		return;
+	}
+	save_file_flush(AUTOSAVE_BLOCKS_PER_FRAME);
+}
+#endif
+
+/**
+ * Write the dirty blocks of cart RAM to the save file and close it
+ */
+void write_cart_ram_file(struct gb_s *gb) {
+	char filename[16];
+
+	if(!save_file.open)
+		return;
+
+	gb_get_rom_name(gb,filename);
+	save_file_flush(UINT32_MAX);
+	if(save_file.open) {
+		FRESULT fr=f_close(&save_file.fil);
+		if(fr!=FR_OK) {
+			printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
 		}
+		save_file.open=false;
+	}
+	printf("I write_cart_ram_file(%s) COMPLETE (%lu bytes)\n",filename,save_file.size);
+}
+
+#if ENABLE_SAVE_STATES
+#define STATE_MAGIC	0x54534750	/* "PGST" */
+#define STATE_VERSION	1
+
+/**
+ * Header of a save state file, followed by the state of the emulator context,
+ * the state of the APU and cart RAM.
+ */
+struct state_header {
+	uint32_t magic;
+	uint16_t version;
+	/* Incremented with each save state of a game, to find the newest. */
+	uint16_t sequence;
+	uint32_t gb_size;
+	uint32_t audio_size;
+	uint32_t ram_size;
+};
+
+/* Save state being written to the SD card from sd_buffer. */
+static struct {
+	bool pending;
+	bool open;
+	FIL fil;
+	uint32_t size;
+	uint32_t written;
+	char filename[32];
+} state_write;
+
+static uint8_t state_slot;
+static uint16_t state_sequence;
+
+static void state_filename(struct gb_s *gb, char *filename, size_t len,
+		uint8_t slot)
+{
+	char rom_name[16];
+
+	gb_get_rom_name(gb,rom_name);
+	snprintf(filename,len,"%s.ss%u",rom_name,slot);
+}
+
+/**
+ * Write the next chunk of the pending save state. The state of the APU may
+ * still be being copied on core 1, in which case nothing is written.
+ */
+static void state_write_step(void)
+{
+	UINT bw;
+	FRESULT fr;
+	uint32_t len;
+
+	if(!state_write.pending || audio_state_pending())
+		return;
+
+	if(!state_write.open) {
+		fr=f_open(&state_write.fil,state_write.filename,
+			FA_CREATE_ALWAYS | FA_WRITE);
+		if(fr!=FR_OK) {
+			printf("E f_open(%s) error: %s (%d)\n",state_write.filename,
+				FRESULT_str(fr),fr);
+			state_write.pending=false;
+			return;
+		}
+		state_write.open=true;
+	}
+
+	len=MIN(STATE_WRITE_CHUNK,state_write.size-state_write.written);
+	fr=f_write(&state_write.fil,sd_buffer+state_write.written,len,&bw);
+	if(fr!=FR_OK || bw!=len) {
+		printf("E save state write error: %s (%d)\n",FRESULT_str(fr),fr);
+		f_close(&state_write.fil);
+		state_write.open=false;
+		state_write.pending=false;
+		return;
+	}
+	state_write.written+=len;
+	if(state_write.written<state_write.size)
+		return;
+
+	fr=f_close(&state_write.fil);
+	if(fr!=FR_OK) {
+		printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+	}
+	state_write.open=false;
+	state_write.pending=false;
+	printf("I %s written (%lu bytes)\n",state_write.filename,state_write.size);
+}
+
+/**
+ * Finish writing the pending save state, so that sd_buffer may be reused.
+ */
+static void state_write_finish(void)
+{
+	while(state_write.pending)
+		state_write_step();
+}
+
+/**
+ * Copy the state of the emulator to sd_buffer, to be written to the file of
+ * slot "slot" by state_write_step().
+ */
+static void state_save(struct gb_s *gb, uint8_t slot)
+{
+	const uint64_t start_time=time_us_64();
+	struct state_header *hdr=(struct state_header *)sd_buffer;
+	uint8_t *p=sd_buffer+sizeof(*hdr);
+
+	if(state_write.pending) {
+		printf("W save state not saved, the previous one is being written\n");
+		return;
+	}
+	if(!sd_mount())
+		return;
+
+	hdr->magic=STATE_MAGIC;
+	hdr->version=STATE_VERSION;
+	hdr->sequence=state_sequence+1;
+	hdr->gb_size=gb_state_size(gb);
+	hdr->audio_size=audio_state_size();
+	hdr->ram_size=MIN(gb_get_save_size(gb),sizeof(ram));
+	if(sizeof(*hdr)+hdr->gb_size+hdr->audio_size+hdr->ram_size
+			>STATE_BUFFER_SIZE) {
+		printf("E save state too large\n");
+		return;
+	}
+
+	gb_state_save(gb,p,hdr->gb_size);
+	p+=hdr->gb_size;
+	/* copied on core 1 when audio is generated from the write log */
+	audio_state_save(p);
+	p+=hdr->audio_size;
+	memcpy(p,ram,hdr->ram_size);
+	p+=hdr->ram_size;
+
+	state_filename(gb,state_write.filename,sizeof(state_write.filename),slot);
+	state_write.size=p-sd_buffer;
+	state_write.written=0;
+	state_write.pending=true;
+	state_sequence++;
+	printf("I save state %u copied in %lu us\n",slot,
+		(uint32_t)(time_us_64()-start_time));
+}
+
+/**
+ * Load the state of slot "slot" from the SD card.
+ * \return	Whether the state was loaded.
+ */
+static bool state_load(struct gb_s *gb, uint8_t slot)
+{
+	const uint64_t start_time=time_us_64();
+	const struct state_header *hdr=(const struct state_header *)sd_buffer;
+	const uint8_t *p=sd_buffer+sizeof(*hdr);
+	char filename[32];
+	enum gb_state_error_e err;
+	FIL fil;
+	FRESULT fr;
+	UINT br;
+
+	if(!sd_mount())
+		return false;
+	state_write_finish();
+
+	state_filename(gb,filename,sizeof(filename),slot);
+	fr=f_open(&fil,filename,FA_READ);
+	if(fr!=FR_OK) {
+		printf("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+		return false;
+	}
+	fr=f_read(&fil,sd_buffer,STATE_BUFFER_SIZE,&br);
+	f_close(&fil);
+	if(fr!=FR_OK) {
+		printf("E f_read(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+		return false;
+	}
+
+	if(br<sizeof(*hdr) || hdr->magic!=STATE_MAGIC
+			|| hdr->version!=STATE_VERSION
+			|| hdr->audio_size!=audio_state_size()
+			|| hdr->ram_size!=MIN(gb_get_save_size(gb),sizeof(ram))
+			|| br<sizeof(*hdr)+hdr->gb_size+hdr->audio_size+hdr->ram_size) {
+		printf("E %s is not a save state of this game\n",filename);
+		return false;
+	}
+	err=gb_state_load(gb,p,hdr->gb_size);
+	if(err!=GB_STATE_NO_ERROR) {
+		printf("E %s could not be loaded (%d)\n",filename,err);
+		return false;
+	}
+	p+=hdr->gb_size;
+	audio_state_load(p);
+	p+=hdr->audio_size;
+	memcpy(ram,p,hdr->ram_size);
+
+	/* the restored cart RAM is saved by the autosave */
+	ram_dirty_set(0,(hdr->ram_size+SAVE_BLOCK_SIZE-1)/SAVE_BLOCK_SIZE);
+	ram_written=true;
+	printf("I save state %u loaded in %lu us\n",slot,
+		(uint32_t)(time_us_64()-start_time));
+	return true;
+}
+
+/**
+ * Select the slot of the newest save state of the game, or slot 0.
+ * \return	Whether the game has a save state.
+ */
+static bool state_scan(struct gb_s *gb)
+{
+	struct state_header hdr;
+	char filename[32];
+	bool found=false;
+	FIL fil;
+	UINT br;
+
+	state_slot=0;
+	state_sequence=0;
+	if(!sd_mount())
+		return false;
+
+	for(uint8_t slot=0;slot<STATE_SLOTS;slot++) {
+		state_filename(gb,filename,sizeof(filename),slot);
+		if(f_open(&fil,filename,FA_READ)!=FR_OK)
+			continue;
+		if(f_read(&fil,&hdr,sizeof(hdr),&br)==FR_OK && br==sizeof(hdr)
+				&& hdr.magic==STATE_MAGIC && hdr.version==STATE_VERSION
+				&& (!found || (int16_t)(hdr.sequence-state_sequence)>0)) {
+			state_slot=slot;
+			state_sequence=hdr.sequence;
+			found=true;
+		}
+		f_close(&fil);
+	}
+
+	if(found)
+		printf("I save state slot %u\n",state_slot);
+	return found;
+}
+#endif
+
+#if ENABLE_REWIND
+/* Largest emulator context snapshot. */
+#define REWIND_STATE_SIZE	(17 * 1024)
+
+/* The last snapshot is kept in full. Each snapshot before it is stored in the
+ * ring as its XOR with the snapshot after it, run length encoded:
+ * 0x00-0x3F	1 to 64 unchanged bytes
+ * 0x40-0x7F	followed by a byte, 1 to 16384 unchanged bytes
+ * 0x80-0xFF	followed by 1 to 128 changed bytes, XORed
+ * Each entry is its length, the encoded delta and its length again, so that
+ * the newest entry can be popped and the oldest dropped. */
+static struct {
+	uint8_t state[REWIND_STATE_SIZE];
+	/* Size of "state", or 0 if there is no snapshot. */
+	uint32_t state_size;
+	/* Frames emulated since "state" was taken or rewound to. */
+	uint32_t frames;
+	uint8_t ring[REWIND_BUFFER_SIZE];
+	uint32_t head;
+	uint32_t tail;
+	uint32_t used;
+	uint32_t count;
+	/* Capture statistics. */
+	uint32_t captures;
+	uint32_t capture_us;
+	uint32_t capture_max_us;
+} rewind_history;
+
+static void rewind_reset(void)
+{
+	rewind_history.state_size=0;
+	rewind_history.frames=0;
+	rewind_history.head=rewind_history.tail=rewind_history.used=0;
+	rewind_history.count=0;
+}
+
+static inline uint32_t rewind_wrap(uint32_t pos)
+{
+	return pos>=REWIND_BUFFER_SIZE ? pos-REWIND_BUFFER_SIZE : pos;
+}
+
+static uint32_t rewind_ring_len(uint32_t pos)
+{
+	return rewind_history.ring[pos] | (rewind_history.ring[rewind_wrap(pos+1)] << 8);
+}
+
+static void rewind_ring_put(const uint8_t *src, uint32_t len)
+{
+	const uint32_t first=MIN(len,REWIND_BUFFER_SIZE-rewind_history.head);
+
+	memcpy(rewind_history.ring+rewind_history.head,src,first);
+	memcpy(rewind_history.ring,src+first,len-first);
+	rewind_history.head=rewind_wrap(rewind_history.head+len);
+	rewind_history.used+=len;
+}
+
+static void rewind_drop_oldest(void)
+{
+	const uint32_t len=rewind_ring_len(rewind_history.tail)+4;
+
+	rewind_history.tail=rewind_wrap(rewind_history.tail+len);
+	rewind_history.used-=len;
+	rewind_history.count--;
+}
+
+/**
+ * Encode "cur" XOR "prev" into "out". Returns the encoded length, which is at
+ * most n + n / 128 + 1 bytes.
+ */
+static uint32_t rewind_encode(const uint8_t *cur, const uint8_t *prev,
+		uint32_t n, uint8_t *out)
+{
+	uint32_t i=0;
+	uint32_t len=0;
+
+	while(i<n) {
+		uint32_t run=0;
+
+		while(i+run<n && run<16384 && cur[i+run]==prev[i+run])
+			run++;
+		if(run>64) {
+			out[len++]=0x40 | ((run-1)>>8);
+			out[len++]=(run-1) & 0xFF;
+		} else if(run>0) {
+			out[len++]=run-1;
+		}
+		i+=run;
+
+		run=0;
+		while(i+run<n && run<128 && cur[i+run]!=prev[i+run])
+			run++;
+		if(run>0) {
+			out[len++]=0x80 | (run-1);
+			for(uint32_t k=0;k<run;k++)
+				out[len++]=cur[i+k] ^ prev[i+k];
+			i+=run;
+		}
+	}
+	return len;
+}
+
+/**
+ * Pop the newest delta from the ring, and apply it to the kept snapshot.
+ */
+static void rewind_pop(void)
+{
+	const uint32_t len=rewind_ring_len(rewind_wrap(rewind_history.head+
+		REWIND_BUFFER_SIZE-2));
+	const uint32_t start=rewind_wrap(rewind_history.head+REWIND_BUFFER_SIZE-2-len);
+	uint32_t pos=start;
+	uint32_t i=0;
+
+	while(pos!=rewind_wrap(start+len)) {
+		const uint8_t t=rewind_history.ring[pos];
+		pos=rewind_wrap(pos+1);
+		if(t<0x40) {
+			i+=t+1;
+		} else if(t<0x80) {
+			i+=(((t & 0x3F) << 8) | rewind_history.ring[pos])+1;
+			pos=rewind_wrap(pos+1);
+		} else {
+			for(uint32_t k=0;k<=(t & 0x7F);k++) {
+				rewind_history.state[i++]^=rewind_history.ring[pos];
+				pos=rewind_wrap(pos+1);
+			}
+		}
+	}
+
+	rewind_history.head=rewind_wrap(rewind_history.head+REWIND_BUFFER_SIZE-len-4);
+	rewind_history.used-=len+4;
+	rewind_history.count--;
+}
+
+/**
+ * Take a snapshot, and store the difference with the previous one. The
+ * snapshot and the delta are encoded in sd_buffer, which is skipped while a
+ * save state is being written from it.
+ */
+static void rewind_capture(struct gb_s *gb)
+{
+	const uint64_t start_time=time_us_64();
+	uint8_t *cur=sd_buffer;
+	uint8_t *delta=sd_buffer+REWIND_STATE_SIZE;
+	uint32_t size;
+	uint32_t us;
+
+#if ENABLE_SAVE_STATES
+	if(state_write.pending)
+		return;
+#endif
+	size=gb_state_save(gb,cur,REWIND_STATE_SIZE);
+	if(size==0)
+		return;
+
+	if(rewind_history.state_size==size) {
+		const uint32_t len=rewind_encode(cur,rewind_history.state,size,delta);
+		const uint8_t len_bytes[2]={len & 0xFF, len >> 8};
+
+		if(len+4>REWIND_BUFFER_SIZE) {
+			/* too large to keep, start a new history */
+			rewind_reset();
+		} else {
+			while(REWIND_BUFFER_SIZE-rewind_history.used<len+4)
+				rewind_drop_oldest();
+			rewind_ring_put(len_bytes,2);
+			rewind_ring_put(delta,len);
+			rewind_ring_put(len_bytes,2);
+			rewind_history.count++;
+		}
+	}
+	memcpy(rewind_history.state,cur,size);
+	rewind_history.state_size=size;
+	rewind_history.frames=0;
+
+	us=time_us_64()-start_time;
+	rewind_history.captures++;
+	rewind_history.capture_us+=us;
+	if(us>rewind_history.capture_max_us)
+		rewind_history.capture_max_us=us;
+}
+
+/**
+ * Called at the end of each frame that is not rewound.
+ */
+static void rewind_frame_end(struct gb_s *gb)
+{
+	if(++rewind_history.frames>=REWIND_INTERVAL)
+		rewind_capture(gb);
+}
+
+/**
+ * Go back to the previous snapshot, or to the last one if frames have been
+ * emulated since. Stays at the oldest snapshot once the history runs out.
+ */
+static void rewind_step(struct gb_s *gb)
+{
+	if(rewind_history.state_size==0)
+		return;
+
+	if(rewind_history.frames==0 && rewind_history.count>0)
+		rewind_pop();
+	gb_state_load(gb,rewind_history.state,rewind_history.state_size);
+	rewind_history.frames=0;
+}
+#endif
+
+#define ROM_HEADER_MAGIC	0x4D4F5247	/* "GROM" */
+
+/**
+ * Header of the ROM resident in flash. Written once the ROM has been
+ * programmed and verified, and erased before programming starts.
+ */
+struct rom_header {
+	uint32_t magic;
+	/* Size, and modification date and time, of the file on the SD card. */
+	uint32_t size;
+	WORD fdate;
+	WORD ftime;
+	/* CRC-32 of the ROM as programmed. */
+	uint32_t crc;
+	char filename[FF_LFN_BUF + 1];
+};
+
+static const struct rom_header *rom_header =
+	(const struct rom_header *) (XIP_BASE + FLASH_HEADER_OFFSET);
+
+/* DMA channel calculating a CRC-32 in the background, or -1. */
+static int rom_crc32_chan = -1;
+
+/**
+ * Start continuing the CRC-32 "crc" over "len" bytes at "data", which may be
+ * in RAM or flash. Calculated by the DMA sniffer in the background, until
+ * rom_crc32_finish() is called.
+ */
+static void rom_crc32_start(uint32_t crc, const void *data, size_t len)
+{
+	static uint8_t sink;
+	dma_channel_config c;
+
+	rom_crc32_chan = dma_claim_unused_channel(true);
+	c = dma_channel_get_default_config(rom_crc32_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_sniff_enable(&c, true);
+
+	dma_sniffer_enable(rom_crc32_chan, DMA_SNIFF_CTRL_CALC_VALUE_CRC32R,
+		true);
+	dma_hw->sniff_data = ~crc;
+	dma_channel_configure(rom_crc32_chan, &c, &sink, data, len, true);
+}
+
+/**
+ * Wait for the CRC-32 started by rom_crc32_start() and return it.
+ */
+static uint32_t rom_crc32_finish(void)
+{
+	uint32_t crc;
+
+	dma_channel_wait_for_finish_blocking(rom_crc32_chan);
+	crc = ~dma_hw->sniff_data;
+
+	dma_sniffer_disable();
+	dma_channel_unclaim(rom_crc32_chan);
+	rom_crc32_chan = -1;
+	return crc;
+}
+
+/**
+ * Continue the CRC-32 "crc" over "len" bytes at "data".
+ */
+static uint32_t rom_crc32(uint32_t crc, const void *data, size_t len)
+{
+	rom_crc32_start(crc, data, len);
+	return rom_crc32_finish();
+}
+
+/**
+ * Erase and program flash with interrupts disabled, as interrupt handlers may
+ * execute from flash.
+ */
+static void rom_flash_erase(uint32_t offset, size_t count)
+{
+	const uint32_t ints = save_and_disable_interrupts();
+	flash_range_erase(offset, count);
+	restore_interrupts(ints);
+}
+
+static void rom_flash_program(uint32_t offset, const uint8_t *data,
+		size_t count)
+{
+	const uint32_t ints = save_and_disable_interrupts();
+	flash_range_program(offset, data, count);
+	restore_interrupts(ints);
+}
+
+/**
+ * Check whether the ROM in flash was programmed from the file "filename"
+ * described by "fno", and is intact.
+ */
+static bool rom_is_resident(const char *filename, const FILINFO *fno)
+{
+	if(rom_header->magic!=ROM_HEADER_MAGIC
+		|| rom_header->size!=fno->fsize
+		|| rom_header->fdate!=fno->fdate
+		|| rom_header->ftime!=fno->ftime
+		|| strncmp(rom_header->filename,filename,
+			sizeof(rom_header->filename))!=0)
+		return false;
+
+	return rom_crc32(0,rom,MIN(rom_header->size,ROM_FLASH_SIZE))
+		==rom_header->crc;
+}
+
+#if ENABLE_ROM_STREAMING
+/**
+ * Open the file of the ROM resident in flash if it is larger than the flash,
+ * to read the banks beyond the flash from it.
+ */
+static void rom_stream_open(void)
+{
+	FRESULT fr;
+
+	memset(rom_stream.chunk,0xFF,sizeof(rom_stream.chunk));
+	memset(rom_stream.used,0,sizeof(rom_stream.used));
+	rom_stream.clock=0;
+	rom_stream.bank=0xFFFF;
+	rom_stream.switches=0;
+	rom_stream.faults=0;
+	rom_stream.fault_us=0;
+	rom_stream.fault_max_us=0;
+
+	if(rom_header->magic!=ROM_HEADER_MAGIC
+		|| rom_header->size<=ROM_FLASH_SIZE
+		|| !sd_mount())
+		return;
+
+	fr=f_open(&rom_stream.fil,rom_header->filename,FA_READ);
+	if(fr!=FR_OK) {
+		printf("E f_open(%s) error: %s (%d)\n",rom_header->filename,
+			FRESULT_str(fr),fr);
+		return;
+	}
+
+	/* Seek with the cluster link map, without following the FAT. */
+	rom_stream.clmt[0]=ROM_STREAM_CLMT_SIZE;
+	rom_stream.fil.cltbl=rom_stream.clmt;
+	fr=f_lseek(&rom_stream.fil,CREATE_LINKMAP);
+	if(fr!=FR_OK) {
+		printf("W %s is fragmented, fast seek disabled\n",
+			rom_header->filename);
+		rom_stream.fil.cltbl=NULL;
+	}
+
+	rom_stream.open=true;
+	printf("I Streaming %lu KiB of %s from the SD card\n",
+		(rom_header->size-ROM_FLASH_SIZE)/1024,rom_header->filename);
+}
+
+static void rom_stream_close(void)
+{
+	if(!rom_stream.open)
+		return;
+
+	f_close(&rom_stream.fil);
+	rom_stream.open=false;
+}
+#endif
+
+/**
+ * Describe the ROM now resident in flash. Must be called once the ROM has been
+ * programmed and verified.
+ */
+static void rom_header_write(const char *filename, const FILINFO *fno,
+		uint32_t crc)
+{
+	static union {
+		struct rom_header header;
+		uint8_t page[(sizeof(struct rom_header) + FLASH_PAGE_SIZE - 1)
+			& ~(FLASH_PAGE_SIZE - 1)];
+	} buffer;
+
+	memset(&buffer,0xFF,sizeof(buffer));
+	buffer.header.magic=ROM_HEADER_MAGIC;
+	buffer.header.size=fno->fsize;
+	buffer.header.fdate=fno->fdate;
+	buffer.header.ftime=fno->ftime;
+	buffer.header.crc=crc;
+	strncpy(buffer.header.filename,filename,
+		sizeof(buffer.header.filename)-1);
+	buffer.header.filename[sizeof(buffer.header.filename)-1]='\0';
+
+	rom_flash_program(FLASH_HEADER_OFFSET,buffer.page,sizeof(buffer.page));
+}
+
+/* ROM files are read from the SD card in chunks of this size, each a multiple
+ * of the SD card block size so that they are read with multiple block
+ * transfers, and a divisor of the flash block size. */
+#define ROM_LOAD_CHUNK		SD_BUFFER_SIZE
+/* Largest ROM of an MBC5 cartridge. */
+#define ROM_STREAM_MAX_SIZE	(8 * 1024 * 1024)
+
+/* Progress bar shown while a ROM is loaded. */
+#define ROM_LOAD_BAR_X		10
+#define ROM_LOAD_BAR_Y		96
+#define ROM_LOAD_BAR_W		200
+#define ROM_LOAD_BAR_H		8
+
+/* Size of the file written by the SD card benchmark, and of each transfer. */
+#define SD_BENCH_SIZE		(1024 * 1024)
+#define SD_BENCH_CHUNK		SD_BUFFER_SIZE
+#define SD_BENCH_RANDOM_SIZE	4096
+#define SD_BENCH_RANDOM_COUNT	64
+
+/**
+ * Print the throughput of "bytes" transferred since "start_time", unless the
+ * transfer failed with "fr", which is printed once the benchmark ends.
+ */
+static void sd_bench_report(const char *name, uint32_t bytes,
+		uint64_t start_time, FRESULT fr)
+{
+	const uint32_t us=time_us_64()-start_time;
+
+	if(fr!=FR_OK)
+		return;
+
+	printf("%s: %lu KB/s\n",name,
+		us ? (uint32_t)((uint64_t)bytes*1000000/1024/us) : 0);
+}
+
+/**
+ * Measure sequential and random read and write throughput of the SD card,
+ * using a temporary file.
+ */
+static void sd_benchmark(void)
+{
+	uint8_t *buffer=sd_buffer;
+	const char *filename="sdbench.tmp";
+	uint64_t start_time;
+	UINT bw, br;
+	FIL fil;
+	FRESULT fr;
+	sd_card_t *pSD=sd_mount();
+	if(!pSD)
+		return;
+
+	printf("SD clock: %lu Hz\n",pSD->baud_rate);
+	fr=f_open(&fil,filename,FA_CREATE_ALWAYS|FA_READ|FA_WRITE);
+	if (fr!=FR_OK) {
+		printf("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+		return;
+	}
+
+	for(uint32_t i=0;i<SD_BENCH_CHUNK;i++)
+		buffer[i]=i*7;
+
+	start_time=time_us_64();
+	for(uint32_t i=0;fr==FR_OK && i<SD_BENCH_SIZE/SD_BENCH_CHUNK;i++)
+		fr=f_write(&fil,buffer,SD_BENCH_CHUNK,&bw);
+	if(fr==FR_OK)
+		fr=f_sync(&fil);
+	sd_bench_report("Sequential write",SD_BENCH_SIZE,start_time,fr);
+
+	start_time=time_us_64();
+	if(fr==FR_OK)
+		fr=f_lseek(&fil,0);
+	for(uint32_t i=0;fr==FR_OK && i<SD_BENCH_SIZE/SD_BENCH_CHUNK;i++)
+		fr=f_read(&fil,buffer,SD_BENCH_CHUNK,&br);
+	sd_bench_report("Sequential read",SD_BENCH_SIZE,start_time,fr);
+
+	start_time=time_us_64();
+	for(uint32_t i=0;fr==FR_OK && i<SD_BENCH_RANDOM_COUNT;i++) {
+		fr=f_lseek(&fil,(rand()%(SD_BENCH_SIZE/SD_BENCH_RANDOM_SIZE))
+			*SD_BENCH_RANDOM_SIZE);
+		if(fr==FR_OK)
+			fr=f_read(&fil,buffer,SD_BENCH_RANDOM_SIZE,&br);
+	}
+	sd_bench_report("Random read",
+		SD_BENCH_RANDOM_COUNT*SD_BENCH_RANDOM_SIZE,start_time,fr);
+
+	start_time=time_us_64();
+	for(uint32_t i=0;fr==FR_OK && i<SD_BENCH_RANDOM_COUNT;i++) {
+		fr=f_lseek(&fil,(rand()%(SD_BENCH_SIZE/SD_BENCH_RANDOM_SIZE))
+			*SD_BENCH_RANDOM_SIZE);
+		if(fr==FR_OK)
+			fr=f_write(&fil,buffer,SD_BENCH_RANDOM_SIZE,&bw);
+	}
+	if(fr==FR_OK)
+		fr=f_sync(&fil);
+	sd_bench_report("Random write",
+		SD_BENCH_RANDOM_COUNT*SD_BENCH_RANDOM_SIZE,start_time,fr);
+
+	if(fr!=FR_OK)
+		printf("E SD benchmark error: %s (%d)\n",FRESULT_str(fr),fr);
+
+	f_close(&fil);
+	f_unlink(filename);
+}
+
+/**
+ * Load a .gb rom file in flash from the SD card.
+ *
+ * Flash is erased a block at a time, as each block is reached. Each chunk is
+ * verified with the DMA sniffer, which reads back the programmed flash while
+ * the next chunk is read from the SD card. Only the part of a larger ROM that
+ * fits in flash is programmed, and the rest is streamed while it is played.
+ */ 
+void load_cart_rom_file(char *filename) {
+	uint8_t *buffer=sd_buffer;
+	UINT br;
+	uint32_t loaded=0;
+	uint32_t crc=0;
+	uint32_t flash_crc=0;
+	bool failed=false;
+	FILINFO fno;
+	const uint64_t start_time=time_us_64();
+	FRESULT fr;
+	if(!sd_mount())
+		return;
+
+	fr=f_stat(filename,&fno);
+	if(fr!=FR_OK) {
+		printf("E f_stat(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+		return;
+	}
+	if(rom_is_resident(filename,&fno)) {
+		printf("I %s is already in flash\n",filename);
+		return;
+	}
+#if ENABLE_ROM_STREAMING
+	/* The rest of a larger ROM is streamed from the SD card. */
+	if(fno.fsize>ROM_STREAM_MAX_SIZE) {
+#else
+	if(fno.fsize>ROM_FLASH_SIZE) {
+#endif
+		printf("E %s is too large (%lu bytes)\n",filename,
+			(unsigned long)fno.fsize);
+		return;
+	}
+	const uint32_t size=MIN(fno.fsize,ROM_FLASH_SIZE);
+
+	FIL fil;
+	fr=f_open(&fil,filename,FA_READ);
+	if (fr==FR_OK) {
+		uint32_t flash_target_offset=FLASH_TARGET_OFFSET;
+
+		mk_ili9225_fill(0x0000);
+		mk_ili9225_text("Loading",ROM_LOAD_BAR_X,ROM_LOAD_BAR_Y-16,
+			0xFFFF,0x0000);
+		const char *name=strrchr(filename,'/');
+		mk_ili9225_text((char *)(name ? name+1 : filename),
+			ROM_LOAD_BAR_X,ROM_LOAD_BAR_Y-8,0xFFFF,0x0000);
+		mk_ili9225_fill_rect(ROM_LOAD_BAR_X,ROM_LOAD_BAR_Y,
+			ROM_LOAD_BAR_W,ROM_LOAD_BAR_H,0x4208);
+
+		/* The resident ROM is about to be overwritten. */
+		rom_flash_erase(FLASH_HEADER_OFFSET,FLASH_SECTOR_SIZE);
+
+		for(;;) {
+			/* The previous chunk is verified during the read. */
+			fr=f_read(&fil,buffer,MIN(ROM_LOAD_CHUNK,size-loaded),&br);
+			if(rom_crc32_chan>=0)
+				flash_crc=rom_crc32_finish();
+			if(fr!=FR_OK) {
+				printf("E f_read error: %s (%d)\n",FRESULT_str(fr),fr);
+				failed=true;
+				break;
+			}
+			if(br==0) break; /* end of file */
+
+			crc=rom_crc32(crc,buffer,br);
+
+			/* Flash is programmed in whole pages. */
+			const UINT count=(br+FLASH_PAGE_SIZE-1)&~(FLASH_PAGE_SIZE-1);
+			memset(buffer+br,0xFF,count-br);
+
+			if((flash_target_offset%FLASH_BLOCK_SIZE)==0)
+				rom_flash_erase(flash_target_offset,FLASH_BLOCK_SIZE);
+			rom_flash_program(flash_target_offset,buffer,count);
+
+			rom_crc32_start(flash_crc,rom+loaded,br);
+
+			/* Next chunk */
+			flash_target_offset+=br;
+			loaded+=br;
+
+			mk_ili9225_fill_rect(ROM_LOAD_BAR_X,ROM_LOAD_BAR_Y,
+				(uint64_t)ROM_LOAD_BAR_W*loaded/size,
+				ROM_LOAD_BAR_H,0xFFFF);
+		}
+		if(!failed && loaded>0 && flash_crc==crc) {
+			rom_header_write(filename,&fno,crc);
+			printf("I Programming successful!\n");
+		} else {
+			printf("E Programming failed!\n");
+		}
+	} else {
+		printf("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
+	}
+	
+	fr=f_close(&fil);
+	if(fr!=FR_OK) {
+		printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+	}
+
+	printf("I load_cart_rom_file(%s) COMPLETE (%lu bytes, %lu ms)\n",
+		filename,loaded,(uint32_t)((time_us_64()-start_time)/1000));
+}
+
+/* The rom browser lists one directory at a time: the parent directory, then
+ * subdirectories, then .gb rom files, each group sorted by name. Directories
+ * are only read when they are browsed, and only the page on screen is kept in
+ * memory. A page is filled with one pass over the directory, keeping the
+ * entries that come right after (or right before) a given entry in sort
+ * order, so memory use does not depend on the size of the library. */
+#define ROM_FILES_PER_PAGE	22
+#define ROM_PATH_MAX		(FF_LFN_BUF + 1)
+
+enum rom_entry_type {
+	ROM_ENTRY_PARENT,
+	ROM_ENTRY_DIR,
+	ROM_ENTRY_FILE
+};
+
+struct rom_entry {
+	uint8_t type;
+	char name[FF_LFN_BUF + 1];
+};
+
+/* Where a page starts or ends, relative to a given entry. */
+enum rom_page_from {
+	ROM_PAGE_AFTER,
+	ROM_PAGE_AT,
+	ROM_PAGE_BEFORE
+};
+
+static struct {
+	/* Directory being browsed, "" for the root directory. */
+	char path[ROM_PATH_MAX];
+	uint8_t count;
+	/* Whether the page is the first page of the directory, and whether
+	 * entries past the page were left out when it was filled. */
+	bool first_page;
+	bool more;
+	/* Slots of the entries of the page, in sort order. */
+	uint8_t order[ROM_FILES_PER_PAGE];
+	struct rom_entry entry[ROM_FILES_PER_PAGE];
+	/* Copies of the entries a page is filled from, as the page is
+	 * overwritten while it is filled. */
+	struct rom_entry key;
+	struct rom_entry first;
+} rom_browser;
+
+static struct rom_entry *rom_browser_entry(uint8_t i)
+{
+	return &rom_browser.entry[rom_browser.order[i]];
+}
+
+static int rom_entry_compare(uint8_t type, const char *name,
+		const struct rom_entry *e)
+{
+	if(type!=e->type)
+		return (int)type-(int)e->type;
+	return strcasecmp(name,e->name);
+}
+
+/**
+ * Add an entry to the page if it is one of the ROM_FILES_PER_PAGE entries
+ * closest to the key seen so far. "sign" is -1 when filling the page
+ * backwards, in which case the page is in reverse order.
+ */
+static void rom_browser_offer(uint8_t type, const char *name, int sign)
+{
+	uint8_t pos=rom_browser.count;
+	uint8_t slot;
+
+	while(pos>0 && sign*rom_entry_compare(type,name,
+			rom_browser_entry(pos-1))<0)
+		pos--;
+	if(pos>=ROM_FILES_PER_PAGE) {
+		rom_browser.more=true;
+		return;
+	}
+
+	if(rom_browser.count<ROM_FILES_PER_PAGE) {
+		slot=rom_browser.count++;
+	} else {
+		/* evict the furthest entry */
+		slot=rom_browser.order[ROM_FILES_PER_PAGE-1];
+		rom_browser.more=true;
+	}
+	memmove(rom_browser.order+pos+1,rom_browser.order+pos,
+		rom_browser.count-1-pos);
+	rom_browser.order[pos]=slot;
+	rom_browser.entry[slot].type=type;
+	strcpy(rom_browser.entry[slot].name,name);
+}
+
+static bool rom_browser_accept(uint8_t type, const char *name,
+		const struct rom_entry *key, enum rom_page_from from)
+{
+	int c;
+
+	if(key==NULL)
+		return true;
+	c=rom_entry_compare(type,name,key);
+	switch(from) {
+	case ROM_PAGE_AFTER:
+		return c>0;
+	case ROM_PAGE_AT:
+		return c>=0;
+	default:
+		return c<0;
+	}
+}
+
+static bool rom_is_gb_file(const char *name)
+{
+	const size_t len=strlen(name);
+
+	return len>3 && strcasecmp(name+len-3,".gb")==0;
+}
+
+/**
+ * Fill the page with the entries of the current directory that come after,
+ * at or before "key", or with the first entries if "key" is NULL. Returns
+ * the number of entries of the page.
+ */
+static uint8_t rom_browser_fill(const struct rom_entry *key,
+		enum rom_page_from from)
+{
+	const int sign=(from==ROM_PAGE_BEFORE) ? -1 : 1;
+	DIR dj;
+	FILINFO fno;
+	FRESULT fr;
+
+	if(key!=NULL && key!=&rom_browser.key) {
+		memcpy(&rom_browser.key,key,sizeof(rom_browser.key));
+		key=&rom_browser.key;
+	}
+	rom_browser.count=0;
+	rom_browser.more=false;
+
+	if(rom_browser.path[0]
+		&& rom_browser_accept(ROM_ENTRY_PARENT,"..",key,from))
+		rom_browser_offer(ROM_ENTRY_PARENT,"..",sign);
+
+	fr=f_opendir(&dj,rom_browser.path[0] ? rom_browser.path : "/");
+	if(fr!=FR_OK) {
+		printf("E f_opendir(%s) error: %s (%d)\n",rom_browser.path,
+			FRESULT_str(fr),fr);
+		rom_browser.first_page=true;
+		return rom_browser.count;
+	}
+	while(true) {
+		uint8_t type;
+
+		fr=f_readdir(&dj,&fno);
+		if(fr!=FR_OK || fno.fname[0]=='\0')
+			break;
+		if(fno.fattrib & (AM_HID | AM_SYS))
+			continue;
+		if(fno.fattrib & AM_DIR) {
+			type=ROM_ENTRY_DIR;
+		} else if(rom_is_gb_file(fno.fname)) {
+			type=ROM_ENTRY_FILE;
+		} else {
+			continue;
+		}
+		if(rom_browser_accept(type,fno.fname,key,from))
+			rom_browser_offer(type,fno.fname,sign);
+	}
+	f_closedir(&dj);
+
+	rom_browser.first_page=(key==NULL)
+		|| (from==ROM_PAGE_BEFORE && !rom_browser.more);
+	if(sign<0) {
+		/* put the page back in sort order */
+		for(uint8_t i=0;i<rom_browser.count/2;i++) {
+			const uint8_t slot=rom_browser.order[i];
+			rom_browser.order[i]=rom_browser.order[rom_browser.count-1-i];
+			rom_browser.order[rom_browser.count-1-i]=slot;
+		}
+	}
+	return rom_browser.count;
+}
+
+/**
+ * Turn to the page after or before "key". The page does not change if there
+ * are no entries after "key", and turning back to a partial page shows the
+ * first page instead.
+ */
+static uint8_t rom_browser_turn(const struct rom_entry *key,
+		enum rom_page_from from)
+{
+	memcpy(&rom_browser.first,rom_browser_entry(0),
+		sizeof(rom_browser.first));
+	rom_browser_fill(key,from);
+	if(from==ROM_PAGE_BEFORE) {
+		if(rom_browser.count<ROM_FILES_PER_PAGE)
+			rom_browser_fill(NULL,ROM_PAGE_AT);
+	} else if(rom_browser.count==0) {
+		rom_browser_fill(&rom_browser.first,ROM_PAGE_AT);
+	}
+	return rom_browser.count;
+}
+
+/**
+ * Enter the directory "name" of the current directory, or go back to the
+ * parent directory for "..". Returns false if the path would be too long.
+ */
+static bool rom_browser_chdir(const char *name)
+{
+	const size_t len=strlen(rom_browser.path);
+
+	if(strcmp(name,"..")==0) {
+		char *slash=strrchr(rom_browser.path,'/');
+		if(slash!=NULL)
+			*slash='\0';
+		return true;
+	}
+	if(len+1+strlen(name)>=sizeof(rom_browser.path)) {
+		printf("E path too long: %s/%s\n",rom_browser.path,name);
+		return false;
+	}
+	rom_browser.path[len]='/';
+	strcpy(rom_browser.path+len+1,name);
+	return true;
+}
+
+/**
+ * Path of the rom file "name" of the current directory.
+ */
+static char *rom_browser_file_path(const char *name)
+{
+	static char path[ROM_PATH_MAX];
+
+	if(snprintf(path,sizeof(path),"%s/%s",rom_browser.path,name)
+			>=(int)sizeof(path)) {
+		printf("E path too long: %s/%s\n",rom_browser.path,name);
+		return NULL;
+	}
+	return path;
+}
+
+/**
+ * Display or highlight entry "i" of the page.
+ */
+static void rom_browser_display_entry(uint8_t i, uint16_t bgcolor)
+{
+	const struct rom_entry *e=rom_browser_entry(i);
+	char text[MK_ILI9225_TEXT_MAX+1];
+
+	if(e->type==ROM_ENTRY_FILE) {
+		mk_ili9225_text((char *)e->name,0,i*8,0xFFFF,bgcolor);
+		return;
+	}
+	/* directories end with a slash */
+	snprintf(text,sizeof(text),"%s/",e->name);
+	if(strlen(e->name)+1>=sizeof(text))
+		text[sizeof(text)-2]='/';
+	mk_ili9225_text(text,0,i*8,0xFFFF,bgcolor);
+}
+
+/**
+ * Function used by the rom file selector to display the current page
+ */
+uint16_t rom_file_selector_display_page(void) {
+	mk_ili9225_fill(0x0000);
+	for(uint8_t ifile=0;ifile<rom_browser.count;ifile++) {
+		rom_browser_display_entry(ifile,0x0000);
+	}
+	return rom_browser.count;
+}
+
+/**
+ * The ROM selector displays pages of up to 22 entries of a directory
+ * allowing the user to browse directories and select which rom file to start
+ * A opens the selected directory or starts the selected rom file
+ * B goes back to the parent directory, or starts the selected rom file in
+ * the root directory
+ * Select jumps to the first entry starting with the next letter
+ */
+void rom_file_selector() {
+	uint16_t num_file;
+
+	if(!sd_mount())
+		return;
+
+	/* display the first page of the root directory */
+	rom_browser.path[0]='\0';
+	rom_browser_fill(NULL,ROM_PAGE_AT);
+	num_file=rom_file_selector_display_page();
+
+	/* select the first entry */
+	uint8_t selected=0;
+	if(num_file>0)
+		rom_browser_display_entry(selected,0xF800);
+
+	/* get user's input */
+	bool up,down,left,right,a,b,select,start;
+	while(true) {
+		up=gpio_get(GPIO_UP);
+		down=gpio_get(GPIO_DOWN);
+		left=gpio_get(GPIO_LEFT);
+		right=gpio_get(GPIO_RIGHT);
+		a=gpio_get(GPIO_A);
+		b=gpio_get(GPIO_B);
+		select=gpio_get(GPIO_SELECT);
+		start=gpio_get(GPIO_START);
+		if(!start) {
+			/* re-start the last game (no need to reprogram flash) */
+			break;
+		}
+		if(!b && rom_browser.path[0]) {
+			/* go back to the parent directory */
+			rom_browser_chdir("..");
+			rom_browser_fill(NULL,ROM_PAGE_AT);
+			num_file=rom_file_selector_display_page();
+			selected=0;
+			if(num_file>0)
+				rom_browser_display_entry(selected,0xF800);
+			sleep_ms(150);
+			continue;
+		}
+		if(num_file==0) {
+			/* nothing to select */
+			tight_loop_contents();
+			continue;
+		}
+		if(!a | !b) {
+			const struct rom_entry *e=rom_browser_entry(selected);
+
+			if(e->type==ROM_ENTRY_FILE) {
+				/* copy the rom from the SD card to flash and start the game */
+				char *path=rom_browser_file_path(e->name);
+				if(path!=NULL) {
+					load_cart_rom_file(path);
+					break;
+				}
+			} else if(rom_browser_chdir(e->name)) {
+				/* open the directory */
+				rom_browser_fill(NULL,ROM_PAGE_AT);
+				num_file=rom_file_selector_display_page();
+				selected=0;
+				if(num_file>0)
+					rom_browser_display_entry(selected,0xF800);
+			}
+			sleep_ms(150);
+		}
+		if(!down) {
+			/* select the next entry */
+			rom_browser_display_entry(selected,0x0000);
+			selected++;
+			if(selected>=num_file) selected=0;
+			rom_browser_display_entry(selected,0xF800);
+			sleep_ms(150);
+		}
+		if(!up) {
+			/* select the previous entry */
+			rom_browser_display_entry(selected,0x0000);
+			if(selected==0) {
+				selected=num_file-1;
+			} else {
+				selected--;
+			}
+			rom_browser_display_entry(selected,0xF800);
+			sleep_ms(150);
+		}
+		if(!right) {
+			/* select the next page */
+			rom_browser_turn(rom_browser_entry(num_file-1),ROM_PAGE_AFTER);
+			num_file=rom_file_selector_display_page();
+			/* select the first entry */
+			selected=0;
+			rom_browser_display_entry(selected,0xF800);
+			sleep_ms(150);
+		}
+		if((!left) && !rom_browser.first_page) {
+			/* select the previous page */
+			rom_browser_turn(rom_browser_entry(0),ROM_PAGE_BEFORE);
+			num_file=rom_file_selector_display_page();
+			/* select the first entry */
+			selected=0;
+			rom_browser_display_entry(selected,0xF800);
+			sleep_ms(150);
+		}
+		if(!select) {
+			/* select the first entry starting with the next letter */
+			const struct rom_entry *e=rom_browser_entry(selected);
+			struct rom_entry *key=&rom_browser.key;
+
+			key->type=e->type;
+			key->name[0]=tolower((unsigned char)e->name[0])+1;
+			key->name[1]='\0';
+			if(rom_browser_fill(key,ROM_PAGE_AT)==0) {
+				/* no more letters, go back to the first page */
+				rom_browser_fill(NULL,ROM_PAGE_AT);
+			}
+			num_file=rom_file_selector_display_page();
+			selected=0;
+			rom_browser_display_entry(selected,0xF800);
+			sleep_ms(150);
+		}
+		tight_loop_contents();
+	}
+}
+
+#endif
+
+/**
+ * Read all buttons with a single read of the GPIO inputs, in the format of
+ * gb.direct.joypad.
+ */
+static inline uint8_t joypad_read(void)
+{
+	const uint32_t gpio = gpio_get_all();
+
+	return ((gpio >> GPIO_A) & 1) |
+		((gpio >> GPIO_B) & 1) << 1 |
+		((gpio >> GPIO_SELECT) & 1) << 2 |
+		((gpio >> GPIO_START) & 1) << 3 |
+		((gpio >> GPIO_RIGHT) & 1) << 4 |
+		((gpio >> GPIO_LEFT) & 1) << 5 |
+		((gpio >> GPIO_UP) & 1) << 6 |
+		((gpio >> GPIO_DOWN) & 1) << 7;
+}
+
+#if ENABLE_JOYPAD_IRQ
+/* Debounced joypad, and the time at which each of its buttons last changed.
+ * Written on core 0 with interrupts disabled or in the GPIO interrupt. */
+static volatile uint8_t joypad_state = 0xFF;
+static uint32_t joypad_changed_us[8];
+/* Set when joypad_state changes, cleared once it is passed to the game. */
+static volatile bool joypad_pending = false;
+
+/**
+ * Update joypad_state from the GPIO inputs. Buttons changed less than
+ * JOYPAD_DEBOUNCE_US ago keep their state.
+ */
+static void joypad_sample(void)
+{
+	const uint32_t now = time_us_32();
+	const uint8_t old = joypad_state;
+	uint8_t state = old;
+	uint_fast8_t changed = joypad_read() ^ old;
+
+	for(unsigned int i = 0; changed != 0; i++, changed >>= 1)
+	{
+		if(!(changed & 1) ||
+				now - joypad_changed_us[i] < JOYPAD_DEBOUNCE_US)
+			continue;
+
+		state ^= 1u << i;
+		joypad_changed_us[i] = now;
+	}
+
+	if(state != old)
+	{
+		joypad_state = state;
+		joypad_pending = true;
+	}
+}
+
+static void joypad_gpio_callback(uint gpio, uint32_t events)
+{
+	(void) gpio;
+	(void) events;
+	joypad_sample();
+}
+
+/**
+ * Call joypad_sample() on every edge of the buttons. Must be called on core 0.
+ */
+static void joypad_irq_init(void)
+{
+	const uint32_t events = GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL;
+
+	gpio_set_irq_enabled_with_callback(GPIO_UP, events, true,
+			&joypad_gpio_callback);
+	gpio_set_irq_enabled(GPIO_DOWN, events, true);
+	gpio_set_irq_enabled(GPIO_LEFT, events, true);
+	gpio_set_irq_enabled(GPIO_RIGHT, events, true);
+	gpio_set_irq_enabled(GPIO_A, events, true);
+	gpio_set_irq_enabled(GPIO_B, events, true);
+	gpio_set_irq_enabled(GPIO_SELECT, events, true);
+	gpio_set_irq_enabled(GPIO_START, events, true);
+}
+#endif
+
+/**
+ * Pass the buttons to the game. The GPIO inputs are sampled again, in case
+ * the last edge of a button was ignored while debouncing.
+ */
+static void joypad_update(struct gb_s *gb)
+{
+#if ENABLE_JOYPAD_IRQ
+	const uint32_t irq = save_and_disable_interrupts();
+	joypad_sample();
+	joypad_pending = false;
+	restore_interrupts(irq);
+
+	gb_set_joypad(gb, joypad_state);
+#else
+	gb_set_joypad(gb, joypad_read());
+#endif
+}
+
+#if ENABLE_LINK
+/**
+ * Messages exchanged over the link cable, each sent as two bytes: bit 7 set,
+ * the type in bits 5-4 and the high nibble of the data, then the low nibble of
+ * the data with bit 7 clear. A unit joining mid-message resynchronises on the
+ * next byte with bit 7 set.
+ */
+enum link_msg_e
+{
+	/* Sent every LINK_HELLO_FRAMES to tell the peer that the link is up. */
+	LINK_MSG_HELLO = 0,
+	/* Byte of a game waiting for the peer to clock a transfer. */
+	LINK_MSG_READY = 1,
+	/* Byte of the game clocking a transfer, in exchange of a READY byte. */
+	LINK_MSG_DATA = 2
+};
+
+static struct {
+	/* First byte of the message being received, 0 if none. */
+	uint8_t rx_head;
+	/* Whether a message was ever received, and when the last one was. */
+	bool heard;
+	uint32_t heard_us;
+
+	/* READY byte of the peer, not yet clocked by this game. */
+	bool peer_ready;
+	uint8_t peer_byte;
+	/* DATA byte of the peer, not yet passed to this game. */
+	bool data_ready;
+	uint8_t data_byte;
+
+	/* Transfer clocked by this game, left pending after LINK_WAIT_US. */
+	bool master_pending;
+
+	/* READY byte sent to the peer for the pending transfer, and when. */
+	bool ready_sent;
+	uint8_t ready_byte;
+	uint32_t ready_us;
+
+	uint_fast8_t hello_frames;
+
+	/* Counters reported with the 'b' command. */
+	uint32_t transfers;
+	/* Transfers clocked by this game, waiting for the byte of the peer. */
+	uint32_t stalls;
+	uint32_t stall_us;
+	uint32_t stall_max_us;
+	/* Stalls after which the transfer was left pending. */
+	uint32_t timeouts;
+	/* Transfers clocked by the peer, from READY to DATA. */
+	uint32_t latencies;
+	uint32_t latency_us;
+	uint32_t latency_max_us;
+	uint32_t errors;
+} link_cable;
+
+static void link_send(const enum link_msg_e type, const uint8_t data)
+{
+	uart_putc_raw(LINK_UART, 0x80 | (type << 4) | (data >> 4));
+	uart_putc_raw(LINK_UART, data & 0x0F);
+}
+
+/**
+ * Process the messages received since the last call.
+ */
+static void link_poll(void)
+{
+	while(uart_is_readable(LINK_UART))
+	{
+		const uint8_t c = uart_getc(LINK_UART);
+		uint8_t data;
+
+		if(c & 0x80)
+		{
+			if(link_cable.rx_head != 0)
+				link_cable.errors++;
+
+			link_cable.rx_head = c;
+			continue;
+		}
+
+		if(link_cable.rx_head == 0 || (c & 0x70) != 0)
+		{
+			link_cable.errors++;
+			link_cable.rx_head = 0;
+			continue;
+		}
+
+		data = (link_cable.rx_head << 4) | c;
+		link_cable.heard = true;
+		link_cable.heard_us = time_us_32();
+
+		switch((link_cable.rx_head >> 4) & 0x03)
+		{
+		case LINK_MSG_HELLO:
+			break;
+
+		case LINK_MSG_READY:
+			link_cable.peer_ready = true;
+			link_cable.peer_byte = data;
+			break;
+
+		case LINK_MSG_DATA:
+			link_cable.data_ready = true;
+			link_cable.data_byte = data;
+			break;
+
+		default:
+			link_cable.errors++;
+			break;
+		}
+
+		link_cable.rx_head = 0;
+	}
+}
+
+static bool link_connected(void)
+{
+	return link_cable.heard && time_us_32() - link_cable.heard_us < LINK_TIMEOUT_US;
+}
+
+/**
+ * Called by the core when the game starts a transfer, and again while a
+ * transfer clocked by the peer is pending. The byte is offered to the peer
+ * once, and again only if the game changes it.
+ */
+static void link_serial_tx(struct gb_s *gb, const uint8_t tx)
+{
+	link_poll();
+
+	if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
+		return;
+
+	if(link_cable.ready_sent && link_cable.ready_byte == tx)
+		return;
+
+	link_cable.ready_sent = true;
+	link_cable.ready_byte = tx;
+	link_cable.ready_us = time_us_32();
+	link_send(LINK_MSG_READY, tx);
+}
+
+/**
+ * Called by the core when a transfer should complete.
+ *
+ * A transfer clocked by the peer completes once its DATA byte has arrived,
+ * and is retried by the core every SERIAL_CYCLES until then. A transfer
+ * clocked by this game exchanges SB for the READY byte of the peer. While the
+ * peer is connected, the byte is waited for up to LINK_WAIT_US, then the
+ * transfer is left pending until it arrives. Without a peer, it completes
+ * with 0xFF.
+ */
+static enum gb_serial_rx_ret_e link_serial_rx(struct gb_s *gb, uint8_t *rx)
+{
+	link_poll();
+
+	if(!(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC))
+	{
+		uint32_t latency;
+
+		if(!link_cable.data_ready)
+			return GB_SERIAL_RX_NO_CONNECTION;
+
+		latency = time_us_32() - link_cable.ready_us;
+		link_cable.latencies++;
+		link_cable.latency_us += latency;
+		if(latency > link_cable.latency_max_us)
+			link_cable.latency_max_us = latency;
+
+		link_cable.data_ready = false;
+		link_cable.ready_sent = false;
+		link_cable.transfers++;
+		*rx = link_cable.data_byte;
+		return GB_SERIAL_RX_SUCCESS;
+	}
+
+	if(!link_cable.peer_ready && !link_connected())
+	{
+		link_cable.master_pending = false;
+		return GB_SERIAL_RX_NO_CONNECTION;
+	}
+
+	if(!link_cable.peer_ready && !link_cable.master_pending)
+	{
+		const uint32_t start = time_us_32();
+		uint32_t stall;
+
+		do {
+			link_poll();
+			stall = time_us_32() - start;
+		} while(!link_cable.peer_ready && stall < LINK_WAIT_US);
+
+		link_cable.stalls++;
+		link_cable.stall_us += stall;
+		if(stall > link_cable.stall_max_us)
+			link_cable.stall_max_us = stall;
+	}
+
+	/* Completing without the byte of the peer would pair its late READY
+	 * byte with the next transfer, so the transfer is left pending, and
+	 * retried every SERIAL_CYCLES without waiting. */
+	if(!link_cable.peer_ready)
+	{
+		if(!link_cable.master_pending)
+			link_cable.timeouts++;
+
+		link_cable.master_pending = true;
+		return GB_SERIAL_RX_PENDING;
+	}
+
+	link_send(LINK_MSG_DATA, gb->hram_io[IO_SB]);
+	link_cable.master_pending = false;
+	link_cable.peer_ready = false;
+	link_cable.transfers++;
+	*rx = link_cable.peer_byte;
+	return GB_SERIAL_RX_SUCCESS;
+}
+
+/**
+ * Drain the UART, and tell the peer that the link is up.
+ */
+static void link_frame_end(void)
+{
+	link_poll();
+
+	if(++link_cable.hello_frames < LINK_HELLO_FRAMES)
+		return;
+
+	link_cable.hello_frames = 0;
+	link_send(LINK_MSG_HELLO, 0);
+}
+
+/**
+ * Clear the state of the link when a game starts.
+ */
+static void link_reset(struct gb_s *gb)
+{
+	memset(&link_cable, 0, sizeof(link_cable));
+	while(uart_is_readable(LINK_UART))
+		(void) uart_getc(LINK_UART);
+
+	gb_init_serial(gb, &link_serial_tx, &link_serial_rx);
+}
+
+/**
+ * Set the UART to LINK_BAUD. clk_peri runs from clk_sys but is declared
+ * slower (see clk_peri_update()), so the rate asked for is scaled by the
+ * same ratio. Must be called after clk_peri is configured.
+ */
+static void link_set_baudrate(void)
+{
+	uart_set_baudrate(LINK_UART, (uint64_t)LINK_BAUD *
+		clock_get_hz(clk_peri) / clock_get_hz(clk_sys));
+}
+
+static void link_init(void)
+{
+	uart_init(LINK_UART, LINK_BAUD);
+	link_set_baudrate();
+	uart_set_fifo_enabled(LINK_UART, true);
+	gpio_set_function(LINK_GPIO_TX, GPIO_FUNC_UART);
+	gpio_set_function(LINK_GPIO_RX, GPIO_FUNC_UART);
+	/* Keep the line idle while no peer is plugged. */
+	gpio_pull_up(LINK_GPIO_RX);
+}
+#endif
+
+/**
+ * Emulate the given number of frames for each frame drawn. Speed 1 ends fast
+ * forward.
+ */
+static void turbo_set(struct gb_s *gb, uint_fast8_t speed)
+{
+	turbo_speed = speed;
+	fast_forward = speed > 1;
+	gb->direct.frame_skip = fast_forward;
+	gb->direct.frame_skip_ratio = fast_forward ? speed - 1 : 1;
+	printf("I turbo speed %ux\n", (unsigned) speed);
+}
+
+/**
+ * Select the next fast forward speed.
+ */
+static void turbo_next(struct gb_s *gb)
+{
+	turbo_set(gb, turbo_speed * 2 > TURBO_SPEED_MAX ? 1 : turbo_speed * 2);
+}
+
+/**
+ * Whether the frame just emulated was drawn, and not skipped by the frame skip
+ * or fast forward.
+ */
+static inline bool frame_drawn(const struct gb_s *gb)
+{
+	return !gb->direct.frame_skip || gb->display.frame_skip_count == 0;
+}
+
+#if ENABLE_FRAME_PACER
+/* Frame period in units of 2^-12 us. One tick of DMG_CLOCK_FREQ_REDUCED is
+ * exactly 15625 of these units, so the period accumulates without drift. */
+#define FRAME_PACER_PERIOD						\
+	((uint64_t)SCREEN_REFRESH_CYCLES_REDUCED *			\
+	 (uint64_t)(1000000.0 * 4096 / DMG_CLOCK_FREQ_REDUCED))
+
+static int frame_pacer_alarm = -1;
+/* Time of the next frame in units of 2^-12 us. */
+static uint64_t frame_pacer_next;
+/* Frames that have become due since last waited for. Written in the alarm
+ * interrupt. */
+static volatile uint32_t frame_pacer_due;
+#if !AUTO_FRAME_SKIP_MAX
+/* Whether frame skip was enabled by the pacer rather than by the user. */
+static bool frame_pacer_skipping;
+#endif
+
+/* Number of frames that were late, and that were dropped to catch up. */
+static uint32_t frame_pacer_late = 0;
+static uint32_t frame_pacer_dropped = 0;
+
+static void frame_pacer_callback(uint alarm)
+{
+	/* Set the next alarm, counting each period that has already passed. */
+	do {
+		frame_pacer_due++;
+		frame_pacer_next += FRAME_PACER_PERIOD;
+	} while(hardware_alarm_set_target(alarm,
+			from_us_since_boot(frame_pacer_next >> 12)));
+
+	__sev();
+}
+
+/**
+ * Start pacing frames from now.
+ */
+static void frame_pacer_start(void)
+{
+	if(frame_pacer_alarm < 0)
+	{
+		frame_pacer_alarm = hardware_alarm_claim_unused(true);
+		hardware_alarm_set_callback(frame_pacer_alarm,
+				frame_pacer_callback);
+	}
+
+	frame_pacer_due = 0;
+#if !AUTO_FRAME_SKIP_MAX
+	frame_pacer_skipping = false;
+#endif
+	frame_pacer_next = (time_us_64() << 12) + FRAME_PACER_PERIOD;
+	hardware_alarm_set_target(frame_pacer_alarm,
+			from_us_since_boot(frame_pacer_next >> 12));
+}
+
+static void frame_pacer_stop(void)
+{
+	if(frame_pacer_alarm >= 0)
+		hardware_alarm_cancel(frame_pacer_alarm);
+}
+
+/**
+ * Wait until the next frame is due. While fast forwarding, only frames that
+ * are drawn are paced, so that the frames skipped in between run at once.
+ */
+static void frame_pacer_wait(struct gb_s *gb)
+{
+	uint32_t lag;
+	uint32_t irq;
+
+	if(fast_forward && !frame_drawn(gb))
+		return;
+
+	while(frame_pacer_due == 0)
+		__wfe();
+
+	irq = save_and_disable_interrupts();
+	lag = --frame_pacer_due;
+	if(lag > FRAME_PACER_MAX_LAG)
+	{
+		frame_pacer_dropped += lag;
+		frame_pacer_due = 0;
+		lag = 0;
+	}
+	restore_interrupts(irq);
+
+	if(lag > 0)
+		frame_pacer_late++;
+
+#if AUTO_FRAME_SKIP_MAX
+	(void) gb;
+#else
+	if(lag > 0 && !gb->direct.frame_skip)
+	{
+		gb->direct.frame_skip = 1;
+		frame_pacer_skipping = true;
+	}
+	else if(lag == 0 && frame_pacer_skipping)
+	{
+		gb->direct.frame_skip = 0;
+		frame_pacer_skipping = false;
+	}
+#endif
+}
+#endif
+
+#if AUTO_FRAME_SKIP_MAX
+/* Time available to emulate each frame. */
+#define FRAME_BUDGET_US	((uint32_t)(1000000.0 / VERTICAL_SYNC))
+
+/* Time taken by the frames of the current frame skip cycle, which is one
+ * drawn frame and the frames skipped before it. */
+static uint32_t auto_frame_skip_us = 0;
+static uint_fast8_t auto_frame_skip_frames = 0;
+
+/* Number of frames that were not drawn. */
+static uint32_t frames_skipped = 0;
+
+/**
+ * Adjust the frame skip ratio at the end of each frame skip cycle. The ratio
+ * is raised when the cycle took longer than its budget, and lowered when it
+ * took less than three quarters of it.
+ */
+static void auto_frame_skip_update(struct gb_s *gb, uint32_t frame_us)
+{
+	uint32_t budget;
+	uint_fast8_t ratio = gb->direct.frame_skip ?
+		gb->direct.frame_skip_ratio : 0;
+
+	auto_frame_skip_us += frame_us;
+	auto_frame_skip_frames++;
+
+	/* The cycle ends when the next frame will be drawn. */
+	if(gb->direct.frame_skip &&
+			gb->display.frame_skip_count < gb->direct.frame_skip_ratio)
+		return;
+
+	frames_skipped += auto_frame_skip_frames - 1;
+	budget = auto_frame_skip_frames * FRAME_BUDGET_US;
+
+	if(auto_frame_skip_us > budget && ratio < AUTO_FRAME_SKIP_MAX)
+		ratio++;
+	else if(auto_frame_skip_us < budget / 4 * 3 && ratio > 0)
+		ratio--;
+
+	gb->direct.frame_skip = ratio != 0;
+	gb->direct.frame_skip_ratio = ratio;
+
+	auto_frame_skip_us = 0;
+	auto_frame_skip_frames = 0;
+}
+#endif
+
+#if ENABLE_REPLAY
+/**
+ * Wait until core 1 has drawn all queued lines.
+ */
+static void replay_lcd_drain(void)
+{
+	while(__atomic_load_n(&lcd_ring_tail, __ATOMIC_ACQUIRE) !=
+			lcd_ring_head)
+		__wfe();
+}
+
+/**
+ * Reset the game to replay or record a trace, after saving it.
+ */
+static void replay_reset(struct gb_s *gb)
+{
+#if ENABLE_SDCARD
+# if ENABLE_SAVE_STATES
+	state_write_finish();
+# endif
+	write_cart_ram_file(gb);
+#endif
+	memset(ram, 0, sizeof(ram));
+
+	replay_lcd_drain();
+	gb_reset(gb);
+#if ENABLE_SDCARD && ENABLE_REWIND
+	rewind_reset();
+#endif
+	turbo_set(gb, 1);
+	gb->direct.interlace = 0;
+	gb->direct.joypad = 0xFF;
+
+	replay.pos = 0;
+	replay.frames = 0;
+	replay.joypad = 0xFF;
+}
+
+/**
+ * Read a trace from the serial console, up to a line "E".
+ * \return	false if no character was received for a second, or the trace
+ *		is empty or too long.
+ */
+static bool replay_read(void)
+{
+	char line[32];
+	unsigned len = 0;
+
+	replay.runs = 0;
+	for(;;)
+	{
+		const int c = getchar_timeout_us(1000 * 1000);
+		unsigned frames, joypad;
+
+		if(c == PICO_ERROR_TIMEOUT)
+		{
+			puts("E replay: trace timed out");
+			return false;
+		}
+
+		if(c != '\n' && c != '\r')
+		{
+			if(len < sizeof(line) - 1)
+				line[len++] = c;
+			continue;
+		}
+
+		line[len] = '\0';
+		len = 0;
+		if(strcmp(line, "E") == 0)
+			return replay.runs > 0;
+
+		if(sscanf(line, "J %u %x", &frames, &joypad) != 2)
+			continue;
+
+		/* Longer runs are split. */
+		while(frames > 0)
+		{
+			const uint16_t n = MIN(frames, UINT16_MAX);
+
+			if(replay.runs == REPLAY_RUNS_MAX)
+			{
+				puts("E replay: trace too long");
+				return false;
+			}
+
+			replay.run[replay.runs].frames = n;
+			replay.run[replay.runs].joypad = joypad;
+			replay.runs++;
+			frames -= n;
+		}
+	}
+}
+
+static void replay_start(struct gb_s *gb)
+{
+	replay_reset(gb);
+
+	replay.frames = replay.run[0].frames;
+	replay.joypad = replay.run[0].joypad;
+	gb->direct.joypad = replay.joypad;
+
+	replay.frame_hash = 2166136261u;
+	replay.frame_count = 0;
+	replay.frame_us_min = UINT32_MAX;
+	replay.frame_us_max = 0;
+	replay.frame_us_sum = 0;
+	memset(replay.hist, 0, sizeof(replay.hist));
+	__atomic_store_n(&replay.active, true, __ATOMIC_RELEASE);
+}
+
+static void replay_report(void)
+{
+	printf("Replay: %lu frames, frame time min %lu us, avg %lu us, "
+		"max %lu us\n", replay.frame_count, replay.frame_us_min,
+		(uint32_t)(replay.frame_us_sum / replay.frame_count),
+		replay.frame_us_max);
+	printf("Frames up to 0, 1, 3, 7 ... us:");
+	for(unsigned bin = 0; bin < REPLAY_HIST_BINS; bin++)
+		printf(" %lu", replay.hist[bin]);
+	printf("\nFrame hash: %08lx\n", replay.frame_hash);
+	stdio_flush();
+}
+
+/**
+ * Count the time spent on a replayed frame and select the joypad of the next
+ * frame.
+ * \return	false once the trace is over.
+ */
+static bool replay_frame_end(struct gb_s *gb, uint32_t us)
+{
+	unsigned bin = us ? 32 - __builtin_clz(us) : 0;
+
+	if(us < replay.frame_us_min)
+		replay.frame_us_min = us;
+	if(us > replay.frame_us_max)
+		replay.frame_us_max = us;
+	replay.frame_us_sum += us;
+	if(bin >= REPLAY_HIST_BINS)
+		bin = REPLAY_HIST_BINS - 1;
+	replay.hist[bin]++;
+	replay.frame_count++;
+
+	/* Every frame is drawn, so that the hash does not depend on speed. */
+	gb->direct.frame_skip = 0;
+
+	if(--replay.frames == 0)
+	{
+		if(++replay.pos == replay.runs)
+		{
+			replay_lcd_drain();
+			__atomic_store_n(&replay.active, false, __ATOMIC_RELEASE);
+			replay_report();
+			return false;
+		}
+
+		replay.frames = replay.run[replay.pos].frames;
+		replay.joypad = replay.run[replay.pos].joypad;
+	}
+
+	return true;
+}
+
+/**
+ * Add the joypad of the frame just emulated to the trace being recorded.
+ */
+static void replay_record(const uint8_t joypad)
+{
+	if(replay.frames > 0 &&
+			(joypad != replay.joypad || replay.frames == UINT16_MAX))
+	{
+		printf("J %u %02X\n", replay.frames, replay.joypad);
+		replay.frames = 0;
+	}
+
+	replay.joypad = joypad;
+	replay.frames++;
+}
+
+static void replay_record_stop(void)
+{
+	if(replay.frames > 0)
+		printf("J %u %02X\n", replay.frames, replay.joypad);
+	puts("E");
+	stdio_flush();
+	replay.recording = false;
+}
+#endif
+
+#if PEANUT_GB_HEATMAP
+/**
+ * Print the heat map as CSV, one line per opcode or memory region that was
+ * counted, then clear it.
+ */
+static void heatmap_dump(struct gb_s *gb)
+{
+	const struct heatmap_s *const h = &gb->heatmap;
+
+	puts("table,index,count");
+	for(unsigned i = 0; i < count_of(h->op); i++)
+		if(h->op[i])
+			printf("op,0x%02X,%lu\n", i, h->op[i]);
+	for(unsigned i = 0; i < count_of(h->cb_op); i++)
+		if(h->cb_op[i])
+			printf("cb,0x%02X,%lu\n", i, h->cb_op[i]);
+	for(unsigned i = 0; i < count_of(h->read); i++)
+		printf("read,0x%X000,%lu\n", i, h->read[i]);
+	for(unsigned i = 0; i < count_of(h->write); i++)
+		printf("write,0x%X000,%lu\n", i, h->write[i]);
+
+	stdio_flush();
+	memset(&gb->heatmap, 0, sizeof(gb->heatmap));
+}
+#endif
+
+#if ENABLE_LCD && ENABLE_SDCARD && ENABLE_FAST_BOOT
+/**
+ * Whether to start the game left in flash without the ROM selector: only at
+ * power on, if a ROM was programmed completely and no button is held.
+ */
+static bool fast_boot(void)
+{
+	static bool booted = false;
+	const bool fast = !booted && rom_header->magic == ROM_HEADER_MAGIC &&
+		joypad_read() == 0xFF;
+
+	booted = true;
+	return fast;
+}
+#endif
+
+/* System clock states, from fastest to slowest. The fastest is used at boot. */
+static const struct clock_state {
+	uint32_t vco;
+	uint8_t div1;
+	uint8_t div2;
+	enum vreg_voltage vreg;
+} clock_states[] = {
+	{ 1596 * MHZ, 6, 1, VREG_VOLTAGE_1_15 },	/* 266 MHz */
+#if ENABLE_DVFS
+	{ 1200 * MHZ, 6, 1, VREG_VOLTAGE_1_15 },	/* 200 MHz */
+	{ 1500 * MHZ, 5, 2, VREG_VOLTAGE_1_10 },	/* 150 MHz */
+	{ 1500 * MHZ, 6, 2, VREG_VOLTAGE_1_10 },	/* 125 MHz */
+#endif
+};
+
+static inline uint32_t clock_state_hz(const struct clock_state *cs)
+{
+	return cs->vco / (cs->div1 * cs->div2);
+}
+
+/**
+ * Run clk_peri from clk_sys. It is declared at 125 MHz at the fastest clock
+ * state, and in proportion at slower ones, so that the SPI and UART dividers
+ * derived from it give the same rates in every state.
+ */
+static void clk_peri_update(void)
+{
+	const uint32_t hz = (uint64_t)(125 * 1000 * 1000) *
+		clock_get_hz(clk_sys) / clock_state_hz(&clock_states[0]);
+
+	clock_configure(clk_peri, 0,
+			CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS, hz, hz);
+}
+
+#if LCD_USE_PIO
+/**
+ * Divider of clk_sys giving at most LCD_PIO_BAUD on the LCD clock.
+ */
+static uint32_t lcd_pio_clkdiv(uint32_t sys_hz)
+{
+	const uint32_t bit_clk = 2 * LCD_PIO_BAUD;
+
+	return (sys_hz + bit_clk - 1) / bit_clk;
+}
+#endif
+
+#if ENABLE_DVFS
+static struct {
+	uint_fast8_t state;
+	/* Longest frame of the current window, and frames in the window. */
+	uint32_t window_max_us;
+	uint_fast16_t window_frames;
+#if ENABLE_SOUND
+	i2s_config_t *i2s;
+	uint32_t underruns;
+#endif
+	/* Time spent in each state, reported with the 'b' command. */
+	uint64_t changed_us;
+	uint64_t state_us[count_of(clock_states)];
+	uint32_t changes;
+} dvfs;
+
+static void dvfs_account(void)
+{
+	const uint64_t now = time_us_64();
 
-		FIL fil;
-		fr=f_open(&fil,filename,FA_READ);
-		if (fr==FR_OK) {
-			f_read(&fil,ram,f_size(&fil),&br);
-		} else {
-			printf("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
-		}
-		
-		fr=f_close(&fil);
-		if(fr!=FR_OK) {
-			printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
-		}
-		f_unmount(pSD->pcName);
-	}
-	printf("I read_cart_ram_file(%s) COMPLETE (%lu bytes)\n",filename,save_size);
+	dvfs.state_us[dvfs.state] += now - dvfs.changed_us;
+	dvfs.changed_us = now;
 }
 
 /**
- * Write a save file to the SD card
+ * Switch to the given clock state, and derive the clocks of the peripherals
+ * again. The voltage is raised before the clock, and lowered after it.
  */
-void write_cart_ram_file(struct gb_s *gb) {
-	char filename[16];
-	uint_fast32_t save_size;
-	UINT bw;
-	
-	gb_get_rom_name(gb,filename);
-	save_size=gb_get_save_size(gb);
-	if(save_size>0) {
-		sd_card_t *pSD=sd_get_by_num(0);
-		FRESULT fr=f_mount(&pSD->fatfs,pSD->pcName,1);
-		if (FR_OK!=fr) {
-			printf("E f_mount error: %s (%d)\n",FRESULT_str(fr),fr);
-			return;
-		}
+static void dvfs_set(uint_fast8_t state)
+{
+	const struct clock_state *const cs = &clock_states[state];
+	const bool faster = clock_state_hz(cs) > clock_get_hz(clk_sys);
 
-		FIL fil;
-		fr=f_open(&fil,filename,FA_CREATE_ALWAYS | FA_WRITE);
-		if (fr==FR_OK) {
-			f_write(&fil,ram,save_size,&bw);
-		} else {
-			printf("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
-		}
-		
-		fr=f_close(&fil);
-		if(fr!=FR_OK) {
-			printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
-		}
-		f_unmount(pSD->pcName);
-	}
-	printf("I write_cart_ram_file(%s) COMPLETE (%lu bytes)\n",filename,save_size);
-}
+	dvfs_account();
+	dvfs.state = state;
+	dvfs.window_max_us = 0;
+	dvfs.window_frames = 0;
+	dvfs.changes++;
 
-/**
- * Load a .gb rom file in flash from the SD card 
- */ 
-void load_cart_rom_file(char *filename) {
-	UINT br;
-	uint8_t buffer[FLASH_SECTOR_SIZE];
-	bool mismatch=false;
-	sd_card_t *pSD=sd_get_by_num(0);
-	FRESULT fr=f_mount(&pSD->fatfs,pSD->pcName,1);
-	if (FR_OK!=fr) {
-		printf("E f_mount error: %s (%d)\n",FRESULT_str(fr),fr);
-		return;
+	if(faster)
+	{
+		vreg_set_voltage(cs->vreg);
+		busy_wait_us(DVFS_VREG_SETTLE_US);
+#if LCD_USE_PIO
+		/* Never exceed LCD_PIO_BAUD while the clock is raised. */
+		pio_sm_set_clkdiv_int_frac(LCD_PIO, lcd_pio_sm,
+				lcd_pio_clkdiv(clock_state_hz(cs)), 0);
+#endif
 	}
-	FIL fil;
-	fr=f_open(&fil,filename,FA_READ);
-	if (fr==FR_OK) {
-		uint32_t flash_target_offset=FLASH_TARGET_OFFSET;
-		for(;;) {
-			f_read(&fil,buffer,sizeof buffer,&br);
-			if(br==0) break; /* end of file */
 
-			printf("I Erasing target region...\n");
-			flash_range_erase(flash_target_offset,FLASH_SECTOR_SIZE);
-			printf("I Programming target region...\n");
-			flash_range_program(flash_target_offset,buffer,FLASH_SECTOR_SIZE);
-			
-			/* Read back target region and check programming */
-			printf("I Done. Reading back target region...\n");
-			for(uint32_t i=0;i<FLASH_SECTOR_SIZE;i++) {
-				if(rom[flash_target_offset+i]!=buffer[i]) {
-					mismatch=true;
-				}
-			}
+	set_sys_clock_pll(cs->vco, cs->div1, cs->div2);
+	clk_peri_update();
 
-			/* Next sector */
-			flash_target_offset+=FLASH_SECTOR_SIZE;
-		}
-		if(mismatch) {
-	        printf("I Programming successful!\n");
-		} else {
-			printf("E Programming failed!\n");
-		}
-	} else {
-		printf("E f_open(%s) error: %s (%d)\n",filename,FRESULT_str(fr),fr);
-	}
-	
-	fr=f_close(&fil);
-	if(fr!=FR_OK) {
-		printf("E f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+	if(!faster)
+	{
+#if LCD_USE_PIO
+		pio_sm_set_clkdiv_int_frac(LCD_PIO, lcd_pio_sm,
+				lcd_pio_clkdiv(clock_state_hz(cs)), 0);
+#endif
+		vreg_set_voltage(cs->vreg);
 	}
-	f_unmount(pSD->pcName);
 
-	printf("I load_cart_rom_file(%s) COMPLETE (%lu bytes)\n",filename,br);
+#if !LCD_USE_PIO
+	spi_set_baudrate(spi0, 30*1000*1000);
+#endif
+#if ENABLE_SOUND
+	i2s_update_clock(dvfs.i2s);
+#endif
+#if ENABLE_SDCARD
+	{
+		sd_card_t *pSD = sd_get_by_num(0);
+
+		if(!(pSD->m_Status & STA_NOINIT))
+			spi_set_baudrate(pSD->spi->hw_inst, pSD->baud_rate);
+	}
+#endif
+#if ENABLE_LINK
+	link_set_baudrate();
+#endif
 }
 
 /**
- * Function used by the rom file selector to display one page of .gb rom files
+ * Select the clock state for the next frames, given how long the frame just
+ * emulated took from its start to the end of its audio.
  */
-uint16_t rom_file_selector_display_page(char filename[22][256],uint16_t num_page) {
-	sd_card_t *pSD=sd_get_by_num(0);
-    DIR dj;
-    FILINFO fno;
-    FRESULT fr;
+static void dvfs_frame_end(const struct gb_s *gb, uint32_t busy_us)
+{
+	const uint32_t period_us = (uint32_t)(1000000.0 / VERTICAL_SYNC);
+	bool slow = busy_us > period_us / 100 * DVFS_UP_PERCENT ||
+		(gb->direct.frame_skip && !fast_forward);
+
+#if ENABLE_SOUND
+	if(dvfs.i2s->underruns > dvfs.underruns)
+		slow = true;
+	dvfs.underruns = dvfs.i2s->underruns;
+#endif
 
-    fr=f_mount(&pSD->fatfs,pSD->pcName,1);
-    if (FR_OK!=fr) {
-        printf("E f_mount error: %s (%d)\n",FRESULT_str(fr),fr);
-        return 0;
-    }
+	if(fast_forward)
+	{
+		if(dvfs.state != 0)
+			dvfs_set(0);
+		return;
+	}
 
-	/* clear the filenames array */
-	for(uint8_t ifile=0;ifile<22;ifile++) {
-		strcpy(filename[ifile],"");
+	if(slow)
+	{
+		if(dvfs.state != 0)
+			dvfs_set(dvfs.state - 1);
+		return;
 	}
 
-    /* search *.gb files */
-	uint16_t num_file=0;
-	fr=f_findfirst(&dj, &fno, "", "*.gb");
+	if(busy_us > dvfs.window_max_us)
+		dvfs.window_max_us = busy_us;
+
+	if(++dvfs.window_frames < DVFS_WINDOW)
+		return;
+
+	if(dvfs.state + 1 < count_of(clock_states))
+	{
+		const struct clock_state *const cs = &clock_states[dvfs.state];
+		const uint64_t predicted_us = (uint64_t)dvfs.window_max_us *
+			clock_state_hz(cs) / clock_state_hz(cs + 1);
 
-	/* skip the first N pages */
-	if(num_page>0) {
-		while(num_file<num_page*22 && fr == FR_OK && fno.fname[0]) {
-			num_file++;
-			fr=f_findnext(&dj, &fno);
+		if(predicted_us < period_us / 100 * DVFS_DOWN_PERCENT)
+		{
+			dvfs_set(dvfs.state + 1);
+			return;
 		}
 	}
 
-	/* store the filenames of this page */
-	num_file=0;
-    while(num_file<22 && fr == FR_OK && fno.fname[0]) {
-		strcpy(filename[num_file],fno.fname);
-        num_file++;
-        fr=f_findnext(&dj, &fno);
-    }
-	f_closedir(&dj);
-	f_unmount(pSD->pcName);
-
-	/* display *.gb rom files on screen */
-	mk_ili9225_fill(0x0000);
-	for(uint8_t ifile=0;ifile<num_file;ifile++) {
-		mk_ili9225_text(filename[ifile],0,ifile*8,0xFFFF,0x0000);
-    }
-	return num_file;
+	dvfs.window_max_us = 0;
+	dvfs.window_frames = 0;
 }
 
 /**
- * The ROM selector displays pages of up to 22 rom files
- * allowing the user to select which rom file to start
- * Copy your *.gb rom files to the root directory of the SD card
+ * Start a game at the fastest clock state.
  */
-void rom_file_selector() {
-    uint16_t num_page;
-	char filename[22][256];
-	uint16_t num_file;
-	
-	/* display the first page with up to 22 rom files */
-	num_file=rom_file_selector_display_page(filename,num_page);
+static void dvfs_reset(void)
+{
+	if(dvfs.state != 0)
+		dvfs_set(0);
 
-	/* select the first rom */
-	uint8_t selected=0;
-	mk_ili9225_text(filename[selected],0,selected*8,0xFFFF,0xF800);
+	dvfs.window_max_us = 0;
+	dvfs.window_frames = 0;
+}
 
-	/* get user's input */
-	bool up,down,left,right,a,b,select,start;
-	while(true) {
-		up=gpio_get(GPIO_UP);
-		down=gpio_get(GPIO_DOWN);
-		left=gpio_get(GPIO_LEFT);
-		right=gpio_get(GPIO_RIGHT);
-		a=gpio_get(GPIO_A);
-		b=gpio_get(GPIO_B);
-		select=gpio_get(GPIO_SELECT);
-		start=gpio_get(GPIO_START);
-		if(!start) {
-			/* re-start the last game (no need to reprogram flash) */
-			break;
-		}
-		if(!a | !b) {
-			/* copy the rom from the SD card to flash and start the game */
-			load_cart_rom_file(filename[selected]);
-			break;
-		}
-		if(!down) {
-			/* select the next rom */
-			mk_ili9225_text(filename[selected],0,selected*8,0xFFFF,0x0000);
-			selected++;
-			if(selected>=num_file) selected=0;
-			mk_ili9225_text(filename[selected],0,selected*8,0xFFFF,0xF800);
-			sleep_ms(150);
-		}
-		if(!up) {
-			/* select the previous rom */
-			mk_ili9225_text(filename[selected],0,selected*8,0xFFFF,0x0000);
-			if(selected==0) {
-				selected=num_file-1;
-			} else {
-				selected--;
-			}
-			mk_ili9225_text(filename[selected],0,selected*8,0xFFFF,0xF800);
-			sleep_ms(150);
-		}
-		if(!right) {
-			/* select the next page */
-			num_page++;
-			num_file=rom_file_selector_display_page(filename,num_page);
-			if(num_file==0) {
-				/* no files in this page, go to the previous page */
-				num_page--;
-				num_file=rom_file_selector_display_page(filename,num_page);
-			}
-			/* select the first file */
-			selected=0;
-			mk_ili9225_text(filename[selected],0,selected*8,0xFFFF,0xF800);
-			sleep_ms(150);
-		}
-		if((!left) && num_page>0) {
-			/* select the previous page */
-			num_page--;
-			num_file=rom_file_selector_display_page(filename,num_page);
-			/* select the first file */
-			selected=0;
-			mk_ili9225_text(filename[selected],0,selected*8,0xFFFF,0xF800);
-			sleep_ms(150);
-		}
-		tight_loop_contents();
+static void dvfs_report(void)
+{
+	dvfs_account();
+
+	printf("Clock: %lu MHz, %lu changes\n",
+		clock_get_hz(clk_sys) / MHZ, dvfs.changes);
+	for(unsigned i = 0; i < count_of(clock_states); i++)
+	{
+		printf("Clock %lu MHz: %lu ms\n",
+			clock_state_hz(&clock_states[i]) / MHZ,
+			(uint32_t)(dvfs.state_us[i] / 1000));
+		dvfs.state_us[i] = 0;
 	}
-}
 
+	dvfs.changes = 0;
+}
 #endif
 
 int main(void)
@@ -566,12 +3845,11 @@ int main(void)
 	
 	/* Overclock. */
 	{
-		const unsigned vco = 1596*1000*1000;	/* 266MHz */
-		const unsigned div1 = 6, div2 = 1;
+		const struct clock_state *const cs = &clock_states[0];
 
-		vreg_set_voltage(VREG_VOLTAGE_1_15);
+		vreg_set_voltage(cs->vreg);
 		sleep_ms(2);
-		set_sys_clock_pll(vco, div1, div2);
+		set_sys_clock_pll(cs->vco, cs->div1, cs->div2);
 		sleep_ms(2);
 	}
 
@@ -591,8 +3869,13 @@ int main(void)
 	gpio_set_function(GPIO_SELECT, GPIO_FUNC_SIO);
 	gpio_set_function(GPIO_START, GPIO_FUNC_SIO);
 	gpio_set_function(GPIO_CS, GPIO_FUNC_SIO);
+#if !LCD_USE_PIO
 	gpio_set_function(GPIO_CLK, GPIO_FUNC_SPI);
 	gpio_set_function(GPIO_SDA, GPIO_FUNC_SPI);
+#endif
+#if MK_ILI9225_READ_AVAILABLE
+	gpio_set_function(GPIO_SDO, GPIO_FUNC_SPI);
+#endif
 	gpio_set_function(GPIO_RS, GPIO_FUNC_SIO);
 	gpio_set_function(GPIO_RST, GPIO_FUNC_SIO);
 	gpio_set_function(GPIO_LED, GPIO_FUNC_SIO);
@@ -620,36 +3903,60 @@ int main(void)
 	gpio_pull_up(GPIO_B);
 	gpio_pull_up(GPIO_SELECT);
 	gpio_pull_up(GPIO_START);
+#if ENABLE_JOYPAD_IRQ
+	joypad_irq_init();
+#endif
 
 	/* Set SPI clock to use high frequency. */
-	clock_configure(clk_peri, 0,
-			CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS,
-			125 * 1000 * 1000, 125 * 1000 * 1000);
+	clk_peri_update();
+#if ENABLE_LINK
+	link_init();
+#endif
+#if LCD_USE_PIO
+	{
+		const uint offset = pio_add_program(LCD_PIO, &lcd_spi_program);
+
+		lcd_pio_sm = pio_claim_unused_sm(LCD_PIO, true);
+		lcd_spi_program_init(LCD_PIO, lcd_pio_sm, offset, GPIO_SDA,
+			GPIO_CLK, lcd_pio_clkdiv(clock_get_hz(clk_sys)));
+	}
+#else
 	spi_init(spi0, 30*1000*1000);
 	spi_set_format(spi0, 16, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+#endif
 
 #if ENABLE_SOUND
-	// Allocate memory for the stream buffer
-	stream=malloc(AUDIO_BUFFER_SIZE_BYTES);
-    assert(stream!=NULL);
-    memset(stream,0,AUDIO_BUFFER_SIZE_BYTES);  // Zero out the stream buffer
-	
-	// Initialize I2S sound driver
-	i2s_config_t i2s_config = i2s_get_default_config();
+	// Initialize I2S sound driver. Used by the DMA interrupt.
+	static i2s_config_t i2s_config;
+	i2s_config = i2s_get_default_config();
 	i2s_config.sample_freq=AUDIO_SAMPLE_RATE;
 	i2s_config.dma_trans_count =AUDIO_SAMPLES;
+	i2s_config.dma_buf_count =AUDIO_BUFFER_COUNT;
 	i2s_volume(&i2s_config,2);
 	i2s_init(&i2s_config);
+#if ENABLE_DVFS
+	dvfs.i2s = &i2s_config;
+#endif
 #endif
 
 while(true)
 {
+	bool fast_booted = false;
+
 #if ENABLE_LCD
 #if ENABLE_SDCARD
-	/* ROM File selector */
-	mk_ili9225_init();
-	mk_ili9225_fill(0x0000);
-	rom_file_selector();
+#if ENABLE_FAST_BOOT
+	if(fast_boot())
+		fast_booted = true;
+	else
+#endif
+	{
+		/* ROM File selector */
+		mk_ili9225_init();
+		lcd_initialised = true;
+		mk_ili9225_fill(0x0000);
+		rom_file_selector();
+	}
 #endif
 #endif
 
@@ -665,12 +3972,42 @@ while(true)
 		goto out;
 	}
 
+	/* Read ROM banks through direct pointers. */
+	gb_set_rom_bank_ptr(&gb, &gb_rom_bank_ptr);
+#if ENABLE_LINK
+	link_reset(&gb);
+#endif
+#if ENABLE_DVFS
+	dvfs_reset();
+#endif
+
 	/* Automatically assign a colour palette to the game */
 	char rom_title[16];
 	auto_assign_palette(palette, gb_colour_hash(&gb),gb_get_rom_name(&gb,rom_title));
+#if ENABLE_LCD
+	palette_update();
+#endif
+	
+#if ENABLE_SOUND
+	// Initialize audio emulation. Must be done before core 1 is started.
+	audio_init();
+#if MINIGB_APU_WRITE_LOG
+	audio_gb = &gb;
+	core1_i2s = &i2s_config;
+#endif
 	
+	putstdio("AUDIO ");
+#endif
+
 #if ENABLE_LCD
 	gb_init_lcd(&gb, &lcd_draw_line);
+	lcd_ring_head = 0;
+	lcd_ring_tail = 0;
+#if PEANUT_GB_SPLIT_RENDER
+	/* Render lines on core 1. */
+	core1_gb = &gb;
+	gb_set_split_render(&gb, &lcd_queue_line, &lcd_wait_line);
+#endif
 
 	/* Start Core1, which processes requests to the LCD. */
 	putstdio("CORE1 ");
@@ -679,97 +4016,236 @@ while(true)
 	putstdio("LCD ");
 #endif
 
-#if ENABLE_SOUND
-	// Initialize audio emulation
-	audio_init();
-	
-	putstdio("AUDIO ");
+#if ENABLE_SDCARD && ENABLE_ROM_STREAMING
+	/* Only banks past bank 0 are streamed, so the file is opened while
+	 * core 1 initialises the LCD. */
+	rom_stream_open();
 #endif
-
 #if ENABLE_SDCARD
 	/* Load Save File. */
 	read_cart_ram_file(&gb);
 #endif
+#if ENABLE_SDCARD && ENABLE_SAVE_STATES
+	if(state_scan(&gb) && fast_booted && FAST_BOOT_RESUME_STATE)
+		state_load(&gb,state_slot);
+#endif
+#if ENABLE_SDCARD && ENABLE_REWIND
+	rewind_reset();
+	bool rewinding = false;
+#endif
 
 	putstdio("\n> ");
+	if(fast_booted)
+		printf("I fast boot in %lu ms\n",
+			(uint32_t)(time_us_64() / 1000));
 	uint_fast32_t frames = 0;
 	uint64_t start_time = time_us_64();
+#if ENABLE_FRAME_PACER
+	frame_pacer_start();
+#endif
+#if ENABLE_PROFILER
+	profile_start();
+#endif
 	while(1)
 	{
 		int input;
+#if AUTO_FRAME_SKIP_MAX || ENABLE_DVFS
+		const uint64_t frame_start = time_us_64();
+#endif
+		PROFILE_BEGIN(PROFILE_FRAME);
+#if ENABLE_REPLAY
+		const uint32_t replay_frame_start = time_us_32();
+#endif
+
+#if ENABLE_SDCARD && ENABLE_REWIND
+		if(rewinding)
+			rewind_step(&gb);
+#endif
 
 		gb.gb_frame = 0;
+#if ENABLE_JOYPAD_IRQ && ENABLE_REPLAY
+		const bool replaying = replay.active;
+#elif ENABLE_JOYPAD_IRQ
+		const bool replaying = false;
+#endif
 
+		PROFILE_BEGIN(PROFILE_CPU);
 		do {
 			__gb_step_cpu(&gb);
-			tight_loop_contents();
+#if ENABLE_JOYPAD_IRQ
+			/* Buttons are passed to the game as soon as they change,
+			 * unless the joypad is replayed. */
+			if(HEDLEY_UNLIKELY(joypad_pending) && !replaying)
+				joypad_update(&gb);
+#endif
 		} while(HEDLEY_LIKELY(gb.gb_frame == 0));
+		PROFILE_END(PROFILE_CPU);
 
 		frames++;
-#if ENABLE_SOUND
-		if(!gb.direct.frame_skip) {
-			audio_callback(NULL, stream, AUDIO_BUFFER_SIZE_BYTES);
-			i2s_dma_write(&i2s_config, stream);
+#if AUTO_FRAME_SKIP_MAX
+		if(!fast_forward)
+			auto_frame_skip_update(&gb, time_us_64() - frame_start);
+#endif
+#if ENABLE_SDCARD && ENABLE_REWIND
+		if(!rewinding)
+			rewind_frame_end(&gb);
+#else
+		const bool rewinding = false;
+#endif
+#if ENABLE_SOUND && MINIGB_APU_WRITE_LOG
+		/* Samples of the frame are generated on core 1. While fast
+		 * forwarding, only the audio of drawn frames is played. */
+		audio_frame_end(!rewinding && (!fast_forward || frame_drawn(&gb)));
+#elif ENABLE_SOUND
+		/* Audio is still generated for skipped frames, unless rewinding.
+		 * While fast forwarding, only drawn frames are played. */
+		if(!rewinding && (!fast_forward || frame_drawn(&gb))) {
+			/* Samples are generated straight into the DMA ring. */
+			PROFILE_BEGIN(PROFILE_I2S_WAIT);
+			int16_t *const buf = i2s_dma_get_buffer(&i2s_config);
+			PROFILE_END(PROFILE_I2S_WAIT);
+
+			PROFILE_BEGIN(PROFILE_AUDIO);
+			audio_callback(NULL, buf, AUDIO_BUFFER_SIZE_BYTES);
+			PROFILE_END(PROFILE_AUDIO);
+			i2s_dma_commit(&i2s_config);
+		}
+#endif
+#if ENABLE_DVFS
+		/* Writes to the SD card only fill the time left, so are not
+		 * counted. */
+		const uint32_t frame_busy_us = time_us_64() - frame_start;
+#endif
+#if ENABLE_SDCARD && (ENABLE_AUTOSAVE || ENABLE_SAVE_STATES)
+		/* Write to the SD card in the time left before the next frame. */
+#if ENABLE_FRAME_PACER
+		if(!fast_forward && frame_pacer_due==0)
+#else
+		if(!fast_forward)
+#endif
+		{
+#if ENABLE_SAVE_STATES
+			if(state_write.pending)
+				state_write_step();
+			else
+#endif
+			{
+#if ENABLE_AUTOSAVE
+				autosave_frame();
+#endif
+			}
 		}
 #endif
+#if ENABLE_REPLAY
+		if(replay.recording)
+			replay_record(gb.direct.joypad);
+		if(replay.active &&
+			!replay_frame_end(&gb, time_us_32() - replay_frame_start))
+			goto out;
+#endif
+#if ENABLE_LINK
+		link_frame_end();
+#endif
+#if ENABLE_FRAME_PACER
+		frame_pacer_wait(&gb);
+#endif
+#if ENABLE_DVFS
+		dvfs_frame_end(&gb, frame_busy_us);
+#endif
+#if ENABLE_PROFILER
+		PROFILE_END(PROFILE_FRAME);
+		profile_frame_end();
+#endif
 
 		/* Update buttons state */
-		prev_joypad_bits.up=gb.direct.joypad_bits.up;
-		prev_joypad_bits.down=gb.direct.joypad_bits.down;
-		prev_joypad_bits.left=gb.direct.joypad_bits.left;
-		prev_joypad_bits.right=gb.direct.joypad_bits.right;
-		prev_joypad_bits.a=gb.direct.joypad_bits.a;
-		prev_joypad_bits.b=gb.direct.joypad_bits.b;
-		prev_joypad_bits.select=gb.direct.joypad_bits.select;
-		prev_joypad_bits.start=gb.direct.joypad_bits.start;
-		gb.direct.joypad_bits.up=gpio_get(GPIO_UP);
-		gb.direct.joypad_bits.down=gpio_get(GPIO_DOWN);
-		gb.direct.joypad_bits.left=gpio_get(GPIO_LEFT);
-		gb.direct.joypad_bits.right=gpio_get(GPIO_RIGHT);
-		gb.direct.joypad_bits.a=gpio_get(GPIO_A);
-		gb.direct.joypad_bits.b=gpio_get(GPIO_B);
-		gb.direct.joypad_bits.select=gpio_get(GPIO_SELECT);
-		gb.direct.joypad_bits.start=gpio_get(GPIO_START);
+		joypad_update(&gb);
+
+#if ENABLE_SDCARD && ENABLE_REWIND
+		/* start + up: rewind while held */
+		rewinding=!gb.direct.joypad_bits.start && !gb.direct.joypad_bits.up
+			&& gb.direct.joypad_bits.select;
+#endif
 
 		/* hotkeys (select + * combo)*/
 		if(!gb.direct.joypad_bits.select) {
 #if ENABLE_SOUND
-			if(!gb.direct.joypad_bits.up && prev_joypad_bits.up) {
+			if(!gb.direct.joypad_bits.up && prev_joypad.bits.up) {
 				/* select + up: increase sound volume */
 				i2s_increase_volume(&i2s_config);
 			}
-			if(!gb.direct.joypad_bits.down && prev_joypad_bits.down) {
+			if(!gb.direct.joypad_bits.down && prev_joypad.bits.down) {
 				/* select + down: decrease sound volume */
 				i2s_decrease_volume(&i2s_config);
 			}
 #endif
-			if(!gb.direct.joypad_bits.right && prev_joypad_bits.right) {
+			if(!gb.direct.joypad_bits.right && prev_joypad.bits.right) {
 				/* select + right: select the next manual color palette */
 				if(manual_palette_selected<12) {
 					manual_palette_selected++;
 					manual_assign_palette(palette,manual_palette_selected);
+#if ENABLE_LCD
+					palette_update();
+					lcd_invalidate();
+#endif
 				}	
 			}
-			if(!gb.direct.joypad_bits.left && prev_joypad_bits.left) {
+			if(!gb.direct.joypad_bits.left && prev_joypad.bits.left) {
 				/* select + left: select the previous manual color palette */
 				if(manual_palette_selected>0) {
 					manual_palette_selected--;
 					manual_assign_palette(palette,manual_palette_selected);
+#if ENABLE_LCD
+					palette_update();
+					lcd_invalidate();
+#endif
 				}
 			}
-			if(!gb.direct.joypad_bits.start && prev_joypad_bits.start) {
+			if(!gb.direct.joypad_bits.start && prev_joypad.bits.start) {
 				/* select + start: save ram and resets to the game selection menu */
-#if ENABLE_SDCARD				
-				write_cart_ram_file(&gb);
-#endif				
 				goto out;
 			}
-			if(!gb.direct.joypad_bits.a && prev_joypad_bits.a) {
-				/* select + A: enable/disable frame-skip => fast-forward */
-				gb.direct.frame_skip=!gb.direct.frame_skip;
-				printf("I gb.direct.frame_skip = %d\n",gb.direct.frame_skip);
+#if ENABLE_SDCARD && ENABLE_SAVE_STATES
+			if(!gb.direct.joypad_bits.b && prev_joypad.bits.b) {
+				/* select + B: save the state of the current slot */
+				state_save(&gb,state_slot);
+			}
+#endif
+			if(!gb.direct.joypad_bits.a && prev_joypad.bits.a) {
+				/* select + A: select the next fast-forward speed */
+				turbo_next(&gb);
+			}
+		}
+#if ENABLE_SDCARD && ENABLE_SAVE_STATES
+		/* hotkeys (start + * combo) */
+		else if(!gb.direct.joypad_bits.start) {
+			if(!gb.direct.joypad_bits.b && prev_joypad.bits.b) {
+				/* start + B: load the state of the current slot */
+#if ENABLE_REWIND
+				if(state_load(&gb,state_slot))
+					rewind_reset();
+#else
+				state_load(&gb,state_slot);
+#endif
+			}
+			if(!gb.direct.joypad_bits.right && prev_joypad.bits.right) {
+				/* start + right: select the next save state slot */
+				state_slot=(state_slot+1)%STATE_SLOTS;
+				printf("I save state slot %u\n",state_slot);
+			}
+			if(!gb.direct.joypad_bits.left && prev_joypad.bits.left) {
+				/* start + left: select the previous save state slot */
+				state_slot=(state_slot+STATE_SLOTS-1)%STATE_SLOTS;
+				printf("I save state slot %u\n",state_slot);
 			}
 		}
+#endif
+		prev_joypad.joypad=gb.direct.joypad;
+
+#if ENABLE_REPLAY
+		/* Buttons only act as hotkeys while replaying. */
+		if(replay.active)
+			gb_set_joypad(&gb, replay.joypad);
+#endif
 
 		/* Serial monitor commands */ 
 		input = getchar_timeout_us(0);
@@ -813,7 +4289,7 @@ while(true)
 			break;
 
 		case 'f':
-			gb.direct.frame_skip = !gb.direct.frame_skip;
+			turbo_next(&gb);
 			break;
 
 		case 'b':
@@ -821,6 +4297,10 @@ while(true)
 			uint64_t end_time;
 			uint32_t diff;
 			uint32_t fps;
+#if PEANUT_GB_FAST_HALT
+			uint64_t cycles;
+			uint32_t halted;
+#endif
 
 			end_time = time_us_64();
 			diff = end_time-start_time;
@@ -829,6 +4309,94 @@ while(true)
 				"Time: %lu us\n"
 				"FPS: %lu\n",
 				frames, diff, fps);
+#if PEANUT_GB_FAST_HALT
+			/* Percentage of emulated cycles spent halted. */
+			cycles = (uint64_t)frames * LCD_LINE_CYCLES * LCD_VERT_LINES;
+			halted = cycles ? (gb.counter.halt_cycles * 100ULL) / cycles : 0;
+			printf("Halted: %lu%%\n", halted);
+			gb.counter.halt_cycles = 0;
+#endif
+#if ENABLE_LCD
+			printf("LCD ring stalls: %lu (%lu us)\n",
+				lcd_ring_stalls, (uint32_t)lcd_ring_stall_us);
+			lcd_ring_stalls = 0;
+			lcd_ring_stall_us = 0;
+# if PEANUT_GB_SPLIT_RENDER
+			printf("LCD ring drains: %lu (%lu us, %lu us per frame)\n",
+				lcd_ring_drains, (uint32_t)lcd_ring_drain_us,
+				frames ? (uint32_t)(lcd_ring_drain_us / frames) : 0);
+			lcd_ring_drains = 0;
+			lcd_ring_drain_us = 0;
+# endif
+# if LCD_SKIP_UNCHANGED_LINES
+			printf("LCD lines skipped: %lu\n", lcd_lines_skipped);
+			lcd_lines_skipped = 0;
+# endif
+#endif
+#if ENABLE_FRAME_PACER
+			printf("Frames late: %lu, dropped: %lu\n",
+				frame_pacer_late, frame_pacer_dropped);
+			frame_pacer_late = 0;
+			frame_pacer_dropped = 0;
+#endif
+#if ENABLE_SOUND
+			printf("Audio underruns: %lu\n", i2s_config.underruns);
+			i2s_config.underruns = 0;
+#endif
+#if ENABLE_SDCARD && ENABLE_REWIND
+			printf("Rewind: %lu snapshots in %lu bytes, capture %lu us avg, %lu us max\n",
+				rewind_history.count, rewind_history.used,
+				rewind_history.captures ?
+				rewind_history.capture_us / rewind_history.captures : 0,
+				rewind_history.capture_max_us);
+			rewind_history.captures = 0;
+			rewind_history.capture_us = 0;
+			rewind_history.capture_max_us = 0;
+#endif
+#if ENABLE_SDCARD && ENABLE_ROM_STREAMING
+			if(rom_stream.open)
+			{
+				printf("ROM streamed bank switches: %lu, chunk reads: %lu (%lu us avg, %lu us max)\n",
+					rom_stream.switches, rom_stream.faults,
+					rom_stream.faults ?
+					(uint32_t)(rom_stream.fault_us / rom_stream.faults) : 0,
+					rom_stream.fault_max_us);
+				rom_stream.switches = 0;
+				rom_stream.faults = 0;
+				rom_stream.fault_us = 0;
+				rom_stream.fault_max_us = 0;
+			}
+#endif
+#if ENABLE_LINK
+			printf("Link %s: %lu transfers, %lu errors\n"
+				"Link stalls: %lu (%lu us avg, %lu us max), timeouts: %lu\n"
+				"Link latency: %lu us avg, %lu us max\n",
+				link_connected() ? "up" : "down",
+				link_cable.transfers, link_cable.errors,
+				link_cable.stalls, link_cable.stalls ?
+				link_cable.stall_us / link_cable.stalls : 0,
+				link_cable.stall_max_us, link_cable.timeouts,
+				link_cable.latencies ?
+				link_cable.latency_us / link_cable.latencies : 0,
+				link_cable.latency_max_us);
+			link_cable.transfers = 0;
+			link_cable.errors = 0;
+			link_cable.stalls = 0;
+			link_cable.stall_us = 0;
+			link_cable.stall_max_us = 0;
+			link_cable.timeouts = 0;
+			link_cable.latencies = 0;
+			link_cable.latency_us = 0;
+			link_cable.latency_max_us = 0;
+#endif
+#if ENABLE_DVFS
+			dvfs_report();
+#endif
+#if AUTO_FRAME_SKIP_MAX
+			printf("Frames skipped: %lu (ratio %u)\n", frames_skipped,
+				gb.direct.frame_skip ? gb.direct.frame_skip_ratio : 0);
+			frames_skipped = 0;
+#endif
 			stdio_flush();
 			frames = 0;
 			start_time = time_us_64();
@@ -885,6 +4453,47 @@ while(true)
 			break;
 		}
 
+#if ENABLE_SDCARD
+		case 's':
+#if ENABLE_SAVE_STATES
+			state_write_finish();
+#endif
+			sd_benchmark();
+			break;
+#endif
+
+#if ENABLE_PROFILER
+		case 'p':
+			profile_report();
+			break;
+#endif
+
+#if ENABLE_REPLAY
+		case 'R':
+			if(replay.recording)
+			{
+				replay_record_stop();
+				break;
+			}
+			replay_reset(&gb);
+			replay.recording = true;
+			puts("# joypad trace");
+			break;
+
+		case 'r':
+			if(replay.recording)
+				replay_record_stop();
+			if(replay_read())
+				replay_start(&gb);
+			break;
+#endif
+
+#if PEANUT_GB_HEATMAP
+		case 'h':
+			heatmap_dump(&gb);
+			break;
+#endif
+
 		case 'q':
 			goto out;
 
@@ -894,8 +4503,27 @@ while(true)
 	}
 out:
 	puts("\nEmulation Ended");
+#if ENABLE_SDCARD
+#if ENABLE_SAVE_STATES
+	state_write_finish();
+#endif
+	/* Save what the autosave has not saved yet. */
+	write_cart_ram_file(&gb);
+# if ENABLE_ROM_STREAMING
+	rom_stream_close();
+# endif
+#endif
 	/* stop lcd task running on core 1 */
 	multicore_reset_core1(); 
+#if ENABLE_LCD
+	lcd_initialised = false;
+#endif
+#if ENABLE_LCD && USE_DMA
+	lcd_dma_stop();
+#endif
+#if ENABLE_FRAME_PACER
+	frame_pacer_stop();
+#endif
 
 }
 
@@ -604,7 +604,10 @@ void mk_ili9225_blit(uint16_t *fbuf,uint8_t x,uint8_t y,uint8_t w,uint8_t h) {
 	mk_ili9225_set_cs(1);
 }
 
-void mk_ili9225_get_letter(uint16_t *fbuf,char l,uint16_t color,uint16_t bgcolor) {
+/**
+ * Draw the letter into fbuf, which is "stride" pixels wide
+ */
+static void mk_ili9225_put_letter(uint16_t *fbuf,uint16_t stride,char l,uint16_t color,uint16_t bgcolor) {
 	uint8_t letter[8];
 	uint8_t row;
 	
@@ -1074,6 +1077,20 @@ void mk_ili9225_get_letter(uint16_t *fbuf,char l,uint16_t color,uint16_t bgcolor
 			break;
 		}
 
+		case '/':
+		{
+			const uint8_t letter_[8]={0b00000110,
+						              0b00001100,
+						              0b00001100,
+									  0b00011000,
+						              0b00110000,
+						              0b00110000,
+						              0b01100000,
+						              0b00000000};
+			memcpy(letter,letter_,8);
+			break;
+		}
+
 		case '!':
 		{
 			const uint8_t letter_[8]={0b00011000,
@@ -1275,23 +1292,31 @@ void mk_ili9225_get_letter(uint16_t *fbuf,char l,uint16_t color,uint16_t bgcolor
 		row=letter[y];
 		for(uint8_t x=0;x<8;x++) {
 			if(row & 128) {
-				fbuf[y*8+x]=color;
+				fbuf[y*stride+x]=color;
 			} else {
-				fbuf[y*8+x]=bgcolor;
+				fbuf[y*stride+x]=bgcolor;
 			}
 			row=row<<1;
 		}
 	}
 }
 
+void mk_ili9225_get_letter(uint16_t *fbuf,char l,uint16_t color,uint16_t bgcolor) {
+	mk_ili9225_put_letter(fbuf,8,l,color,bgcolor);
+}
+
 void mk_ili9225_text(char *s,uint8_t x,uint8_t y,uint16_t color,uint16_t bgcolor) {
-	uint16_t fbuf[8*8];
-	for(uint8_t i=0;i<strlen(s);i++) {
-		mk_ili9225_get_letter(fbuf,s[i],color,bgcolor);
-		mk_ili9225_blit(fbuf,x,y,8,8);
-		x+=8;
-		if(x>27*8) {
-			break;
-		}
+	/* the whole row is drawn in one buffer and sent with a single blit */
+	static uint16_t fbuf[MK_ILI9225_TEXT_MAX*8*8];
+	uint8_t n=0;
+	while(s[n] && n<MK_ILI9225_TEXT_MAX && x+(n+1)*8<=SCREEN_SIZE_Y) {
+		n++;
 	}
-}
\ No newline at end of file
+	if(n==0) {
+		return;
+	}
+	for(uint8_t i=0;i<n;i++) {
+		mk_ili9225_put_letter(fbuf+i*8,n*8,s[i],color,bgcolor);
+	}
+	mk_ili9225_blit(fbuf,x,y,n*8,8);
+}